@@ -0,0 +1,86 @@
+#!../../bin/linux-x86_64/usbMouseTest
+
+#############################################################################
+# Transport comparison benchmark
+# Needs write access to /dev/uhid and to the hidraw and input device nodes.
+< envPaths
+epicsEnvSet(VENDOR, "$(VENDOR=0x1209)")
+epicsEnvSet(PRODUCT, "$(PRODUCT=0x0001)")
+
+cd "$(TOP)"
+
+#############################################################################
+# Register support components
+dbLoadDatabase "dbd/usbMouseTest.dbd"
+usbMouseTest_registerRecordDeviceDriver pdbbase
+
+#############################################################################
+# Create the virtual mouse before the ports look for it
+#usbMouseBenchDevice(vendor, product, uhid/gadget, UDC)
+usbMouseBenchDevice($(VENDOR), $(PRODUCT), "uhid")
+# Or, to reach the libusb transports too, on a virtual USB bus
+# (modprobe dummy_hcd raw_gadget; needs write access to /dev/raw-gadget
+# and to the usbfs device node)
+#usbMouseBenchDevice($(VENDOR), $(PRODUCT), "gadget", "dummy_udc.0")
+epicsThreadSleep(1)
+
+#############################################################################
+# Uncomment to serve the ports from a shared event loop pool
+#usbMouseLoopPool(threads, rebalance period, priority)
+#usbMouseLoopPool(2, 5, 0)
+# and, to compare busy polling with blocking, uncomment the second
+# benchmark run below
+
+#############################################################################
+# Uncomment to hold a PM QoS request and set timer slack while any port
+# reads more than 1000 reports/s (needs write access to /dev/cpu_dma_latency)
+#usbMousePowerQos(threshold, latency(us), timer slack(ns), hold(s))
+#usbMousePowerQos(1000, 0, 1000, 5)
+
+#############################################################################
+# Configure one port per transport under test
+#usbMouseConfigure(port, vendor, product, number, interval, priority, transport)
+usbMouseConfigure("BH", $(VENDOR), $(PRODUCT), 0, 0, 0, "hidraw")
+usbMouseConfigure("BE", $(VENDOR), $(PRODUCT), 0, 0, 0, "evdev")
+# Libusb ports need the gadget device, and take it from the kernel drivers
+#usbMouseConfigure("BI", $(VENDOR), $(PRODUCT), 0, 0, 0, "interrupt")
+#usbMouseConfigure("BC", $(VENDOR), $(PRODUCT), 0, 1, 0, "control")
+
+#############################################################################
+# Uncomment for the multi-port throughput benchmark: free-running sim
+# ports, each with a publish stage on a thread of its own
+#usbMouseConfigure("T1", 0, 0, 0, 0, 0, "sim")
+#usbMouseSetClock("T1", "virtual", 0)
+#usbMouseStage("T1", "raw", 0, "")
+#usbMouseStage("T1", "decode", 0, "")
+#usbMouseStage("T1", "publish", 1000, "")
+#usbMouseConfigure("T2", 0, 0, 0, 0, 0, "sim")
+#usbMouseSetClock("T2", "virtual", 0)
+#usbMouseStage("T2", "raw", 0, "")
+#usbMouseStage("T2", "decode", 0, "")
+#usbMouseStage("T2", "publish", 1000, "")
+
+#############################################################################
+# Uncomment to compare batched with per-sample dispatch to records
+#usbMouseDispatchBenchmark(ports, samples per wakeup, seconds)
+#usbMouseDispatchBenchmark(100, 4, 2)
+
+#############################################################################
+# Start EPICS
+cd "$(TOP)/iocBoot/$(IOC)"
+iocInit
+
+#usbMouseBenchmark(ports, rates, seconds per rate, histogram)
+usbMouseBenchmark("BH BE", "125 500 1000 8000", 5, 1)
+
+# Loop threads spin for 200 us after each report before parking, and
+# are pinned to CPUs 2 and up (isolcpus=2,3 for best results)
+#usbMouseLoopBusyPoll(spin(us), first cpu)
+#usbMouseLoopBusyPoll(200, 2)
+#usbMouseBenchmark("BH BE", "125 500 1000 8000", 5, 1)
+
+# Gadget faults: stall, drop, short, disconnect (count is ms) or clear
+#usbMouseGadgetFault("disconnect", 500)
+
+#usbMouseThroughput(ports, seconds)
+#usbMouseThroughput("T1 T2", 5)
@@ -30,17 +30,79 @@ cd "$(TOP)"
 dbLoadDatabase "dbd/usbMouseTest.dbd"
 usbMouseTest_registerRecordDeviceDriver pdbbase
 
+#############################################################################
+# Keep an inventory of the USB HID devices for the libusb transports
+#usbMouseDiscovery(port, refresh)
+#usbMouseDiscovery("USB", 2)
+#dbLoadRecords("db/usbMouseDiscovery.db","P=$(P),PORT=USB")
+
 #############################################################################
 # Configure port
-#usbMouseConfigure(port, vendor, product, number, interval, priority)
-usbMouseConfigure("$(PORT)", $(VENDOR), $(PRODUCT), 0, 0, 0)
+#usbMouseConfigure(port, vendor, product, number, interval, priority, transport)
+usbMouseConfigure("$(PORT)", $(VENDOR), $(PRODUCT), 0, 0, 0, "control")
 asynSetTraceIOMask("$(PORT)", 2000 ,0x4)
+# Or read interrupt reports and check the button levels every 2 seconds
+#usbMouseConfigure("$(PORT)", $(VENDOR), $(PRODUCT), 0, 0, 0, "interrupt resync=2")
+
+# A simulated mouse running on virtual time
+#usbMouseConfigure("SIM", 0, 0, 0, 1, 0, "sim radius=50 period=200 count=3600000")
+#usbMouseSetClock("SIM", "virtual", 0)
+
+# Replay an evemu-record capture at four times its recorded speed
+#usbMouseConfigure("REPLAY", 0, 0, 0, 0, 0, "replay file=/tmp/mouse.evemu speed=4")
 # Uncomment the following line to enable readback data display
 #asynSetTraceMask("$(PORT)", 2000, 0x9)
 
+# Processing pipeline -- the default is "raw", "decode" and "publish"
+#usbMouseStage(port, stage, queue size, arguments)
+#usbMouseStage("$(PORT)", "decode", 0, "")
+# 800 counts per inch to millimetres, fractions of a count carried over
+#usbMouseStage("$(PORT)", "scale", 0, "x=25.4/800 y=-25.4/800")
+#dbLoadRecords("db/usbMouseScale.db","P=$(P),R=$(R),PORT=$(PORT),EGU=mm")
+#usbMouseStage("$(PORT)", "filter", 0, "rate=50")
+#usbMouseStage("$(PORT)", "derive", 0, "smoothing=0.5")
+#usbMouseStage("$(PORT)", "simplify", 0, "tolerance=2 latency=0.5")
+#usbMouseStage("$(PORT)", "histogram", 0, "nx=100 ny=100 xmin=-5000 xmax=5000")
+#dbLoadRecords("db/usbMouseHistogram.db","P=$(P),R=$(R),PORT=$(PORT),NX=100,NY=100,NBINS=10000")
+#usbMouseStage("$(PORT)", "capture", 0, "prefix=/tmp/mouse_ prealloc=4")
+#usbMouseStage("$(PORT)", "capture", 0, "prefix=/data/mouse_ block=256 blocks=32 direct=1")
+#dbLoadRecords("db/usbMouseCapture.db","P=$(P),R=$(R),PORT=$(PORT)")
+#usbMouseStage("$(PORT)", "publish", 16, "")
+
+# Native device support in place of asyn for the basic records.  To
+# compare, run the SIM port above with "publish" and usbMouse.db, then
+# with "native" and usbMouseNative.db, and after iocInit run
+# usbMouseStageTiming("SIM", 10)
+#usbMouseStage("$(PORT)", "decode", 0, "")
+#usbMouseStage("$(PORT)", "native", 0, "")
+#dbLoadRecords("db/usbMouseNative.db","P=$(P),R=$(R),PORT=$(PORT)")
+
+# Jog two motors, holding the left button to move and pressing the
+# right button to switch between velocity and position mode
+#usbMouseStage("$(PORT)", "decode", 0, "")
+#usbMouseStage("$(PORT)", "jog", 0, "rate=10 gain=0.001 deadband=20 accel=0.5 enable=0 select=1 mode=1")
+#usbMouseStage("$(PORT)", "publish", 0, "")
+#dbLoadRecords("db/usbMouseJog.db","P=$(P),R=$(R),PORT=$(PORT),OUT_X=m1.RLV,OUT_Y=m2.RLV")
+
+# Use a dial as a rotary encoder of 1024 counts per turn on its wheel,
+# homed by the middle button or by an index mark PV
+#usbMouseStage("$(PORT)", "decode", 0, "")
+#usbMouseStage("$(PORT)", "encoder", 0, "wheel=1024 home=2")
+#usbMouseStage("$(PORT)", "publish", 0, "")
+#dbLoadRecords("db/usbMouseEncoder.db","P=$(P),R=$(R),PORT=$(PORT),AXIS=Wheel,HOME_DOL=index CP,HOME_OMSL=closed_loop")
+#dbLoadRecords("db/usbMouseEncoder64.db","P=$(P),R=$(R),PORT=$(PORT),AXIS=Wheel")
+
+# Latch the position at each camera frame, signalled by EPICS event 10
+# with the frame time from timing event 10
+#usbMouseStage("$(PORT)", "decode", 0, "")
+#usbMouseStage("$(PORT)", "latch", 0, "depth=512 span=0.008")
+#usbMouseStage("$(PORT)", "publish", 0, "")
+#dbLoadRecords("db/usbMouseLatch.db","P=$(P),R=$(R),PORT=$(PORT),SCAN=Event,EVNT=10,TSEV=10")
+
 #############################################################################
 # Load record instances
 dbLoadRecords("db/usbMouse.db","P=$(P),R=$(R),PORT=$(PORT)")
+#dbLoadRecords("db/usbMouseGroup.db","P=$(P),R=$(R),PORT=$(PORT)")
 
 #############################################################################
 # Start EPICS
@@ -49,3 +111,4 @@ iocInit
 
 epicsThreadSleep(2)
 asynReport(2,"$(PORT)")
+#usbMouseCaptureBenchmark("$(PORT)", 10)
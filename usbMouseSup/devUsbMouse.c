@@ -0,0 +1,386 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Native device support -- DTYP "usbMouse"
+ *
+ * An alternative to the asyn device support for the highest record
+ * update rates.  A "native" stage in the port's pipeline keeps a
+ * snapshot of the latest sample, and each field of the sample has an
+ * I/O Intr scan list of its own.  When a field changes the stage just
+ * calls scanIoRequest for it; there is no interrupt list to walk and no
+ * callback per record.  Records read the field from the snapshot when
+ * they process, so a record that falls behind shows the newest value.
+ *
+ * Records name the port and the field, by its asyn address or name:
+ *      field(INP, "@M0 10")
+ *      field(INP, "@M0 X")
+ *   bi         buttons, addresses 0 to 7
+ *   longin     X, Y and wheel, addresses 10 to 12
+ *   ai         X and Y velocity, addresses 13 and 14
+ *   waveform   the whole sample, address 15, FTVL LONG
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsStdio.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <epicsExport.h>
+#include <cantProceed.h>
+#include <alarm.h>
+#include <dbAccess.h>
+#include <dbScan.h>
+#include <devSup.h>
+#include <recGbl.h>
+#include <menuFtype.h>
+#include <biRecord.h>
+#include <longinRecord.h>
+#include <aiRecord.h>
+#include <waveformRecord.h>
+
+#include "usbMousePvt.h"
+
+#define NATIVE_NADDR    (USBMOUSE_ADDR_SAMPLE + 1)
+
+typedef struct nativePvt {
+    drvPvt         *pdpvt;
+    epicsMutexId    lock;
+    int             havePublished;
+    epicsTimeStamp  time;
+    mouseValues     values;
+    double          xVelocity;
+    double          yVelocity;
+    IOSCANPVT       ioscan[NATIVE_NADDR];
+    int             recordCount;
+    unsigned long   scanRequests;
+} nativePvt;
+
+/*
+ * Per-record private storage
+ */
+typedef struct devPvt {
+    nativePvt      *native;
+    int             addr;
+} devPvt;
+
+/*
+ * Native stage
+ */
+static nativePvt *
+findNative(drvPvt *pdpvt)
+{
+    usbMouseStage *stage;
+
+    for (stage = pdpvt->pipeline ; stage != NULL ; stage = stage->next) {
+        if (stage->type == &usbMouseNativeStage)
+            return stage->pvt;
+    }
+    return NULL;
+}
+
+static void *
+nativeCreate(drvPvt *pdpvt, const char *args)
+{
+    nativePvt *pvt;
+    int i;
+
+    if (findNative(pdpvt) != NULL) {
+        printf("%s already has a native stage\n", pdpvt->portName);
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "nativeCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    for (i = 0 ; i < NATIVE_NADDR ; i++)
+        scanIoInit(&pvt->ioscan[i]);
+    return pvt;
+}
+
+static int
+nativeProcess(void *arg, usbMouseSample *sample)
+{
+    nativePvt *pvt = arg;
+    const mouseValues *newMouse = &sample->values;
+    epicsUInt32 changed;
+    int addr;
+
+    epicsMutexMustLock(pvt->lock);
+    if (pvt->havePublished) {
+        changed = (newMouse->buttons ^ pvt->values.buttons) &
+                    ((1 << (USBMOUSE_ADDR_BUTTON_LAST + 1)) - 1);
+        if (newMouse->xPosition != pvt->values.xPosition)
+            changed |= 1 << USBMOUSE_ADDR_X;
+        if (newMouse->yPosition != pvt->values.yPosition)
+            changed |= 1 << USBMOUSE_ADDR_Y;
+        if (newMouse->wheel != pvt->values.wheel)
+            changed |= 1 << USBMOUSE_ADDR_WHEEL;
+        if (sample->xVelocity != pvt->xVelocity)
+            changed |= 1 << USBMOUSE_ADDR_X_VELOCITY;
+        if (sample->yVelocity != pvt->yVelocity)
+            changed |= 1 << USBMOUSE_ADDR_Y_VELOCITY;
+        if (memcmp(newMouse, &pvt->values, sizeof *newMouse) != 0)
+            changed |= 1 << USBMOUSE_ADDR_SAMPLE;
+    }
+    else {
+        changed = (1 << NATIVE_NADDR) - 1;
+        pvt->havePublished = 1;
+    }
+    pvt->time = sample->time;
+    pvt->values = *newMouse;
+    pvt->xVelocity = sample->xVelocity;
+    pvt->yVelocity = sample->yVelocity;
+    epicsMutexUnlock(pvt->lock);
+
+    for (addr = 0 ; changed != 0 ; addr++, changed >>= 1) {
+        if (changed & 1) {
+            scanIoRequest(pvt->ioscan[addr]);
+            pvt->scanRequests++;
+        }
+    }
+    return 1;
+}
+
+static void
+nativeReport(void *arg, FILE *fp, int details)
+{
+    nativePvt *pvt = arg;
+
+    fprintf(fp, "%d records", pvt->recordCount);
+    if (details >= 3)
+        fprintf(fp, ", %lu scan requests", pvt->scanRequests);
+}
+
+const usbMouseStageType usbMouseNativeStage = {
+    "native", nativeCreate, nativeProcess, nativeReport
+};
+
+/*
+ * Common device support
+ */
+static long
+initCommon(dbCommon *prec, DBLINK *plink, int addrFirst, int addrLast)
+{
+    char portName[40], field[40], *end;
+    drvPvt *pdpvt;
+    nativePvt *native;
+    devPvt *pdevPvt;
+    int addr;
+
+    if ((plink->type != INST_IO)
+     || (sscanf(plink->value.instio.string, "%39s %39s", portName, field) != 2)) {
+        recGblRecordError(S_db_badField, prec,
+                                    "devUsbMouse: INP must be \"@port addr\"");
+        prec->pact = 1;
+        return S_db_badField;
+    }
+    addr = strtol(field, &end, 0);
+    if ((end == field) || (*end != '\0'))
+        addr = usbMouseFieldFind(field);
+    if ((addr < addrFirst) || (addr > addrLast)) {
+        recGblRecordError(S_db_badField, prec,
+                                "devUsbMouse: address wrong for record type");
+        prec->pact = 1;
+        return S_db_badField;
+    }
+    if ((pdpvt = usbMouseFindPort(portName)) == NULL) {
+        recGblRecordError(S_db_badField, prec, "devUsbMouse: no such port");
+        prec->pact = 1;
+        return S_db_badField;
+    }
+    if ((native = findNative(pdpvt)) == NULL) {
+        recGblRecordError(S_db_badField, prec,
+                                        "devUsbMouse: port has no native stage");
+        prec->pact = 1;
+        return S_db_badField;
+    }
+    pdevPvt = callocMustSucceed(1, sizeof *pdevPvt, "devUsbMouse");
+    pdevPvt->native = native;
+    pdevPvt->addr = addr;
+    prec->dpvt = pdevPvt;
+    native->recordCount++;
+    return 0;
+}
+
+static long
+getIoIntInfo(int cmd, dbCommon *prec, IOSCANPVT *iopvt)
+{
+    devPvt *pdevPvt = prec->dpvt;
+
+    if (pdevPvt == NULL)
+        return -1;
+    *iopvt = pdevPvt->native->ioscan[pdevPvt->addr];
+    return 0;
+}
+
+/*
+ * Called with the snapshot lock held
+ */
+static void
+setTime(dbCommon *prec, nativePvt *native)
+{
+    if (prec->tse == epicsTimeEventDeviceTime)
+        prec->time = native->time;
+}
+
+/*
+ * bi -- buttons
+ */
+static long
+initBi(biRecord *prec)
+{
+    return initCommon((dbCommon *)prec, &prec->inp,
+                        USBMOUSE_ADDR_BUTTON_FIRST, USBMOUSE_ADDR_BUTTON_LAST);
+}
+
+static long
+readBi(biRecord *prec)
+{
+    devPvt *pdevPvt = prec->dpvt;
+    nativePvt *native = pdevPvt->native;
+
+    epicsMutexMustLock(native->lock);
+    prec->rval = (native->values.buttons >> pdevPvt->addr) & 0x1;
+    setTime((dbCommon *)prec, native);
+    epicsMutexUnlock(native->lock);
+    return 0;
+}
+
+struct {
+    long      number;
+    DEVSUPFUN report;
+    DEVSUPFUN init;
+    DEVSUPFUN init_record;
+    DEVSUPFUN get_ioint_info;
+    DEVSUPFUN read_bi;
+} devBiUsbMouse = {
+    5, NULL, NULL, initBi, getIoIntInfo, readBi
+};
+epicsExportAddress(dset, devBiUsbMouse);
+
+/*
+ * longin -- positions and wheel
+ */
+static long
+initLongin(longinRecord *prec)
+{
+    return initCommon((dbCommon *)prec, &prec->inp,
+                        USBMOUSE_ADDR_X, USBMOUSE_ADDR_WHEEL);
+}
+
+static long
+readLongin(longinRecord *prec)
+{
+    devPvt *pdevPvt = prec->dpvt;
+    nativePvt *native = pdevPvt->native;
+
+    epicsMutexMustLock(native->lock);
+    switch (pdevPvt->addr) {
+    case USBMOUSE_ADDR_X:       prec->val = native->values.xPosition;   break;
+    case USBMOUSE_ADDR_Y:       prec->val = native->values.yPosition;   break;
+    case USBMOUSE_ADDR_WHEEL:   prec->val = native->values.wheel;       break;
+    }
+    setTime((dbCommon *)prec, native);
+    epicsMutexUnlock(native->lock);
+    return 0;
+}
+
+struct {
+    long      number;
+    DEVSUPFUN report;
+    DEVSUPFUN init;
+    DEVSUPFUN init_record;
+    DEVSUPFUN get_ioint_info;
+    DEVSUPFUN read_longin;
+} devLonginUsbMouse = {
+    5, NULL, NULL, initLongin, getIoIntInfo, readLongin
+};
+epicsExportAddress(dset, devLonginUsbMouse);
+
+/*
+ * ai -- velocities
+ */
+static long
+initAi(aiRecord *prec)
+{
+    return initCommon((dbCommon *)prec, &prec->inp,
+                        USBMOUSE_ADDR_X_VELOCITY, USBMOUSE_ADDR_Y_VELOCITY);
+}
+
+static long
+readAi(aiRecord *prec)
+{
+    devPvt *pdevPvt = prec->dpvt;
+    nativePvt *native = pdevPvt->native;
+
+    epicsMutexMustLock(native->lock);
+    prec->val = pdevPvt->addr == USBMOUSE_ADDR_X_VELOCITY ?
+                                    native->xVelocity : native->yVelocity;
+    setTime((dbCommon *)prec, native);
+    epicsMutexUnlock(native->lock);
+    prec->udf = 0;
+    return 2;
+}
+
+struct {
+    long      number;
+    DEVSUPFUN report;
+    DEVSUPFUN init;
+    DEVSUPFUN init_record;
+    DEVSUPFUN get_ioint_info;
+    DEVSUPFUN read_ai;
+    DEVSUPFUN special_linconv;
+} devAiUsbMouse = {
+    6, NULL, NULL, initAi, getIoIntInfo, readAi, NULL
+};
+epicsExportAddress(dset, devAiUsbMouse);
+
+/*
+ * waveform -- the whole sample
+ */
+static long
+initWaveform(waveformRecord *prec)
+{
+    if ((prec->ftvl != menuFtypeLONG) || (prec->nelm < USBMOUSE_SAMPLE_SIZE)) {
+        recGblRecordError(S_db_badField, prec,
+                    "devUsbMouse: waveform needs FTVL LONG and NELM >= 4");
+        prec->pact = 1;
+        return S_db_badField;
+    }
+    return initCommon((dbCommon *)prec, &prec->inp,
+                        USBMOUSE_ADDR_SAMPLE, USBMOUSE_ADDR_SAMPLE);
+}
+
+static long
+readWaveform(waveformRecord *prec)
+{
+    devPvt *pdevPvt = prec->dpvt;
+    nativePvt *native = pdevPvt->native;
+    epicsInt32 *packed = prec->bptr;
+
+    epicsMutexMustLock(native->lock);
+    packed[0] = native->values.buttons;
+    packed[1] = native->values.xPosition;
+    packed[2] = native->values.yPosition;
+    packed[3] = native->values.wheel;
+    setTime((dbCommon *)prec, native);
+    epicsMutexUnlock(native->lock);
+    prec->nord = USBMOUSE_SAMPLE_SIZE;
+    return 0;
+}
+
+struct {
+    long      number;
+    DEVSUPFUN report;
+    DEVSUPFUN init;
+    DEVSUPFUN init_record;
+    DEVSUPFUN get_ioint_info;
+    DEVSUPFUN read_wf;
+} devWfUsbMouse = {
+    5, NULL, NULL, initWaveform, getIoIntInfo, readWaveform
+};
+epicsExportAddress(dset, devWfUsbMouse);
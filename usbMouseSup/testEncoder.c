@@ -0,0 +1,118 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Check that the exact scaling behind the encoder and scale stages
+ * doesn't drift.  Millions of deltas either way go through
+ * usbMouseScaleDelta with non-integer ratios, and the counts, whole
+ * revolutions and remainders that come out are checked against the
+ * total motion worked out directly.
+ */
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "usbMouseCore.h"
+
+#define NDELTAS 5000000
+
+/*
+ * Repeatable pseudo-random deltas in [-limit, limit]
+ */
+static unsigned long seed;
+
+static int
+nextDelta(int limit)
+{
+    seed = seed * 1103515245UL + 12345UL;
+    return (int)((seed >> 8) % (2 * limit + 1)) - limit;
+}
+
+static epicsInt64
+floorDiv(epicsInt64 a, epicsInt64 b)
+{
+    epicsInt64 q = a / b;
+
+    if ((a % b) != 0 && ((a < 0) != (b < 0)))
+        q--;
+    return q;
+}
+
+/*
+ * Run deltas through a num/den scale, then back again, and check the
+ * result against the total at every step and at the end
+ */
+static void
+checkScale(const char *what, epicsInt64 num, epicsInt64 den, int limit)
+{
+    static int deltas[NDELTAS];
+    epicsInt64 total = 0, scaled = 0, remainder = 0;
+    unsigned long bad = 0;
+    int i;
+
+    seed = 1;
+    for (i = 0 ; i < NDELTAS ; i++) {
+        deltas[i] = nextDelta(limit);
+        total += deltas[i];
+        scaled += usbMouseScaleDelta(num, den, &remainder, deltas[i]);
+        if ((remainder < 0) || (remainder >= den)
+         || (scaled * den + remainder != total * num))
+            bad++;
+    }
+    testOk(bad == 0, "%s: remainder exact after each of %d deltas (%lu bad)",
+                                                    what, NDELTAS, bad);
+    testOk(scaled == floorDiv(total * num, den),
+                    "%s: %lld after %lld counts", what, (long long)scaled,
+                    (long long)total);
+    for (i = NDELTAS - 1 ; i >= 0 ; i--)
+        scaled += usbMouseScaleDelta(num, den, &remainder, -deltas[i]);
+    testOk((scaled == 0) && (remainder == 0),
+                    "%s: back to exactly zero (%lld, remainder %lld)", what,
+                    (long long)scaled, (long long)remainder);
+}
+
+/*
+ * An encoder axis of num/den counts per revolution: whole revolutions
+ * carried out of the phase by scaling each delta by den/num
+ */
+static void
+checkEncoder(epicsInt64 num, epicsInt64 den, int limit)
+{
+    epicsInt64 count = 0, revolutions = 0, phase = 0;
+    unsigned long bad = 0;
+    int i, delta;
+
+    seed = 2;
+    for (i = 0 ; i < NDELTAS ; i++) {
+        delta = nextDelta(limit);
+        count += delta;
+        revolutions += usbMouseScaleDelta(den, num, &phase, delta);
+        if ((phase < 0) || (phase >= num)
+         || (count * den != revolutions * num + phase))
+            bad++;
+    }
+    testOk(bad == 0,
+            "encoder %lld/%lld counts/rev: phase exact after each of %d deltas (%lu bad)",
+            (long long)num, (long long)den, NDELTAS, bad);
+    testOk((revolutions == floorDiv(count * den, num))
+        && (phase == count * den - revolutions * num),
+            "encoder %lld/%lld counts/rev: count %lld is %lld rev + %lld/%lld counts",
+            (long long)num, (long long)den, (long long)count,
+            (long long)revolutions, (long long)phase, (long long)den);
+}
+
+MAIN(testEncoder)
+{
+    testPlan(13);
+    testDiag("usbMouseScaleDelta");
+    checkScale("gain 25.4/800", 127, 4000, 127);
+    checkScale("gain -5/2", -5, 2, 127);
+    checkScale("gain 1/3, large deltas", 1, 3, 32767);
+    checkEncoder(3605, 10, 127);
+    checkEncoder(1024, 1, 32767);
+    return testDone();
+}
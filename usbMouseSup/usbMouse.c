@@ -12,6 +12,8 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <epicsStdio.h>
 #include <epicsString.h>
 #include <epicsThread.h>
@@ -21,8 +23,18 @@
 #include <iocsh.h>
 #include <asynDriver.h>
 #include <asynInt32.h>
+#include <asynFloat64.h>
+#include <asynInt8Array.h>
+#include <asynInt32Array.h>
+#include <asynOctet.h>
+#include <asynDrvUser.h>
 #include <libusb-1.0/libusb.h>
 
+#include "usbMousePvt.h"
+#ifdef USBMOUSE_HAVE_INT64
+#include <asynInt64.h>
+#endif
+
 
 /*
  * Define this to non-zero to get lengthy ASYN reports
@@ -37,119 +49,9 @@
 #define USB_DT_CS_INTERFACE    (LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_DT_INTERFACE)
 
 /*
- * USB Setup Packet values
- * These are gleaned from HID1_11.pdf section 7.2.1 "Get_Report Request":
- *      bmRequestType       10100001
- *      bRequest            00000001 (GET_REPORT)
- *      wValue              Report type in high byte, report ID in low byte
- *      wIndex              Interface
- *      wLength             Report length
- *
- * The GET_REPORT request allows the host to receive a report via the
- * CONTROL pipe.  A report type of 1 is 'INPUT'.
- */
-
-/*
- * bmRequestType bits
- */
-#define USB_TYPE_CLASS          (0x01 << 5) /* Class device request */
-#define USB_RECIP_INTERFACE     0x01        /* Recepient is interface */
-
-/*
- * bRequest values for HID class
- */
-#define HID_REPORT_GET          0x01
-
-/*
- * wValue bits (report type is high byte)
- */
-#define HID_RT_INPUT            0x01
-
-/*
- * How long to wait for response (milliseconds)
+ * List of configured ports
  */
-#define USB_TIMEOUT             10000
-
-/*
- * Mouse values
- */
-typedef struct mouseValues {
-    int buttons;
-    int xPosition;
-    int yPosition;
-    int wheel;
-} mouseValues;
-
-/*
- * Driver private storage
- */
-typedef struct drvPvt {
-    char                           *portName;
-
-    /*
-     * Asyn interfaces
-     */
-    asynInterface                   asynCommon;
-    asynInterface                   asynInt32;
-    void                           *asynInt32InterruptPvt;
-
-    /*
-     * Control diagnostic messages
-     */
-    asynUser                       *pasynUserForMessages;
-
-    /*
-     * Device information
-     */
-    int                             idVendor;
-    int                             idProduct;
-    int                             idNumber;
-
-    /*
-     * libusb-1.0
-     */
-    libusb_context                 *usbContext;
-    libusb_device_handle           *usbHandle;
-    struct libusb_device_descriptor usbDeviceDescriptor;
-    struct libusb_config_descriptor *usbConfigp;
-    int                             isConnected;
-
-    /*
-     * Data from mouse
-     */
-    unsigned char                   cbuf[80];
-    int                             nRead;
-    mouseValues                     oldMouse;
-    mouseValues                     newMouse;
-    char                           *manufacturerString;
-    char                           *productString;
-    char                           *serialNumberString;
-    int                             HIDreportLength;
-    unsigned char                  *HIDreport;
-
-    /*
-     * Reader thread info
-     */
-    double                          pollInterval;
-    int                             useDevicePollInterval;
-    unsigned long                   packetCount;
-    int                             transferDone;
-} drvPvt;
-
-/*
- * Sign-extend
- */
-static int
-signExtend(int size, int value)
-{
-    switch(size) {
-    default:                           break;
-    case 1: value = (epicsInt8)value;  break;
-    case 2: value = (epicsInt16)value; break;
-    case 4: value = (epicsInt32)value; break;
-    }
-    return value;
-}
+static drvPvt *portList;
 
 #if ASYN_LONG_REPORTS
 /*
@@ -158,36 +60,6 @@ signExtend(int size, int value)
  * information for the ASYN report method.           *
  *****************************************************
  */
-/*
- * Get a report of the HID values
- */
-static void
-getHIDreport(drvPvt *pdpvt,
-             const struct libusb_interface_descriptor *interface,
-             const unsigned char *buf)
-{
-    int s;
-
-    if (pdpvt->HIDreport)
-        free(pdpvt->HIDreport);
-    pdpvt->HIDreportLength = (buf[8] << 8) | buf[7];
-    pdpvt->HIDreport = callocMustSucceed(pdpvt->HIDreportLength, 1, "getHIDreport");
-    s = libusb_control_transfer(pdpvt->usbHandle,
-                        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
-                                             LIBUSB_RECIPIENT_INTERFACE,
-                        LIBUSB_REQUEST_GET_DESCRIPTOR,
-                        (LIBUSB_DT_REPORT << 8) | 0x00,
-                        interface->bInterfaceNumber,
-                        pdpvt->HIDreport, pdpvt->HIDreportLength, USB_TIMEOUT);
-    if (s != pdpvt->HIDreportLength) {
-        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                                            "Get HID report failed: %d\n", s);
-        free(pdpvt->HIDreport);
-        pdpvt->HIDreport = NULL;
-        pdpvt->HIDreportLength = 0;
-    }
-}
-
 /*
  * Show HID report
  */
@@ -278,19 +150,19 @@ showHIDreport(FILE *fp, drvPvt *pdpvt)
                 break;
 
             case 0x14:
-                fprintf(fp, "Logical minimum %d", signExtend(bSize, data));
+                fprintf(fp, "Logical minimum %d", usbMouseSignExtend(bSize, data));
                 break;
 
             case 0x24:
-                fprintf(fp, "Logical maximum %d", signExtend(bSize, data));
+                fprintf(fp, "Logical maximum %d", usbMouseSignExtend(bSize, data));
                 break;
 
             case 0x34:
-                fprintf(fp, "Physical minimum %d", signExtend(bSize, data));
+                fprintf(fp, "Physical minimum %d", usbMouseSignExtend(bSize, data));
                 break;
 
             case 0x44:
-                fprintf(fp, "Physical maximum %d", signExtend(bSize, data));
+                fprintf(fp, "Physical maximum %d", usbMouseSignExtend(bSize, data));
                 break;
 
             case 0x54:
@@ -351,67 +223,14 @@ showHIDreport(FILE *fp, drvPvt *pdpvt)
 #endif /* ASYN_LONG_REPORTS */
 
 /*
- * Get a string descriptor from the device
- * This routine isn't strictly necessary either, but it does provide
- * useful information so I made it non-conditional.
+ * Replace one of the port's strings, such as those the core library
+ * read from the device
  */
-static asynStatus
-getStringDescriptor(drvPvt *pdpvt, unsigned int descriptor, char **cpp)
+void
+usbMouseReplaceString(char **cpp, const char *value)
 {
-    unsigned char cbuf[255];
-    char value[128];
-    int i, j, s;
-    int languageCode;
-
-    if (descriptor == 0) {
-        *cpp = epicsStrDup("???");
-        return asynSuccess;
-    }
-    if (descriptor > 255) {
-        epicsSnprintf(value, sizeof value, "Invalid desriptor (%d)", descriptor);
-        *cpp = epicsStrDup(value);
-        return asynError;
-    }
-
-    /*
-     * Get the first supported language
-     */
-    s = libusb_control_transfer(pdpvt->usbHandle,
-          LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
-          LIBUSB_REQUEST_GET_DESCRIPTOR,
-          (LIBUSB_DT_STRING << 8) | 0x00,  /* Index 0 (language identifiers) */
-          0x0000,  /* Interface number */
-          cbuf, sizeof cbuf, USB_TIMEOUT);
-    if (s <= 0) {
-        epicsSnprintf(value, sizeof value, "Can't get language descriptor");
-        *cpp = epicsStrDup(value);
-        return asynError;
-    }
-    languageCode = (cbuf[3] << 8) | cbuf[2];
-
-    /*
-     * Get the string in that language
-     */
-    s = libusb_control_transfer(pdpvt->usbHandle,
-         LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
-          LIBUSB_REQUEST_GET_DESCRIPTOR,
-         (LIBUSB_DT_STRING << 8) | descriptor,
-         languageCode,
-         cbuf, sizeof cbuf, USB_TIMEOUT);
-    if (s <= 0) {
-        epicsSnprintf(value, sizeof value, "Can't get descriptor %d", descriptor);
-        *cpp = epicsStrDup(value);
-        return asynError;
-    }
-
-    /*
-     * Assume string is in ASCII subset of Unicode
-     */
-    for (i = 2, j = 0 ; (i < cbuf[0]) && (j < sizeof(value) - 1) ; i += 2, j++)
-        value[j] = cbuf[i];
-    value[j] = '\0';
+    free(*cpp);
     *cpp = epicsStrDup(value);
-    return asynSuccess;
 }
 
 /*
@@ -420,102 +239,58 @@ getStringDescriptor(drvPvt *pdpvt, unsigned int descriptor, char **cpp)
 static asynStatus
 connectToMouse(drvPvt *pdpvt)
 {
-    libusb_device **list;
+    usbMouseDevice *dev = &pdpvt->usbDevice;
     libusb_device *found = NULL;
-    ssize_t n;
-    int i, s;
-    const struct libusb_interface_descriptor *interface;
-    const struct libusb_endpoint_descriptor *endpoint;
+    usbMouseDeviceInfo info;
+    int s, inventory;
 
     /*
-     * Find the device
+     * Find the device -- in the discovery service inventory if there is
+     * one, otherwise the core library searches the bus
      */
-    n = libusb_get_device_list(NULL, &list);
-    if (n < 0) {
-        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                                "libusb_get_device_list failed: %d\n", (int)n);
-        return asynError;
-    }
-    for (i = 0 ; i < n ; i++) {
-        libusb_device *device = list[i];
-        int s = libusb_get_device_descriptor(device, &pdpvt->usbDeviceDescriptor);
-        if (s != 0) {
-            asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                                "libusb_get_device_descriptor failed: %d\n", s);
-            return asynError;
-        }
-        if ((pdpvt->usbDeviceDescriptor.idVendor == pdpvt->idVendor)
-         && (pdpvt->usbDeviceDescriptor.idProduct == pdpvt->idProduct)) {
-            found = device;
-            break;
-        }
-    }
-    if (!found) {
+    inventory = usbMouseDiscoveryFind(pdpvt->idVendor, pdpvt->idProduct,
+                                                            &found, &info);
+    if (inventory == 0) {
         asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-            "Can't find device with vendor ID:%4.4X and product ID:%4.4X.\n",
+            "No device with vendor ID:%4.4X and product ID:%4.4X in inventory.\n",
                                          pdpvt->idVendor,  pdpvt->idProduct);
         return asynError;
     }
-
-    /*
-     * Open a connection to the device
-     */
-    s = libusb_open(found, &pdpvt->usbHandle);
-    if (s != 0) {
-        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                                                "libusb_open failed: %d\n", s);
-        return 1;
+    if (inventory > 0) {
+        s = usbMouseDeviceOpen(dev, found, &info);
+        libusb_unref_device(found);
     }
-    libusb_free_device_list(list, 1);
-    s = libusb_kernel_driver_active(pdpvt->usbHandle, pdpvt->idNumber);
-    if (s == 1) {
-        s = libusb_detach_kernel_driver(pdpvt->usbHandle, pdpvt->idNumber);
-        if (s != 0) {
-            asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                    "Warning -- libusb_detach_kernel_driver failed: %d\n", s);
-        }
+    else {
+        s = usbMouseDeviceOpen(dev, NULL, NULL);
     }
-    else if (s != 0) {
+    if (s < 0) {
         asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                                "libusb_kernel_driver_active failed: %d\n", s);
+                                                "%s.\n", dev->errorMessage);
         return asynError;
     }
-    s = libusb_claim_interface(pdpvt->usbHandle, pdpvt->idNumber);
-    if (s != 0) {
+    if (dev->errorMessage[0]) {
         asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                           "Warning -- libusb_claim_interface failed: %d\n", s);
+                                    "Warning -- %s.\n", dev->errorMessage);
     }
 
     /*
      * Get device information
      */
-    if (pdpvt->usbConfigp != NULL)
-        libusb_free_config_descriptor(pdpvt->usbConfigp);
-    libusb_get_config_descriptor(found, 0, &pdpvt->usbConfigp);
-    interface = pdpvt->usbConfigp->interface->altsetting;
-    endpoint = interface->endpoint;
     if (pdpvt->useDevicePollInterval)
-        pdpvt->pollInterval = 125.0e-6 * (1 << (endpoint->bInterval - 1));
-    if (interface->bInterfaceClass == LIBUSB_CLASS_HID) {
-#if ASYN_LONG_REPORTS
-        const unsigned char *buf = interface->extra;
-        if ((interface->extra_length >= 9)
-         && (interface->extra_length >= buf[0])
-         && (buf[1] == LIBUSB_DT_HID)
-         && (buf[5] >= 1)
-         && (buf[6] == LIBUSB_DT_REPORT)) {
-            getHIDreport(pdpvt, interface, buf);
-        }
-#endif
+        pdpvt->pollInterval = dev->pollInterval;
+    free(pdpvt->HIDreport);
+    pdpvt->HIDreport = NULL;
+    pdpvt->HIDreportLength = 0;
+    if (dev->HIDreport) {
+        pdpvt->HIDreport = callocMustSucceed(dev->HIDreportLength, 1,
+                                                            "connectToMouse");
+        memcpy(pdpvt->HIDreport, dev->HIDreport, dev->HIDreportLength);
+        pdpvt->HIDreportLength = dev->HIDreportLength;
     }
-    else {
-        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                "Interface class (%d) is not LIBUSB_CLASS_HID (%d)\n",
-                         interface->bInterfaceClass, LIBUSB_CLASS_HID);
-    }
-    getStringDescriptor(pdpvt, pdpvt->usbDeviceDescriptor.iManufacturer, &pdpvt->manufacturerString);
-    getStringDescriptor(pdpvt, pdpvt->usbDeviceDescriptor.iProduct, &pdpvt->productString);
-    getStringDescriptor(pdpvt, pdpvt->usbDeviceDescriptor.iSerialNumber, &pdpvt->serialNumberString);
+    pdpvt->usesReportIds = dev->usesReportIds;
+    usbMouseReplaceString(&pdpvt->manufacturerString, dev->info.manufacturer);
+    usbMouseReplaceString(&pdpvt->productString, dev->info.product);
+    usbMouseReplaceString(&pdpvt->serialNumberString, dev->info.serialNumber);
 
     /*
      * All connected and ready to go
@@ -525,56 +300,775 @@ connectToMouse(drvPvt *pdpvt)
     return asynSuccess;
 }
 
+/*
+ * Disconnect from libusb transports
+ */
+static void
+disconnectFromMouse(drvPvt *pdpvt)
+{
+    usbMouseDeviceClose(&pdpvt->usbDevice);
+}
+
+/*
+ * Poll the device for its current report over the CONTROL pipe
+ */
+static int
+controlRead(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    int s;
+
+    s = usbMouseDeviceReadControl(&pdpvt->usbDevice, buf, size);
+    if (s < 0) {
+        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
+                                "%s\n", pdpvt->usbDevice.errorMessage);
+    }
+    return s;
+}
+
+/*
+ * Wait for the device to send a report on its INTERRUPT IN endpoint
+ */
+static int
+interruptRead(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    int s;
+
+    s = usbMouseDeviceReadInterrupt(&pdpvt->usbDevice, buf, size);
+    if (s < 0) {
+        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
+                                "%s\n", pdpvt->usbDevice.errorMessage);
+    }
+    return s;
+}
+
+static const usbMouseTransport controlTransport = {
+    "control", 1, connectToMouse, controlRead, disconnectFromMouse,
+    usbMouseDecodeBoot
+};
+static const usbMouseTransport interruptTransport = {
+    "interrupt", 0, connectToMouse, interruptRead, disconnectFromMouse,
+    usbMouseDecodeBoot, 0, controlRead
+};
+
+/*
+ * Known transports
+ */
+static const usbMouseTransport *const transports[] = {
+    &controlTransport,
+    &interruptTransport,
+    &usbMouseSimTransport,
+    &usbMouseReplayTransport,
+#ifdef __linux__
+    &usbMouseHidrawTransport,
+    &usbMouseEvdevTransport,
+#endif
+};
+#define NTRANSPORTS (sizeof transports / sizeof transports[0])
+
+/*
+ * Find a configured port
+ */
+drvPvt *
+usbMouseFindPort(const char *portName)
+{
+    drvPvt *pdpvt;
+
+    for (pdpvt = portList ; pdpvt != NULL ; pdpvt = pdpvt->next) {
+        if (strcmp(pdpvt->portName, portName) == 0)
+            break;
+    }
+    return pdpvt;
+}
+
+drvPvt *
+usbMousePortList(void)
+{
+    return portList;
+}
+
+/*
+ * Field names records can give in drvInfo
+ */
+typedef struct fieldName {
+    const char *name;
+    int         addr;
+} fieldName;
+
+#define ENCODER_FIELDS(axis, n) \
+    { "ENC_" axis "_ANGLE", USBMOUSE_ADDR_ENCODER + (n) * USBMOUSE_ENCODER_STRIDE \
+                                            + USBMOUSE_ENCODER_ANGLE }, \
+    { "ENC_" axis "_REVOLUTIONS", USBMOUSE_ADDR_ENCODER + (n) * USBMOUSE_ENCODER_STRIDE \
+                                            + USBMOUSE_ENCODER_REVOLUTIONS }, \
+    { "ENC_" axis "_COUNT", USBMOUSE_ADDR_ENCODER + (n) * USBMOUSE_ENCODER_STRIDE \
+                                            + USBMOUSE_ENCODER_COUNT }, \
+    { "ENC_" axis "_HOME", USBMOUSE_ADDR_ENCODER + (n) * USBMOUSE_ENCODER_STRIDE \
+                                            + USBMOUSE_ENCODER_HOME }
+
+static const fieldName fieldNames[] = {
+    { "BTN0",                   USBMOUSE_ADDR_BUTTON_FIRST + 0 },
+    { "BTN1",                   USBMOUSE_ADDR_BUTTON_FIRST + 1 },
+    { "BTN2",                   USBMOUSE_ADDR_BUTTON_FIRST + 2 },
+    { "BTN3",                   USBMOUSE_ADDR_BUTTON_FIRST + 3 },
+    { "BTN4",                   USBMOUSE_ADDR_BUTTON_FIRST + 4 },
+    { "BTN5",                   USBMOUSE_ADDR_BUTTON_FIRST + 5 },
+    { "BTN6",                   USBMOUSE_ADDR_BUTTON_FIRST + 6 },
+    { "BTN7",                   USBMOUSE_ADDR_BUTTON_FIRST + 7 },
+    { "X",                      USBMOUSE_ADDR_X },
+    { "Y",                      USBMOUSE_ADDR_Y },
+    { "WHEEL",                  USBMOUSE_ADDR_WHEEL },
+    { "VEL_X",                  USBMOUSE_ADDR_X_VELOCITY },
+    { "VEL_Y",                  USBMOUSE_ADDR_Y_VELOCITY },
+    { "SAMPLE",                 USBMOUSE_ADDR_SAMPLE },
+    { "RAW",                    USBMOUSE_ADDR_RAW },
+    { "RAW_LENGTH",             USBMOUSE_ADDR_RAW_LENGTH },
+    { "RAW_REPORT_ID",          USBMOUSE_ADDR_RAW_REPORT_ID },
+    { "JOG_X",                  USBMOUSE_ADDR_JOG_X },
+    { "JOG_Y",                  USBMOUSE_ADDR_JOG_Y },
+    { "JOG_ENABLE",             USBMOUSE_ADDR_JOG_ENABLE },
+    { "JOG_MODE",               USBMOUSE_ADDR_JOG_MODE },
+    { "JOG_GAIN",               USBMOUSE_ADDR_JOG_GAIN },
+    { "JOG_ACTIVE",             USBMOUSE_ADDR_JOG_ACTIVE },
+    { "VERTEX_X",               USBMOUSE_ADDR_VERTEX_X },
+    { "VERTEX_Y",               USBMOUSE_ADDR_VERTEX_Y },
+    { "VERTEX_COUNT",           USBMOUSE_ADDR_VERTEX_COUNT },
+    { "LOOP",                   USBMOUSE_ADDR_LOOP },
+    { "LOOP_LOAD",              USBMOUSE_ADDR_LOOP_LOAD },
+    { "LOOP_THREAD_LOAD",       USBMOUSE_ADDR_LOOP_THREAD_LOAD },
+    { "LOOP_SPIN",              USBMOUSE_ADDR_LOOP_SPIN },
+    { "LOOP_SPIN_WAKES",        USBMOUSE_ADDR_LOOP_SPIN_WAKES },
+    { "LOOP_PARK_WAKES",        USBMOUSE_ADDR_LOOP_PARK_WAKES },
+    { "HIST",                   USBMOUSE_ADDR_HIST },
+    { "HIST_RESET",             USBMOUSE_ADDR_HIST_RESET },
+    { "HIST_X_MIN",             USBMOUSE_ADDR_HIST_X_MIN },
+    { "HIST_X_MAX",             USBMOUSE_ADDR_HIST_X_MAX },
+    { "HIST_Y_MIN",             USBMOUSE_ADDR_HIST_Y_MIN },
+    { "HIST_Y_MAX",             USBMOUSE_ADDR_HIST_Y_MAX },
+    { "HIST_COUNT",             USBMOUSE_ADDR_HIST_COUNT },
+    { "HIST_OUTSIDE",           USBMOUSE_ADDR_HIST_OUTSIDE },
+    { "CAPTURE",                USBMOUSE_ADDR_CAPTURE },
+    { "TRIAL",                  USBMOUSE_ADDR_TRIAL },
+    { "TRIAL_START",            USBMOUSE_ADDR_TRIAL_START },
+    { "TRIAL_STOP",             USBMOUSE_ADDR_TRIAL_STOP },
+    { "TRIAL_SAMPLES",          USBMOUSE_ADDR_TRIAL_SAMPLES },
+    { "TRIAL_DURATION",         USBMOUSE_ADDR_TRIAL_DURATION },
+    { "TRIAL_PATH",             USBMOUSE_ADDR_TRIAL_PATH },
+    { "CAPTURE_PREFIX",         USBMOUSE_ADDR_CAPTURE_PREFIX },
+    { "CAPTURE_FILE",           USBMOUSE_ADDR_CAPTURE_FILE },
+    { "CAPTURE_DROPS",          USBMOUSE_ADDR_CAPTURE_DROPS },
+    { "CAPTURE_WAITS",          USBMOUSE_ADDR_CAPTURE_WAITS },
+    { "CAPTURE_RATE",           USBMOUSE_ADDR_CAPTURE_RATE },
+    { "CAPTURE_BACKLOG",        USBMOUSE_ADDR_CAPTURE_BACKLOG },
+    { "CAPTURE_ERRORS",         USBMOUSE_ADDR_CAPTURE_ERRORS },
+    { "RESYNC_DISCREPANCIES",   USBMOUSE_ADDR_RESYNC_DISCREPANCIES },
+    { "SCALED_X",               USBMOUSE_ADDR_SCALED_X },
+    { "SCALED_Y",               USBMOUSE_ADDR_SCALED_Y },
+    { "SCALED_WHEEL",           USBMOUSE_ADDR_SCALED_WHEEL },
+    { "POWER_ACTIVE",           USBMOUSE_ADDR_POWER_ACTIVE },
+    { "POWER_RATE",             USBMOUSE_ADDR_POWER_RATE },
+    ENCODER_FIELDS("X", 0),
+    ENCODER_FIELDS("Y", 1),
+    ENCODER_FIELDS("WHEEL", 2),
+    { "LATCH",                  USBMOUSE_ADDR_LATCH },
+    { "LATCH_AT",               USBMOUSE_ADDR_LATCH_AT },
+    { "LATCH_X",                USBMOUSE_ADDR_LATCH_X },
+    { "LATCH_Y",                USBMOUSE_ADDR_LATCH_Y },
+    { "LATCH_WHEEL",            USBMOUSE_ADDR_LATCH_WHEEL },
+    { "LATCH_BUTTONS",          USBMOUSE_ADDR_LATCH_BUTTONS },
+    { "LATCH_COUNT",            USBMOUSE_ADDR_LATCH_COUNT },
+    { "LATCH_MISSED",           USBMOUSE_ADDR_LATCH_MISSED },
+};
+#define NFIELDNAMES (sizeof fieldNames / sizeof fieldNames[0])
+
+/*
+ * Address of a named field, or -1.  Case doesn't matter.
+ */
+int
+usbMouseFieldFind(const char *name)
+{
+    int i;
+
+    for (i = 0 ; i < NFIELDNAMES ; i++) {
+        if (epicsStrCaseCmp(fieldNames[i].name, name) == 0)
+            return fieldNames[i].addr;
+    }
+    return -1;
+}
+
+/*
+ * Zeroed storage starting on a cache line boundary.  Ports and stages
+ * live as long as the IOC so the storage is never freed, not even when
+ * setting one up fails -- the pointer returned isn't the one to free.
+ */
+void *
+usbMouseCallocAligned(size_t size, const char *errorMessage)
+{
+    char *cp = callocMustSucceed(1, size + USBMOUSE_CACHELINE, errorMessage);
+
+    return cp + (USBMOUSE_CACHELINE - (size_t)cp % USBMOUSE_CACHELINE);
+}
+
+/*
+ * Decode stage -- the transport knows how its reports are laid out
+ */
+static void *
+decodeCreate(drvPvt *pdpvt, const char *args)
+{
+    return pdpvt;
+}
+
+static int
+decodeProcess(void *pvt, usbMouseSample *sample)
+{
+    drvPvt *pdpvt = (drvPvt *)pvt;
+
+    /*
+     * A state report from a resync passes on only if it corrects the
+     * buttons, and carries no motion
+     */
+    if (sample->resync) {
+        if (!usbMouseResyncButtons(&pdpvt->newMouse, sample,
+                                   pdpvt->transport->decode))
+            return 0;
+        pdpvt->resyncDiscrepancies++;
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_RESYNC_DISCREPANCIES,
+                                    pdpvt->resyncDiscrepancies, &sample->time);
+        return 1;
+    }
+    usbMouseAccumulate(&pdpvt->newMouse, sample, pdpvt->transport->decode);
+    return 1;
+}
+
+const usbMouseStageType usbMouseDecodeStage = {
+    "decode", decodeCreate, decodeProcess, NULL
+};
+
+/*
+ * The sample fields the publish stage sends, by address.  Records find
+ * their entry directly from the field they resolved to when they were
+ * initialized, so there is no decoding of addresses per sample.
+ */
+#define SAMPLE_INT32    1
+#define SAMPLE_FLOAT64  2
+
+typedef struct sampleField {
+    int     type;
+    int     mask;       /* button bit, or 0 for the whole value */
+    size_t  offset;     /* of the value in usbMouseSample */
+} sampleField;
+
+#define SAMPLE_BUTTON(n) \
+    { SAMPLE_INT32, 1 << (n), offsetof(usbMouseSample, values.buttons) }
+
+static const sampleField sampleFields[USBMOUSE_ADDR_STAGE_FIRST] = {
+    SAMPLE_BUTTON(0), SAMPLE_BUTTON(1), SAMPLE_BUTTON(2), SAMPLE_BUTTON(3),
+    SAMPLE_BUTTON(4), SAMPLE_BUTTON(5), SAMPLE_BUTTON(6), SAMPLE_BUTTON(7),
+    { 0 }, { 0 },
+    { SAMPLE_INT32, 0, offsetof(usbMouseSample, values.xPosition) },
+    { SAMPLE_INT32, 0, offsetof(usbMouseSample, values.yPosition) },
+    { SAMPLE_INT32, 0, offsetof(usbMouseSample, values.wheel) },
+    { SAMPLE_FLOAT64, 0, offsetof(usbMouseSample, xVelocity) },
+    { SAMPLE_FLOAT64, 0, offsetof(usbMouseSample, yVelocity) },
+};
+
+/*
+ * The entry for a record, NULL if it is for another stage's address,
+ * or an entry of type 0 if there is no such field
+ */
+static const sampleField *
+sampleFieldFind(asynUser *pasynUser, int addr)
+{
+    int field = USBMOUSE_FIELD(pasynUser, addr);
+    static const sampleField none;
+
+    if (field >= USBMOUSE_ADDR_STAGE_FIRST)
+        return NULL;
+    if (field < 0)
+        return &none;
+    return &sampleFields[field];
+}
+
+static epicsInt32
+sampleInt32(const usbMouseSample *sample, const sampleField *f)
+{
+    int value = *(const int *)((const char *)sample + f->offset);
+
+    return f->mask ? ((value & f->mask) != 0) : value;
+}
+
+static epicsFloat64
+sampleFloat64(const usbMouseSample *sample, const sampleField *f)
+{
+    return *(const double *)((const char *)sample + f->offset);
+}
+
 /*
  * Stuff data into records and trigger record processing.
+ * A run of samples from one port is sent with one interruptStart and
+ * interruptEnd per interface; each record still sees every value, in
+ * order.
+ */
+static void
+transferStatus(drvPvt *pdpvt, const usbMouseSample *samples, int nSamples)
+{
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+    const usbMouseSample *sample, *oldSample;
+    const mouseValues *newMouse, *oldMouse;
+    int i, first;
+
+    /*
+     * The whole sample as one array so a record group can update atomically
+     */
+    for (i = 0, oldMouse = &pdpvt->oldSample.values ; i < nSamples ; i++) {
+        if ((memcmp(&samples[i].values, oldMouse, sizeof *oldMouse) != 0)
+         || (pdpvt->transferDone == 0))
+            break;
+        oldMouse = &samples[i].values;
+    }
+    if (i < nSamples) {
+        pasynManager->interruptStart(pdpvt->asynInt32ArrayInterruptPvt, &pclientList);
+        for (first = !pdpvt->transferDone ; i < nSamples ; i++, first = 0) {
+            epicsInt32 packed[USBMOUSE_SAMPLE_SIZE];
+            sample = &samples[i];
+            newMouse = &sample->values;
+            if (!first && (memcmp(newMouse, oldMouse, sizeof *newMouse) == 0))
+                continue;
+            oldMouse = newMouse;
+            packed[0] = newMouse->buttons;
+            packed[1] = newMouse->xPosition;
+            packed[2] = newMouse->yPosition;
+            packed[3] = newMouse->wheel;
+            pnode = (interruptNode *)ellFirst(pclientList);
+            while (pnode) {
+                asynInt32ArrayInterrupt *int32ArrayInterrupt = pnode->drvPvt;
+                if (USBMOUSE_FIELD(int32ArrayInterrupt->pasynUser,
+                                   int32ArrayInterrupt->addr) == USBMOUSE_ADDR_SAMPLE) {
+                    int32ArrayInterrupt->pasynUser->timestamp = sample->time;
+                    int32ArrayInterrupt->callback(int32ArrayInterrupt->userPvt,
+                                                  int32ArrayInterrupt->pasynUser,
+                                                  packed, USBMOUSE_SAMPLE_SIZE);
+                }
+                pnode = (interruptNode *)ellNext(&pnode->node);
+            }
+        }
+        pasynManager->interruptEnd(pdpvt->asynInt32ArrayInterruptPvt);
+    }
+
+    pasynManager->interruptStart(pdpvt->asynInt32InterruptPvt, &pclientList);
+    oldSample = &pdpvt->oldSample;
+    for (i = 0, first = !pdpvt->transferDone ; i < nSamples ; i++, first = 0) {
+        sample = &samples[i];
+        pnode = (interruptNode *)ellFirst(pclientList);
+        while (pnode) {
+            asynInt32Interrupt *int32Interrupt = pnode->drvPvt;
+            const sampleField *f = sampleFieldFind(int32Interrupt->pasynUser,
+                                                   int32Interrupt->addr);
+            if (f && (f->type == SAMPLE_INT32)) {
+                epicsInt32 newValue = sampleInt32(sample, f);
+                if (first || (newValue != sampleInt32(oldSample, f))) {
+                    int32Interrupt->pasynUser->timestamp = sample->time;
+                    int32Interrupt->callback(int32Interrupt->userPvt,
+                                             int32Interrupt->pasynUser,
+                                             newValue);
+                }
+            }
+            else if (f && first) {
+                errlogPrintf("WARNING -- BAD USB MOUSE ASYN ADDRESSS %d\n",
+                                                            int32Interrupt->addr);
+            }
+            pnode = (interruptNode *)ellNext(&pnode->node);
+        }
+        oldSample = sample;
+    }
+    pasynManager->interruptEnd(pdpvt->asynInt32InterruptPvt);
+
+    pasynManager->interruptStart(pdpvt->asynFloat64InterruptPvt, &pclientList);
+    oldSample = &pdpvt->oldSample;
+    for (i = 0, first = !pdpvt->transferDone ; i < nSamples ; i++, first = 0) {
+        sample = &samples[i];
+        pnode = (interruptNode *)ellFirst(pclientList);
+        while (pnode) {
+            asynFloat64Interrupt *float64Interrupt = pnode->drvPvt;
+            const sampleField *f = sampleFieldFind(float64Interrupt->pasynUser,
+                                                   float64Interrupt->addr);
+            if (f && (f->type == SAMPLE_FLOAT64)) {
+                epicsFloat64 newValue = sampleFloat64(sample, f);
+                if (first || (newValue != sampleFloat64(oldSample, f))) {
+                    float64Interrupt->pasynUser->timestamp = sample->time;
+                    float64Interrupt->callback(float64Interrupt->userPvt,
+                                               float64Interrupt->pasynUser,
+                                               newValue);
+                }
+            }
+            else if (f && first) {
+                errlogPrintf("WARNING -- BAD USB MOUSE ASYN ADDRESSS %d\n",
+                                                        float64Interrupt->addr);
+            }
+            pnode = (interruptNode *)ellNext(&pnode->node);
+        }
+        oldSample = sample;
+    }
+    pasynManager->interruptEnd(pdpvt->asynFloat64InterruptPvt);
+    pdpvt->oldSample = samples[nSamples - 1];
+    pdpvt->transferDone = 1;
+}
+
+/*
+ * Batched dispatch.  A thread serving several ports brackets each
+ * wakeup with usbMouseBatchBegin and usbMouseBatchEnd.  Samples reaching
+ * a publish stage running on that thread in between are held, per port
+ * and in order, and sent on together at the end, so each port pays the
+ * fixed costs of dispatch once per wakeup rather than once per report.
  */
+static epicsThreadOnceId batchOnce = EPICS_THREAD_ONCE_INIT;
+static epicsThreadPrivateId batchId;
+
+static void
+batchInit(void *arg)
+{
+    batchId = epicsThreadPrivateCreate();
+}
+
+void
+usbMouseBatchBegin(usbMouseBatch *batch)
+{
+    epicsThreadOnce(&batchOnce, batchInit, NULL);
+    batch->first = batch->last = NULL;
+    batch->nSamples = 0;
+    batch->nPorts = 0;
+    epicsThreadPrivateSet(batchId, batch);
+}
+
 static void
-transferStatus(drvPvt *pdpvt)
+batchFlush(drvPvt *pdpvt)
+{
+    if (pdpvt->batchCount) {
+        transferStatus(pdpvt, pdpvt->batch, pdpvt->batchCount);
+        pdpvt->batchCount = 0;
+    }
+}
+
+void
+usbMouseBatchEnd(usbMouseBatch *batch)
+{
+    drvPvt *pdpvt;
+
+    epicsThreadPrivateSet(batchId, NULL);
+    while ((pdpvt = batch->first) != NULL) {
+        batch->first = pdpvt->batchNext;
+        pdpvt->batchNext = NULL;
+        pdpvt->batchListed = 0;
+        batchFlush(pdpvt);
+    }
+    batch->last = NULL;
+}
+
+static void *
+publishCreate(drvPvt *pdpvt, const char *args)
+{
+    return pdpvt;
+}
+
+static int
+publishProcess(void *pvt, usbMouseSample *sample)
+{
+    drvPvt *pdpvt = (drvPvt *)pvt;
+    usbMouseBatch *batch = batchId ? epicsThreadPrivateGet(batchId) : NULL;
+
+    if (batch == NULL) {
+        transferStatus(pdpvt, sample, 1);
+        return 1;
+    }
+    if (pdpvt->batch == NULL)
+        pdpvt->batch = callocMustSucceed(USBMOUSE_BATCH_SIZE,
+                                         sizeof *pdpvt->batch, "publishProcess");
+    if (!pdpvt->batchListed) {
+        pdpvt->batchListed = 1;
+        if (batch->last)
+            batch->last->batchNext = pdpvt;
+        else
+            batch->first = pdpvt;
+        batch->last = pdpvt;
+        batch->nPorts++;
+    }
+    else if (pdpvt->batchCount == USBMOUSE_BATCH_SIZE) {
+        batchFlush(pdpvt);
+    }
+    pdpvt->batch[pdpvt->batchCount++] = *sample;
+    batch->nSamples++;
+    return 1;
+}
+
+const usbMouseStageType usbMousePublishStage = {
+    "publish", publishCreate, publishProcess, NULL
+};
+
+/*
+ * Send a value to the records attached to one address
+ */
+void
+usbMousePublishInt32(drvPvt *pdpvt, int addr, epicsInt32 value,
+                     const epicsTimeStamp *time)
 {
     ELLLIST *pclientList;
     interruptNode *pnode;
-    int changedButtons = pdpvt->newMouse.buttons ^ pdpvt->oldMouse.buttons;
 
     pasynManager->interruptStart(pdpvt->asynInt32InterruptPvt, &pclientList);
     pnode = (interruptNode *)ellFirst(pclientList);
     while (pnode) {
         asynInt32Interrupt *int32Interrupt = pnode->drvPvt;
-        if ((int32Interrupt->addr >= 0) && (int32Interrupt->addr <= 7)) {
-            int bit = 1 << int32Interrupt->addr;
-            if (((changedButtons & bit) != 0)
-             || (pdpvt->transferDone == 0))
-                int32Interrupt->callback(int32Interrupt->userPvt,
-                                         int32Interrupt->pasynUser,
-                                         ((pdpvt->newMouse.buttons&bit)!=0));
+        if (USBMOUSE_FIELD(int32Interrupt->pasynUser, int32Interrupt->addr) == addr) {
+            int32Interrupt->pasynUser->timestamp = *time;
+            int32Interrupt->callback(int32Interrupt->userPvt,
+                                     int32Interrupt->pasynUser, value);
         }
-        else if ((int32Interrupt->addr >= 10) && (int32Interrupt->addr <= 12)) {
-            int newValue = 0, oldValue = 0;
-            switch (int32Interrupt->addr) {
-            case 10: newValue = pdpvt->newMouse.xPosition;
-                     oldValue = pdpvt->oldMouse.xPosition;
-                     break;
-            case 11: newValue = pdpvt->newMouse.yPosition;
-                     oldValue = pdpvt->oldMouse.yPosition;
-                     break;
-            case 12: newValue = pdpvt->newMouse.wheel;
-                     oldValue = pdpvt->oldMouse.wheel;
-                     break;
-            }
-            if ((newValue != oldValue)
-             || (pdpvt->transferDone == 0))
-                int32Interrupt->callback(int32Interrupt->userPvt,
-                                         int32Interrupt->pasynUser,
-                                         newValue);
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pdpvt->asynInt32InterruptPvt);
+}
+
+void
+usbMousePublishFloat64(drvPvt *pdpvt, int addr, epicsFloat64 value,
+                       const epicsTimeStamp *time)
+{
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+
+    pasynManager->interruptStart(pdpvt->asynFloat64InterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynFloat64Interrupt *float64Interrupt = pnode->drvPvt;
+        if (USBMOUSE_FIELD(float64Interrupt->pasynUser, float64Interrupt->addr) == addr) {
+            float64Interrupt->pasynUser->timestamp = *time;
+            float64Interrupt->callback(float64Interrupt->userPvt,
+                                       float64Interrupt->pasynUser, value);
         }
-        else if (pdpvt->transferDone == 0) {
-            errlogPrintf("WARNING -- BAD USB MOUSE ASYN ADDRESSS %d\n",
-                                                        int32Interrupt->addr);
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pdpvt->asynFloat64InterruptPvt);
+}
+
+void
+usbMousePublishInt32Array(drvPvt *pdpvt, int addr, epicsInt32 *value,
+                          size_t nElements, const epicsTimeStamp *time)
+{
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+
+    pasynManager->interruptStart(pdpvt->asynInt32ArrayInterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynInt32ArrayInterrupt *int32ArrayInterrupt = pnode->drvPvt;
+        if (USBMOUSE_FIELD(int32ArrayInterrupt->pasynUser, int32ArrayInterrupt->addr) == addr) {
+            int32ArrayInterrupt->pasynUser->timestamp = *time;
+            int32ArrayInterrupt->callback(int32ArrayInterrupt->userPvt,
+                                          int32ArrayInterrupt->pasynUser,
+                                          value, nElements);
+        }
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pdpvt->asynInt32ArrayInterruptPvt);
+}
+
+void
+usbMousePublishString(drvPvt *pdpvt, int addr, const char *value,
+                      const epicsTimeStamp *time)
+{
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+
+    pasynManager->interruptStart(pdpvt->asynOctetInterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynOctetInterrupt *octetInterrupt = pnode->drvPvt;
+        if (USBMOUSE_FIELD(octetInterrupt->pasynUser, octetInterrupt->addr) == addr) {
+            octetInterrupt->pasynUser->timestamp = *time;
+            octetInterrupt->callback(octetInterrupt->userPvt,
+                                     octetInterrupt->pasynUser,
+                                     (char *)value, strlen(value),
+                                     ASYN_EOM_END);
+        }
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pdpvt->asynOctetInterruptPvt);
+}
+
+#ifdef USBMOUSE_HAVE_INT64
+void
+usbMousePublishInt64(drvPvt *pdpvt, int addr, epicsInt64 value,
+                     const epicsTimeStamp *time)
+{
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+
+    pasynManager->interruptStart(pdpvt->asynInt64InterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynInt64Interrupt *int64Interrupt = pnode->drvPvt;
+        if (USBMOUSE_FIELD(int64Interrupt->pasynUser, int64Interrupt->addr) == addr) {
+            int64Interrupt->pasynUser->timestamp = *time;
+            int64Interrupt->callback(int64Interrupt->userPvt,
+                                     int64Interrupt->pasynUser, value);
+        }
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pdpvt->asynInt64InterruptPvt);
+}
+#endif
+
+/*
+ * Raw stage -- send the undecoded report to waveform records at a
+ * limited rate.  Much cheaper than ASYN_TRACEIO_DRIVER for watching
+ * what the device sends.
+ */
+typedef struct rawPvt {
+    drvPvt         *pdpvt;
+    double          minInterval;
+    int             havePublished;
+    epicsTimeStamp  lastTime;
+} rawPvt;
+
+static void *
+rawCreate(drvPvt *pdpvt, const char *args)
+{
+    rawPvt *pvt;
+    double rate = usbMouseArgDouble(args, "rate", 10.0);
+
+    if (rate <= 0) {
+        printf("raw stage rate must be positive\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "rawCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->minInterval = 1.0 / rate;
+    return pvt;
+}
+
+static int
+rawProcess(void *arg, usbMouseSample *sample)
+{
+    rawPvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+    int reportId;
+
+    if (pvt->havePublished
+     && (epicsTimeDiffInSeconds(&sample->time, &pvt->lastTime) < pvt->minInterval))
+        return 1;
+    pvt->havePublished = 1;
+    pvt->lastTime = sample->time;
+    reportId = (pdpvt->usesReportIds && (sample->nRead > 0)) ? sample->report[0] : 0;
+
+    pasynManager->interruptStart(pdpvt->asynInt8ArrayInterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynInt8ArrayInterrupt *int8ArrayInterrupt = pnode->drvPvt;
+        if (USBMOUSE_FIELD(int8ArrayInterrupt->pasynUser,
+                           int8ArrayInterrupt->addr) == USBMOUSE_ADDR_RAW) {
+            int8ArrayInterrupt->pasynUser->timestamp = sample->time;
+            int8ArrayInterrupt->callback(int8ArrayInterrupt->userPvt,
+                                         int8ArrayInterrupt->pasynUser,
+                                         (epicsInt8 *)sample->report,
+                                         sample->nRead);
+        }
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pdpvt->asynInt8ArrayInterruptPvt);
+
+    pasynManager->interruptStart(pdpvt->asynInt32InterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynInt32Interrupt *int32Interrupt = pnode->drvPvt;
+        int field = USBMOUSE_FIELD(int32Interrupt->pasynUser,
+                                   int32Interrupt->addr);
+        if ((field == USBMOUSE_ADDR_RAW_LENGTH)
+         || (field == USBMOUSE_ADDR_RAW_REPORT_ID)) {
+            int32Interrupt->pasynUser->timestamp = sample->time;
+            int32Interrupt->callback(int32Interrupt->userPvt,
+                                     int32Interrupt->pasynUser,
+                    field == USBMOUSE_ADDR_RAW_LENGTH ? sample->nRead : reportId);
         }
         pnode = (interruptNode *)ellNext(&pnode->node);
     }
     pasynManager->interruptEnd(pdpvt->asynInt32InterruptPvt);
-    pdpvt->oldMouse = pdpvt->newMouse;
-    pdpvt->transferDone = 1;
+    return 1;
+}
+
+static void
+rawReport(void *arg, FILE *fp, int details)
+{
+    rawPvt *pvt = arg;
+
+    fprintf(fp, "rate=%g", 1.0 / pvt->minInterval);
+}
+
+const usbMouseStageType usbMouseRawStage = {
+    "raw", rawCreate, rawProcess, rawReport
+};
+
+/*
+ * Pass a report just read into cbuf down the pipeline
+ */
+static void
+handleReport(drvPvt *pdpvt, int nRead, int resync)
+{
+    extern volatile int interruptAccept;
+
+#ifdef __linux__
+    usbMousePowerApply();
+#endif
+    pdpvt->nRead = nRead;
+    asynPrintIO(pdpvt->pasynUserForMessages, ASYN_TRACEIO_DRIVER, 
+            (char *)pdpvt->cbuf, pdpvt->nRead, "Read %d", pdpvt->nRead);
+
+    /*
+     * The pipeline can't change once records are being processed
+     */
+    if (interruptAccept) {
+        usbMouseSample *sample = &pdpvt->sample;
+        if (pdpvt->pipeline == NULL)
+            usbMousePipelineDefault(pdpvt);
+        pdpvt->clock->now(pdpvt->clock, &sample->time);
+        sample->sequence = pdpvt->packetCount;
+        sample->resync = resync;
+        sample->nRead = nRead;
+        memcpy(sample->report, pdpvt->cbuf, nRead);
+        usbMousePipelineRun(pdpvt->pipeline, sample);
+    }
+    if (!resync)
+        pdpvt->packetCount++;
+}
+
+void
+usbMouseHandleReport(drvPvt *pdpvt, int nRead)
+{
+    handleReport(pdpvt, nRead, 0);
+}
+
+/*
+ * Ask the device for its current state if a resync is due.  Called by
+ * the thread reading the device, between reads.
+ */
+void
+usbMouseResyncCheck(drvPvt *pdpvt)
+{
+    epicsTimeStamp now;
+    int s;
+
+    if (pdpvt->resyncInterval <= 0)
+        return;
+    pdpvt->clock->now(pdpvt->clock, &now);
+    if (epicsTimeDiffInSeconds(&now, &pdpvt->resyncTime) < pdpvt->resyncInterval)
+        return;
+    pdpvt->resyncTime = now;
+    s = pdpvt->transport->resync(pdpvt, pdpvt->cbuf, sizeof pdpvt->cbuf);
+    if (s <= 0) {
+        pdpvt->resyncErrors++;
+        return;
+    }
+    pdpvt->resyncCount++;
+    handleReport(pdpvt, s, 1);
 }
 
 /*
@@ -585,39 +1079,29 @@ readerThread(void *arg)
 {
     drvPvt *pdpvt = arg;
     int s;
-    extern volatile int interruptAccept;
 
     for (;;) {
         if (!pdpvt->isConnected) {
-            epicsThreadSleep(10.0);
-            if (connectToMouse(pdpvt) != asynSuccess)
+            pdpvt->clock->advance(pdpvt->clock, 10.0);
+            if (pdpvt->transport->connect(pdpvt) != asynSuccess)
                 continue;
         }
         for (;;) {
-            s = libusb_control_transfer(pdpvt->usbHandle,
-                    LIBUSB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-                    HID_REPORT_GET,
-                    (HID_RT_INPUT << 8) | 0x00,
-                    pdpvt->idNumber,
-                    pdpvt->cbuf, sizeof pdpvt->cbuf, USB_TIMEOUT);
-            if (s <= 0) {
-                asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR, 
-                                "libusb_control_transfer failed: %d\n", s);
-                libusb_close(pdpvt->usbHandle);
+            s = pdpvt->transport->read(pdpvt, pdpvt->cbuf, sizeof pdpvt->cbuf);
+            if (s < 0) {
+                pdpvt->transport->disconnect(pdpvt);
                 pdpvt->isConnected = 0;
                 break;
             }
-            pdpvt->nRead = s;
-            if (s > 0) pdpvt->newMouse.buttons = pdpvt->cbuf[0];
-            if (s > 1) pdpvt->newMouse.xPosition += signExtend(1, pdpvt->cbuf[1]);
-            if (s > 2) pdpvt->newMouse.yPosition += signExtend(1, pdpvt->cbuf[2]);
-            if (s > 3) pdpvt->newMouse.wheel += signExtend(1, pdpvt->cbuf[3]);
-            asynPrintIO(pdpvt->pasynUserForMessages, ASYN_TRACEIO_DRIVER, 
-                    (char *)pdpvt->cbuf, pdpvt->nRead, "Read %d", pdpvt->nRead);
-            if (interruptAccept)
-                transferStatus(pdpvt);
-            pdpvt->packetCount++;
-            epicsThreadSleep(pdpvt->pollInterval);
+            /*
+             * The resync reads into the same buffer, so the report
+             * just read has to be handled first
+             */
+            if (s > 0)
+                usbMouseHandleReport(pdpvt, s);
+            usbMouseResyncCheck(pdpvt);
+            if ((s > 0) && pdpvt->transport->polled)
+                pdpvt->clock->advance(pdpvt->clock, pdpvt->pollInterval);
         }
     }
 }
@@ -630,25 +1114,50 @@ static void
 report(void *pvt, FILE *fp, int details)
 {
     drvPvt *pdpvt = (drvPvt *)pvt;
-    const struct libusb_interface_descriptor *interface;
 
-    interface = pdpvt->usbConfigp->interface->altsetting;
     if (details >= 1) {
+        fprintf(fp, "          Transport: %s\n", pdpvt->transport->name);
+        if (pdpvt->deviceNode)
+            fprintf(fp, "        Device node: %s\n", pdpvt->deviceNode);
         fprintf(fp, "          Vendor ID: 0x%4.4X\n", pdpvt->idVendor);
         fprintf(fp, "         Product ID: 0x%4.4X\n", pdpvt->idProduct);
         fprintf(fp, "   Interface number: %d\n", pdpvt->idNumber);
-        fprintf(fp, "      Poll interval: %.3g ms\n", pdpvt->pollInterval * 1000);
-        fprintf(fp, "    Maximum current: %d mA\n", pdpvt->usbConfigp->MaxPower * 2);
+        if (pdpvt->transport->polled)
+            fprintf(fp, "      Poll interval: %.3g ms\n", pdpvt->pollInterval * 1000);
+        if (pdpvt->resyncInterval > 0)
+            fprintf(fp, "    Resync interval: %.3g s (%lu done, %lu failed, %d corrections)\n",
+                                pdpvt->resyncInterval, pdpvt->resyncCount,
+                                pdpvt->resyncErrors, (int)pdpvt->resyncDiscrepancies);
+        fprintf(fp, "              Clock: %s\n", pdpvt->clock->name);
+#ifdef __linux__
+        usbMouseLoopReport(pdpvt, fp, details);
+#endif
+        if (pdpvt->usbDevice.config) {
+            fprintf(fp, "    Maximum current: %d mA\n", pdpvt->usbDevice.config->MaxPower * 2);
+            fprintf(fp, "        USB reports: %lu (%lu timeouts, %lu errors)\n",
+                                pdpvt->usbDevice.reports, pdpvt->usbDevice.timeouts,
+                                pdpvt->usbDevice.errors);
+        }
     }
 
 #if ASYN_LONG_REPORTS
     if (details >= 1) {
-        fprintf(fp, "       Manufacturer: \"%s\"\n", pdpvt->manufacturerString);
-        fprintf(fp, "            Product: \"%s\"\n", pdpvt->productString);
-        fprintf(fp, "      Serial number: \"%s\"\n", pdpvt->serialNumberString);
+        if (pdpvt->manufacturerString)
+            fprintf(fp, "       Manufacturer: \"%s\"\n", pdpvt->manufacturerString);
+        if (pdpvt->productString)
+            fprintf(fp, "            Product: \"%s\"\n", pdpvt->productString);
+        if (pdpvt->serialNumberString)
+            fprintf(fp, "      Serial number: \"%s\"\n", pdpvt->serialNumberString);
+    }
+    if ((details >= 2) && (pdpvt->usbDevice.config == NULL)) {
+        fprintf(fp, "  HID Report Length: %d\n", pdpvt->HIDreportLength);
+        if (pdpvt->HIDreport)
+            showHIDreport(fp, pdpvt);
     }
-    if (details >= 2) {
+    else if (details >= 2) {
         int i;
+        const struct libusb_interface_descriptor *interface =
+                                        pdpvt->usbDevice.config->interface->altsetting;
         const struct libusb_endpoint_descriptor *endpoint = interface->endpoint;
         if (interface->bInterfaceClass == LIBUSB_CLASS_HID) {
             const unsigned char *buf;
@@ -716,6 +1225,7 @@ report(void *pvt, FILE *fp, int details)
     if (details >= 3) {
         fprintf(fp, "       Packet Count: %lu\n", pdpvt->packetCount);
     }
+    usbMousePipelineReport(pdpvt, fp, details);
     if (details >= 4) {
         int i;
         fprintf(fp, "    ");
@@ -741,35 +1251,177 @@ disconnect(void *pvt, asynUser *pasynUser)
 static asynCommon commonMethods = { report, connect, disconnect };
 
 /*
- * asynInt32 methods
- * There are none!
- * Everything is handled with interrupt callbacks
+ * asynDrvUser methods
+ * A record naming a field in its drvInfo gets the field's address in
+ * its reason; see USBMOUSE_FIELD.
  */
-static asynInt32 int32Methods;
+static asynStatus
+drvUserCreate(void *pvt, asynUser *pasynUser, const char *drvInfo,
+              const char **pptypeName, size_t *psize)
+{
+    int addr;
 
-static void
+    if ((drvInfo == NULL) || (*drvInfo == '\0')) {
+        pasynUser->reason = 0;
+        return asynSuccess;
+    }
+    if ((addr = usbMouseFieldFind(drvInfo)) < 0) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                                            "No field named \"%s\"", drvInfo);
+        return asynError;
+    }
+    pasynUser->reason = addr + USBMOUSE_REASON_OFFSET;
+    if (pptypeName)
+        *pptypeName = NULL;
+    if (psize)
+        *psize = 0;
+    return asynSuccess;
+}
+
+static asynStatus
+drvUserGetType(void *pvt, asynUser *pasynUser, const char **pptypeName,
+               size_t *psize)
+{
+    if (pptypeName)
+        *pptypeName = NULL;
+    if (psize)
+        *psize = 0;
+    return asynSuccess;
+}
+
+static asynStatus
+drvUserDestroy(void *pvt, asynUser *pasynUser)
+{
+    return asynSuccess;
+}
+static asynDrvUser drvUserMethods = { drvUserCreate, drvUserGetType,
+                                      drvUserDestroy };
+
+/*
+ * asynInt32, asynFloat64, asynInt8Array, asynInt32Array, asynOctet and,
+ * with asyn R4-33 or later, asynInt64 methods
+ * Values from the mouse are handled with interrupt callbacks.
+ * Writes go to the pipeline stage that owns the address.
+ */
+static asynStatus
+stageWrite(drvPvt *pdpvt, asynUser *pasynUser, double value)
+{
+    int addr;
+    asynStatus status;
+
+    status = pasynManager->getAddr(pasynUser, &addr);
+    if (status != asynSuccess)
+        return status;
+    addr = USBMOUSE_FIELD(pasynUser, addr);
+    status = usbMousePipelineWrite(pdpvt, addr, value);
+    if (status != asynSuccess)
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                                "Can't write %g to address %d", value, addr);
+    return status;
+}
+
+static asynStatus
+int32Write(void *pvt, asynUser *pasynUser, epicsInt32 value)
+{
+    return stageWrite(pvt, pasynUser, value);
+}
+
+static asynStatus
+float64Write(void *pvt, asynUser *pasynUser, epicsFloat64 value)
+{
+    return stageWrite(pvt, pasynUser, value);
+}
+
+static asynStatus
+octetWrite(void *pvt, asynUser *pasynUser, const char *data, size_t numchars,
+           size_t *nbytesTransfered)
+{
+    drvPvt *pdpvt = pvt;
+    char value[256];
+    int addr;
+    asynStatus status;
+
+    status = pasynManager->getAddr(pasynUser, &addr);
+    if (status != asynSuccess)
+        return status;
+    addr = USBMOUSE_FIELD(pasynUser, addr);
+    if (numchars >= sizeof value) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                                                        "String too long");
+        return asynError;
+    }
+    memcpy(value, data, numchars);
+    value[numchars] = '\0';
+    status = usbMousePipelineWriteString(pdpvt, addr, value);
+    if (status != asynSuccess) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                                "Can't write \"%s\" to address %d", value, addr);
+        return status;
+    }
+    *nbytesTransfered = numchars;
+    return asynSuccess;
+}
+
+static asynInt32 int32Methods = { int32Write };
+static asynFloat64 float64Methods = { float64Write };
+static asynInt8Array int8ArrayMethods;
+static asynInt32Array int32ArrayMethods;
+static asynOctet octetMethods = { octetWrite };
+#ifdef USBMOUSE_HAVE_INT64
+static asynInt64 int64Methods;
+#endif
+
+void
 usbMouseConfigure(const char *portName, int idVendor, int idProduct,
-                  int idNumber, int interval, int priority)
+                  int idNumber, int interval, int priority,
+                  const char *transportSpec)
 {
     drvPvt *pdpvt;
     asynStatus status;
     epicsThreadId tid;
     char *threadName;
+    const usbMouseTransport *transport = NULL;
+    size_t n;
+    int i;
 
     /*
      * Handle defaults
      */
     if (priority <= 0) priority = epicsThreadPriorityMedium;
+    if ((transportSpec == NULL) || (*transportSpec == '\0'))
+        transportSpec = controlTransport.name;
+    n = strcspn(transportSpec, " \t");
+    for (i = 0 ; i < NTRANSPORTS ; i++) {
+        if ((strlen(transports[i]->name) == n)
+         && (strncmp(transports[i]->name, transportSpec, n) == 0)) {
+            transport = transports[i];
+            break;
+        }
+    }
+    if (transport == NULL) {
+        printf("Unknown transport \"%s\"\n", transportSpec);
+        return;
+    }
 
     /*
      * Set up local storage
      */
-    pdpvt = (drvPvt *)callocMustSucceed(1, sizeof(drvPvt), portName);
+    pdpvt = (drvPvt *)usbMouseCallocAligned(sizeof(drvPvt), portName);
     pdpvt->portName = epicsStrDup(portName);
+    pdpvt->priority = priority;
+    pdpvt->transport = transport;
+    pdpvt->transportArgs = epicsStrDup(transportSpec + n);
+    pdpvt->fd = -1;
+    pdpvt->clock = usbMouseClockReal();
     if (interval <= 0)
         pdpvt->useDevicePollInterval = 1;
     else
         pdpvt->pollInterval = interval / 1000.0;
+    pdpvt->resyncInterval = usbMouseArgDouble(pdpvt->transportArgs, "resync", 0);
+    if ((pdpvt->resyncInterval > 0) && (transport->resync == NULL)) {
+        printf("The %s transport can't resynchronize.\n", transport->name);
+        pdpvt->resyncInterval = 0;
+    }
 
     /*
      * Create our port (autoconnect)
@@ -799,6 +1451,66 @@ usbMouseConfigure(const char *portName, int idVendor, int idProduct,
     }
     pasynManager->registerInterruptSource(pdpvt->portName, &pdpvt->asynInt32,
                                                 &pdpvt->asynInt32InterruptPvt);
+    pdpvt->asynDrvUser.interfaceType = asynDrvUserType;
+    pdpvt->asynDrvUser.pinterface  = &drvUserMethods;
+    pdpvt->asynDrvUser.drvPvt = pdpvt;
+    status = pasynManager->registerInterface(pdpvt->portName, &pdpvt->asynDrvUser);
+    if (status != asynSuccess) {
+        printf("registerInterface(asynDrvUser) failed\n");
+        return;
+    }
+    pdpvt->asynFloat64.interfaceType = asynFloat64Type;
+    pdpvt->asynFloat64.pinterface  = &float64Methods;
+    pdpvt->asynFloat64.drvPvt = pdpvt;
+    status = pasynFloat64Base->initialize(pdpvt->portName, &pdpvt->asynFloat64);
+    if (status != asynSuccess) {
+        printf("pasynFloat64Base->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pdpvt->portName, &pdpvt->asynFloat64,
+                                                &pdpvt->asynFloat64InterruptPvt);
+    pdpvt->asynInt8Array.interfaceType = asynInt8ArrayType;
+    pdpvt->asynInt8Array.pinterface  = &int8ArrayMethods;
+    pdpvt->asynInt8Array.drvPvt = pdpvt;
+    status = pasynInt8ArrayBase->initialize(pdpvt->portName, &pdpvt->asynInt8Array);
+    if (status != asynSuccess) {
+        printf("pasynInt8ArrayBase->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pdpvt->portName, &pdpvt->asynInt8Array,
+                                                &pdpvt->asynInt8ArrayInterruptPvt);
+    pdpvt->asynInt32Array.interfaceType = asynInt32ArrayType;
+    pdpvt->asynInt32Array.pinterface  = &int32ArrayMethods;
+    pdpvt->asynInt32Array.drvPvt = pdpvt;
+    status = pasynInt32ArrayBase->initialize(pdpvt->portName, &pdpvt->asynInt32Array);
+    if (status != asynSuccess) {
+        printf("pasynInt32ArrayBase->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pdpvt->portName, &pdpvt->asynInt32Array,
+                                                &pdpvt->asynInt32ArrayInterruptPvt);
+    pdpvt->asynOctet.interfaceType = asynOctetType;
+    pdpvt->asynOctet.pinterface  = &octetMethods;
+    pdpvt->asynOctet.drvPvt = pdpvt;
+    status = pasynOctetBase->initialize(pdpvt->portName, &pdpvt->asynOctet, 0, 0, 0);
+    if (status != asynSuccess) {
+        printf("pasynOctetBase->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pdpvt->portName, &pdpvt->asynOctet,
+                                                &pdpvt->asynOctetInterruptPvt);
+#ifdef USBMOUSE_HAVE_INT64
+    pdpvt->asynInt64.interfaceType = asynInt64Type;
+    pdpvt->asynInt64.pinterface  = &int64Methods;
+    pdpvt->asynInt64.drvPvt = pdpvt;
+    status = pasynInt64Base->initialize(pdpvt->portName, &pdpvt->asynInt64);
+    if (status != asynSuccess) {
+        printf("pasynInt64Base->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pdpvt->portName, &pdpvt->asynInt64,
+                                                &pdpvt->asynInt64InterruptPvt);
+#endif
 
     /*
      * Set up dummy asynUser for controlling diagnostic messages
@@ -814,8 +1526,20 @@ usbMouseConfigure(const char *portName, int idVendor, int idProduct,
      */
     pdpvt->idVendor = idVendor;
     pdpvt->idProduct = idProduct;
-    libusb_init(&pdpvt->usbContext);
-    connectToMouse(pdpvt);
+    pdpvt->idNumber = idNumber;
+    if (usbMouseDeviceInit(&pdpvt->usbDevice, idVendor, idProduct, idNumber) != 0)
+        printf("Warning -- %s\n", pdpvt->usbDevice.errorMessage);
+    pdpvt->transport->connect(pdpvt);
+    pdpvt->next = portList;
+    portList = pdpvt;
+
+#ifdef __linux__
+    /*
+     * Use the event loop pool if there is one and the transport allows
+     */
+    if (usbMouseLoopAdd(pdpvt) == asynSuccess)
+        return;
+#endif
 
     /*
      * Start the reader thread.
@@ -843,21 +1567,30 @@ static const iocshArg usbMouseConfigureArg2 = { "product ID",iocshArgInt};
 static const iocshArg usbMouseConfigureArg3 = { "device number",iocshArgInt};
 static const iocshArg usbMouseConfigureArg4 = { "poll interval(ms)",iocshArgInt};
 static const iocshArg usbMouseConfigureArg5 = { "priority",iocshArgInt};
+static const iocshArg usbMouseConfigureArg6 = { "transport",iocshArgString};
 static const iocshArg *usbMouseConfigureArgs[] = {
                     &usbMouseConfigureArg0, &usbMouseConfigureArg1,
                     &usbMouseConfigureArg2, &usbMouseConfigureArg3,
-                    &usbMouseConfigureArg4, &usbMouseConfigureArg5 };
+                    &usbMouseConfigureArg4, &usbMouseConfigureArg5,
+                    &usbMouseConfigureArg6 };
 static const iocshFuncDef usbMouseConfigureFuncDef =
-      {"usbMouseConfigure",6,usbMouseConfigureArgs};
+      {"usbMouseConfigure",7,usbMouseConfigureArgs};
 static void usbMouseConfigureCallFunc(const iocshArgBuf *args)
 {
     usbMouseConfigure(args[0].sval, args[1].ival, args[2].ival,
-                      args[3].ival, args[4].ival, args[5].ival);
+                      args[3].ival, args[4].ival, args[5].ival,
+                      args[6].sval);
 }
 
 static void
 usbMouseSup_RegisterCommands(void)
 {
     iocshRegister(&usbMouseConfigureFuncDef,usbMouseConfigureCallFunc);
+#ifdef __linux__
+    usbMouseBench_RegisterCommands();
+    usbMouseLoop_RegisterCommands();
+    usbMouseGadget_RegisterCommands();
+    usbMousePower_RegisterCommands();
+#endif
 }
 epicsExportRegistrar(usbMouseSup_RegisterCommands);
@@ -0,0 +1,723 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Transport comparison benchmark
+ *
+ * A virtual mouse is created through the kernel's uhid interface and
+ * driven at fixed report rates.  Every report moves the mouse one count
+ * in X, so the X value delivered to an asyn callback identifies the
+ * report, which gives the latency from injection to callback.  The CPU
+ * time per report is that of the thread making the callbacks, which
+ * with an inline publish stage is the port's reader thread.
+ *
+ * The uhid device is seen by the hidraw and evdev transports only.
+ * The libusb transports (control and interrupt, both of which go
+ * through usbfs) need a device on a real or emulated USB bus, which
+ * the raw-gadget mouse of usbMouseGadget.c provides.  It is seen by
+ * every transport but the simulator.
+ *
+ * The throughput benchmark needs no device.  It counts the reports read
+ * and the samples finished by the last stage of each port over an
+ * interval, which with sim ports on virtual clocks and queued stages
+ * measures how fast reading and processing threads can run side by side.
+ *
+ * The dispatch benchmark needs no device either.  It times the publish
+ * stage sending samples from many ports to stand-in records, one sample
+ * at a time and batched per wakeup as the event loop pool does.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+#include <asynDriver.h>
+#include <asynInt32.h>
+
+#include "usbMousePvt.h"
+
+/*
+ * Boot protocol mouse: 3 buttons, 8-bit relative X, Y and wheel
+ */
+const unsigned char usbMouseBootReportDescriptor[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05,
+    0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38,
+    0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03, 0x81, 0x06,
+    0xC0, 0xC0
+};
+const int usbMouseBootReportDescriptorSize = sizeof usbMouseBootReportDescriptor;
+#define MOUSE_REPORT_SIZE 4
+
+/*
+ * Virtual device
+ */
+static int uhidFd = -1;
+static epicsMutexId uhidLock;
+static unsigned char currentReport[MOUSE_REPORT_SIZE];  /* buttons only */
+static int (*inject)(const unsigned char *report, int size);
+static int (*reaches)(const usbMouseTransport *transport);
+
+/*
+ * Current run
+ */
+static double *injectTimes;
+static int nInject;
+
+typedef struct benchPort {
+    drvPvt          *pdpvt;
+    asynUser        *pasynUser;
+    asynInt32       *pasynInt32;
+    void            *int32Pvt;
+    void            *registrarPvt;
+    int              reachable;
+    volatile int     running;
+    epicsInt32       lastX;
+    epicsInt32       baseX;
+    int              received;
+    double          *latency;
+    int              haveCpu;
+    double           firstCpu;
+    double           lastCpu;
+} benchPort;
+
+static double
+clockSeconds(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+/*
+ * Answer requests from the kernel.  GET_REPORT gets the current state,
+ * the buttons of the last report injected with no motion.
+ */
+static void
+uhidThread(void *arg)
+{
+    struct uhid_event ev, reply;
+
+    for (;;) {
+        if (read(uhidFd, &ev, sizeof ev) <= 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (ev.type == UHID_GET_REPORT) {
+            memset(&reply, 0, sizeof reply);
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = ev.u.get_report.id;
+            reply.u.get_report_reply.size = MOUSE_REPORT_SIZE;
+            epicsMutexMustLock(uhidLock);
+            memcpy(reply.u.get_report_reply.data, currentReport, MOUSE_REPORT_SIZE);
+            epicsMutexUnlock(uhidLock);
+            if (write(uhidFd, &reply, sizeof reply) < 0)
+                break;
+        }
+    }
+    printf("usbMouseBench: uhid read failed: %s\n", strerror(errno));
+}
+
+static int
+uhidInject(const unsigned char *report, int size)
+{
+    struct uhid_event ev;
+    int status;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_INPUT2;
+    ev.u.input2.size = size;
+    memcpy(ev.u.input2.data, report, size);
+    epicsMutexMustLock(uhidLock);
+    if (size > 0)
+        currentReport[0] = report[0];
+    status = write(uhidFd, &ev, sizeof ev) == sizeof ev ? 0 : -1;
+    epicsMutexUnlock(uhidLock);
+    return status;
+}
+
+static int
+uhidReaches(const usbMouseTransport *transport)
+{
+    return (transport == &usbMouseHidrawTransport)
+        || (transport == &usbMouseEvdevTransport);
+}
+
+static int
+gadgetReaches(const usbMouseTransport *transport)
+{
+    return transport != &usbMouseSimTransport;
+}
+
+/*
+ * Create the virtual mouse
+ */
+static void
+usbMouseBenchDevice(int idVendor, int idProduct, const char *type,
+                    const char *udc)
+{
+    struct uhid_event ev;
+
+    if (inject) {
+        printf("Benchmark device already exists.\n");
+        return;
+    }
+    if (type && (strcmp(type, "gadget") == 0)) {
+        if (usbMouseGadgetCreate(idVendor, idProduct, udc) == 0) {
+            inject = usbMouseGadgetInject;
+            reaches = gadgetReaches;
+        }
+        return;
+    }
+    if (type && *type && (strcmp(type, "uhid") != 0)) {
+        printf("Benchmark device type must be uhid or gadget.\n");
+        return;
+    }
+    if ((uhidFd = open("/dev/uhid", O_RDWR | O_CLOEXEC)) < 0) {
+        printf("Can't open /dev/uhid: %s\n", strerror(errno));
+        return;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_CREATE2;
+    strcpy((char *)ev.u.create2.name, "usbMouse benchmark mouse");
+    strcpy((char *)ev.u.create2.phys, "usbMouseBench/input0");
+    ev.u.create2.rd_size = usbMouseBootReportDescriptorSize;
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = idVendor;
+    ev.u.create2.product = idProduct;
+    memcpy(ev.u.create2.rd_data, usbMouseBootReportDescriptor,
+                                        usbMouseBootReportDescriptorSize);
+    if (write(uhidFd, &ev, sizeof ev) != sizeof ev) {
+        printf("Can't create uhid device: %s\n", strerror(errno));
+        close(uhidFd);
+        uhidFd = -1;
+        return;
+    }
+    uhidLock = epicsMutexMustCreate();
+    epicsThreadCreate("usbMouseUhid", epicsThreadPriorityHigh,
+                      epicsThreadGetStackSize(epicsThreadStackSmall),
+                      uhidThread, NULL);
+    inject = uhidInject;
+    reaches = uhidReaches;
+}
+
+static void
+benchCallback(void *userPvt, asynUser *pasynUser, epicsInt32 value)
+{
+    benchPort *bp = userPvt;
+    int seq = value - bp->baseX;
+
+    bp->lastX = value;
+    if (!bp->running || (seq < 1) || (seq > nInject) || (bp->received >= nInject))
+        return;
+    bp->latency[bp->received++] = clockSeconds(CLOCK_MONOTONIC) - injectTimes[seq];
+    bp->lastCpu = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    if (!bp->haveCpu) {
+        bp->firstCpu = bp->lastCpu;
+        bp->haveCpu = 1;
+    }
+}
+
+/*
+ * Latency histogram bin upper edges in microseconds
+ */
+static const double histogramEdges[] = {
+    10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+#define NEDGES (sizeof histogramEdges / sizeof histogramEdges[0])
+
+static void
+printHistogramHeader(void)
+{
+    int i;
+
+    printf("%-21s", "  Latency (us)");
+    for (i = 0 ; i < NEDGES ; i++)
+        printf(" %6s%-4g", "<", histogramEdges[i]);
+    printf(" %6s%-4g\n", ">=", histogramEdges[NEDGES - 1]);
+}
+
+/*
+ * Percentage of reports in each bin -- latencies are sorted
+ */
+static void
+printHistogram(const double *latency, int n)
+{
+    int i, bin;
+
+    printf("%-21s", "");
+    for (i = 0, bin = 0 ; bin <= NEDGES ; bin++) {
+        int first = i;
+        while ((i < n) && ((bin == NEDGES) || (latency[i] * 1e6 < histogramEdges[bin])))
+            i++;
+        printf(" %9.2f%%", 100.0 * (i - first) / n);
+    }
+    printf("\n");
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static asynStatus
+benchAttach(benchPort *bp, const char *portName)
+{
+    asynInterface *pasynInterface;
+
+    bp->pdpvt = usbMouseFindPort(portName);
+    if (bp->pdpvt == NULL) {
+        printf("No such port: %s\n", portName);
+        return asynError;
+    }
+    bp->reachable = reaches(bp->pdpvt->transport);
+    bp->pasynUser = pasynManager->createAsynUser(NULL, NULL);
+    if ((pasynManager->connectDevice(bp->pasynUser, portName, USBMOUSE_ADDR_X) != asynSuccess)
+     || ((pasynInterface = pasynManager->findInterface(bp->pasynUser, asynInt32Type, 1)) == NULL)) {
+        printf("Can't connect to %s\n", portName);
+        return asynError;
+    }
+    bp->pasynInt32 = pasynInterface->pinterface;
+    bp->int32Pvt = pasynInterface->drvPvt;
+    return bp->pasynInt32->registerInterruptUser(bp->int32Pvt, bp->pasynUser,
+                                        benchCallback, bp, &bp->registrarPvt);
+}
+
+static void
+benchRun(benchPort *ports, int nPorts, double rate, double seconds,
+         int histogram)
+{
+    struct timespec next;
+    unsigned char report[MOUSE_REPORT_SIZE] = { 0, 1, 0, 0 };
+    double period = 1.0 / rate;
+    int i, p;
+
+    nInject = (int)(rate * seconds);
+    injectTimes = callocMustSucceed(nInject + 1, sizeof *injectTimes, "benchRun");
+    for (p = 0 ; p < nPorts ; p++) {
+        benchPort *bp = &ports[p];
+        bp->latency = callocMustSucceed(nInject, sizeof *bp->latency, "benchRun");
+        bp->received = 0;
+        bp->haveCpu = 0;
+        bp->baseX = bp->lastX;
+        bp->running = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (i = 1 ; i <= nInject ; i++) {
+        next.tv_nsec += (long)(period * 1e9);
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            continue;
+        injectTimes[i] = clockSeconds(CLOCK_MONOTONIC);
+        if (inject(report, sizeof report) != 0) {
+            printf("Injection failed: %s\n", strerror(errno));
+            nInject = i - 1;
+            break;
+        }
+    }
+    epicsThreadSleep(0.5);
+
+    for (p = 0 ; p < nPorts ; p++) {
+        benchPort *bp = &ports[p];
+        double sum = 0;
+        int n;
+
+        bp->running = 0;
+        n = bp->received;
+        printf("%-10s %-10s %6g %8d ", bp->pdpvt->portName,
+                                    bp->pdpvt->transport->name, rate, nInject);
+        if (!bp->reachable) {
+            printf("     n/a (needs a USB device)\n");
+        }
+        else if (n == 0) {
+            printf("%8d %6.2f\n", 0, 100.0);
+        }
+        else {
+            qsort(bp->latency, n, sizeof bp->latency[0], compareDouble);
+            for (i = 0 ; i < n ; i++)
+                sum += bp->latency[i];
+            printf("%8d %6.2f %8.2f %8.1f %8.1f %8.1f %8.1f\n", n,
+                100.0 * (nInject - n) / nInject,
+                n > 1 ? (bp->lastCpu - bp->firstCpu) * 1e6 / (n - 1) : 0.0,
+                sum * 1e6 / n,
+                bp->latency[n / 2] * 1e6,
+                bp->latency[(int)(n * 0.99)] * 1e6,
+                bp->latency[n - 1] * 1e6);
+            if (histogram)
+                printHistogram(bp->latency, n);
+        }
+        free(bp->latency);
+        bp->latency = NULL;
+    }
+    free(injectTimes);
+    injectTimes = NULL;
+}
+
+static void
+usbMouseBenchmark(const char *portNames, const char *rates, double seconds,
+                  int histogram)
+{
+    benchPort *ports;
+    char *list, *tok, *save;
+    int nPorts = 0, maxPorts, p;
+    extern volatile int interruptAccept;
+
+    if (inject == NULL) {
+        printf("No benchmark device -- run usbMouseBenchDevice before usbMouseConfigure.\n");
+        return;
+    }
+    if (!interruptAccept) {
+        printf("Run the benchmark after iocInit.\n");
+        return;
+    }
+    if ((portNames == NULL) || (*portNames == '\0')) {
+        printf("Usage: usbMouseBenchmark \"port ...\" [\"rate ...\"] [seconds] [histogram]\n");
+        return;
+    }
+    if ((rates == NULL) || (*rates == '\0'))
+        rates = "125 500 1000 8000";
+    if (seconds <= 0)
+        seconds = 5;
+    maxPorts = strlen(portNames) / 2 + 1;
+    ports = callocMustSucceed(maxPorts, sizeof *ports, "usbMouseBenchmark");
+    list = epicsStrDup(portNames);
+    for (tok = strtok_r(list, " \t,", &save) ; tok ; tok = strtok_r(NULL, " \t,", &save)) {
+        if (benchAttach(&ports[nPorts], tok) == asynSuccess)
+            nPorts++;
+    }
+    free(list);
+    if (nPorts == 0) {
+        free(ports);
+        return;
+    }
+
+    printf("%-10s %-10s %6s %8s %8s %6s %8s %8s %8s %8s %8s\n",
+        "Port", "Transport", "Rate", "Sent", "Received", "Loss%",
+        "CPU/rpt", "Mean", "p50", "p99", "Max");
+    printf("%-10s %-10s %6s %8s %8s %6s %8s %8s %8s %8s %8s\n",
+        "", "", "(Hz)", "", "", "", "(us)", "(us)", "(us)", "(us)", "(us)");
+    if (histogram)
+        printHistogramHeader();
+    list = epicsStrDup(rates);
+    for (tok = strtok_r(list, " \t,", &save) ; tok ; tok = strtok_r(NULL, " \t,", &save)) {
+        double rate = strtod(tok, NULL);
+        if (rate > 0) {
+            epicsThreadSleep(0.5);
+            benchRun(ports, nPorts, rate, seconds, histogram);
+        }
+    }
+    free(list);
+
+    for (p = 0 ; p < nPorts ; p++) {
+        benchPort *bp = &ports[p];
+        bp->pasynInt32->cancelInterruptUser(bp->int32Pvt, bp->pasynUser,
+                                                            bp->registrarPvt);
+        pasynManager->freeAsynUser(bp->pasynUser);
+    }
+    free(ports);
+}
+
+/*
+ * Count the work done by each port over an interval
+ */
+static void
+usbMouseThroughput(const char *portNames, double seconds)
+{
+    drvPvt **ports;
+    unsigned long *counts;
+    char *list, *tok, *save;
+    int nPorts = 0, maxPorts, p, pass;
+    double start = 0, elapsed, totalReports = 0, totalSamples = 0;
+    unsigned long totalDrops = 0;
+    extern volatile int interruptAccept;
+
+    if (!interruptAccept) {
+        printf("Run the benchmark after iocInit.\n");
+        return;
+    }
+    if ((portNames == NULL) || (*portNames == '\0')) {
+        printf("Usage: usbMouseThroughput \"port ...\" [seconds]\n");
+        return;
+    }
+    if (seconds <= 0)
+        seconds = 5;
+    maxPorts = strlen(portNames) / 2 + 1;
+    ports = callocMustSucceed(maxPorts, sizeof *ports, "usbMouseThroughput");
+    counts = callocMustSucceed(maxPorts * 3, sizeof *counts, "usbMouseThroughput");
+    list = epicsStrDup(portNames);
+    for (tok = strtok_r(list, " \t,", &save) ; tok ; tok = strtok_r(NULL, " \t,", &save)) {
+        if ((ports[nPorts] = usbMouseFindPort(tok)) != NULL)
+            nPorts++;
+        else
+            printf("No such port: %s\n", tok);
+    }
+    free(list);
+
+    /*
+     * Pass 0 takes the starting counts, pass 1 the differences
+     */
+    for (pass = 0 ; pass < 2 ; pass++) {
+        if (pass) {
+            epicsThreadSleep(seconds);
+            elapsed = clockSeconds(CLOCK_MONOTONIC) - start;
+        }
+        else {
+            start = clockSeconds(CLOCK_MONOTONIC);
+        }
+        for (p = 0 ; p < nPorts ; p++) {
+            usbMouseStage *stage, *last = NULL;
+            unsigned long drops = 0, *c = &counts[p * 3];
+
+            for (stage = ports[p]->pipeline ; stage ; stage = stage->next) {
+                drops += stage->dropCount;
+                last = stage;
+            }
+            if (pass) {
+                c[0] = ports[p]->packetCount - c[0];
+                c[1] = (last ? last->sampleCount : 0) - c[1];
+                c[2] = drops - c[2];
+            }
+            else {
+                c[0] = ports[p]->packetCount;
+                c[1] = last ? last->sampleCount : 0;
+                c[2] = drops;
+            }
+        }
+    }
+
+    printf("%-10s %12s %12s %10s\n", "Port", "Reports/s", "Samples/s", "Dropped");
+    for (p = 0 ; p < nPorts ; p++) {
+        unsigned long *c = &counts[p * 3];
+        printf("%-10s %12.0f %12.0f %10lu\n", ports[p]->portName,
+                            c[0] / elapsed, c[1] / elapsed, c[2]);
+        totalReports += c[0];
+        totalSamples += c[1];
+        totalDrops += c[2];
+    }
+    printf("%-10s %12.0f %12.0f %10lu\n", "Total", totalReports / elapsed,
+                            totalSamples / elapsed, totalDrops);
+    free(counts);
+    free(ports);
+}
+
+/*
+ * Cost of dispatching samples to records, one sample at a time and in
+ * per-wakeup batches, over many ports.  Ports DISP0, DISP1, ... are
+ * created on first use with a sim transport that stops after one report,
+ * and each gets callbacks standing in for records on a button and the X
+ * and Y positions.  Every sample moves X and Y, so every sample makes
+ * two callbacks, and the publish stage itself is timed.  The ports, with
+ * their reader threads and callbacks, stay for the life of the IOC and
+ * are reused by later runs.
+ */
+static unsigned long dispatchCallbacks;
+
+static void
+dispatchCallback(void *userPvt, asynUser *pasynUser, epicsInt32 value)
+{
+    dispatchCallbacks++;
+}
+
+static drvPvt *
+dispatchPort(int index)
+{
+    static const int addrs[] = { USBMOUSE_ADDR_BUTTON_FIRST,
+                                 USBMOUSE_ADDR_X, USBMOUSE_ADDR_Y };
+    char portName[40];
+    drvPvt *pdpvt;
+    int i;
+
+    epicsSnprintf(portName, sizeof portName, "DISP%d", index);
+    if ((pdpvt = usbMouseFindPort(portName)) != NULL)
+        return pdpvt;
+    if (index == 0)
+        printf("Creating benchmark ports DISP0... -- they stay until the IOC exits.\n");
+    usbMouseConfigure(portName, 0, 0, 0, 0, 0, "sim count=1");
+    if ((pdpvt = usbMouseFindPort(portName)) == NULL)
+        return NULL;
+    for (i = 0 ; i < sizeof addrs / sizeof addrs[0] ; i++) {
+        asynUser *pasynUser = pasynManager->createAsynUser(NULL, NULL);
+        asynInterface *pasynInterface;
+        asynInt32 *pasynInt32;
+        void *registrarPvt;
+
+        if ((pasynManager->connectDevice(pasynUser, portName, addrs[i]) != asynSuccess)
+         || ((pasynInterface = pasynManager->findInterface(pasynUser, asynInt32Type, 1)) == NULL)) {
+            printf("Can't connect to %s\n", portName);
+            return NULL;
+        }
+        pasynInt32 = pasynInterface->pinterface;
+        pasynInt32->registerInterruptUser(pasynInterface->drvPvt, pasynUser,
+                                    dispatchCallback, NULL, &registrarPvt);
+    }
+    return pdpvt;
+}
+
+/*
+ * Send perWakeup samples to each port, batched or not, for an interval.
+ * Returns the thread CPU time per sample, and the time the run took,
+ * which can overrun the interval by up to one wakeup, in elapsed.
+ */
+static double
+dispatchRun(drvPvt **ports, usbMouseSample *samples, int nPorts,
+            int perWakeup, double seconds, int batched,
+            unsigned long *nSamples, unsigned long *nCallbacks,
+            double *elapsed)
+{
+    usbMouseBatch batch;
+    double start = clockSeconds(CLOCK_MONOTONIC), cpu;
+    int p, i;
+
+    *nSamples = 0;
+    dispatchCallbacks = 0;
+    cpu = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    while (clockSeconds(CLOCK_MONOTONIC) - start < seconds) {
+        if (batched)
+            usbMouseBatchBegin(&batch);
+        for (p = 0 ; p < nPorts ; p++) {
+            for (i = 0 ; i < perWakeup ; i++) {
+                usbMouseSample *sample = &samples[i];
+                sample->values.xPosition++;
+                sample->values.yPosition--;
+                usbMousePublishStage.process(ports[p], sample);
+            }
+        }
+        if (batched)
+            usbMouseBatchEnd(&batch);
+        *nSamples += nPorts * perWakeup;
+    }
+    cpu = clockSeconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    *elapsed = clockSeconds(CLOCK_MONOTONIC) - start;
+    *nCallbacks = dispatchCallbacks;
+    return *nSamples ? cpu / *nSamples : 0;
+}
+
+static void
+usbMouseDispatchBenchmark(int nPorts, int perWakeup, double seconds)
+{
+    drvPvt **ports;
+    usbMouseSample *samples;
+    int p, batched;
+    double single = 0;
+
+    if (nPorts <= 0) nPorts = 100;
+    if (perWakeup <= 0) perWakeup = 4;
+    if (seconds <= 0) seconds = 2;
+    ports = callocMustSucceed(nPorts, sizeof *ports, "usbMouseDispatchBenchmark");
+    samples = callocMustSucceed(perWakeup, sizeof *samples, "usbMouseDispatchBenchmark");
+    for (p = 0 ; p < nPorts ; p++) {
+        if ((ports[p] = dispatchPort(p)) == NULL) {
+            free(samples);
+            free(ports);
+            return;
+        }
+    }
+    for (p = 0 ; p < perWakeup ; p++)
+        epicsTimeGetCurrent(&samples[p].time);
+
+    printf("%d ports, %d samples per port per wakeup\n", nPorts, perWakeup);
+    printf("%-10s %14s %14s %14s %10s\n", "Dispatch", "Samples/s",
+                            "ns/sample", "ns/callback", "Speedup");
+    for (batched = 0 ; batched < 2 ; batched++) {
+        unsigned long nSamples, nCallbacks;
+        double elapsed;
+        double perSample = dispatchRun(ports, samples, nPorts, perWakeup,
+                                seconds, batched, &nSamples, &nCallbacks,
+                                &elapsed);
+        if (!batched)
+            single = perSample;
+        printf("%-10s %14.0f %14.1f %14.1f %9.2fx\n",
+                    batched ? "Batched" : "Single",
+                    nSamples / elapsed, perSample * 1e9,
+                    nCallbacks ? perSample * nSamples / nCallbacks * 1e9 : 0.0,
+                    perSample > 0 ? single / perSample : 0.0);
+    }
+    free(samples);
+    free(ports);
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseBenchDeviceArg0 = { "vendor ID",iocshArgInt};
+static const iocshArg usbMouseBenchDeviceArg1 = { "product ID",iocshArgInt};
+static const iocshArg usbMouseBenchDeviceArg2 = { "uhid/gadget",iocshArgString};
+static const iocshArg usbMouseBenchDeviceArg3 = { "UDC",iocshArgString};
+static const iocshArg *usbMouseBenchDeviceArgs[] = {
+                    &usbMouseBenchDeviceArg0, &usbMouseBenchDeviceArg1,
+                    &usbMouseBenchDeviceArg2, &usbMouseBenchDeviceArg3 };
+static const iocshFuncDef usbMouseBenchDeviceFuncDef =
+      {"usbMouseBenchDevice",4,usbMouseBenchDeviceArgs};
+static void usbMouseBenchDeviceCallFunc(const iocshArgBuf *args)
+{
+    usbMouseBenchDevice(args[0].ival, args[1].ival, args[2].sval, args[3].sval);
+}
+
+static const iocshArg usbMouseBenchmarkArg0 = { "ports",iocshArgString};
+static const iocshArg usbMouseBenchmarkArg1 = { "rates(Hz)",iocshArgString};
+static const iocshArg usbMouseBenchmarkArg2 = { "seconds",iocshArgDouble};
+static const iocshArg usbMouseBenchmarkArg3 = { "histogram",iocshArgInt};
+static const iocshArg *usbMouseBenchmarkArgs[] = {
+                    &usbMouseBenchmarkArg0, &usbMouseBenchmarkArg1,
+                    &usbMouseBenchmarkArg2, &usbMouseBenchmarkArg3 };
+static const iocshFuncDef usbMouseBenchmarkFuncDef =
+      {"usbMouseBenchmark",4,usbMouseBenchmarkArgs};
+static void usbMouseBenchmarkCallFunc(const iocshArgBuf *args)
+{
+    usbMouseBenchmark(args[0].sval, args[1].sval, args[2].dval, args[3].ival);
+}
+
+static const iocshArg usbMouseThroughputArg0 = { "ports",iocshArgString};
+static const iocshArg usbMouseThroughputArg1 = { "seconds",iocshArgDouble};
+static const iocshArg *usbMouseThroughputArgs[] = {
+                    &usbMouseThroughputArg0, &usbMouseThroughputArg1 };
+static const iocshFuncDef usbMouseThroughputFuncDef =
+      {"usbMouseThroughput",2,usbMouseThroughputArgs};
+static void usbMouseThroughputCallFunc(const iocshArgBuf *args)
+{
+    usbMouseThroughput(args[0].sval, args[1].dval);
+}
+
+static const iocshArg usbMouseDispatchBenchmarkArg0 = { "ports (DISPn, kept)",iocshArgInt};
+static const iocshArg usbMouseDispatchBenchmarkArg1 = { "samples per wakeup",iocshArgInt};
+static const iocshArg usbMouseDispatchBenchmarkArg2 = { "seconds",iocshArgDouble};
+static const iocshArg *usbMouseDispatchBenchmarkArgs[] = {
+                    &usbMouseDispatchBenchmarkArg0, &usbMouseDispatchBenchmarkArg1,
+                    &usbMouseDispatchBenchmarkArg2 };
+static const iocshFuncDef usbMouseDispatchBenchmarkFuncDef =
+      {"usbMouseDispatchBenchmark",3,usbMouseDispatchBenchmarkArgs};
+static void usbMouseDispatchBenchmarkCallFunc(const iocshArgBuf *args)
+{
+    usbMouseDispatchBenchmark(args[0].ival, args[1].ival, args[2].dval);
+}
+
+void
+usbMouseBench_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseBenchDeviceFuncDef,usbMouseBenchDeviceCallFunc);
+    iocshRegister(&usbMouseBenchmarkFuncDef,usbMouseBenchmarkCallFunc);
+    iocshRegister(&usbMouseThroughputFuncDef,usbMouseThroughputCallFunc);
+    iocshRegister(&usbMouseDispatchBenchmarkFuncDef,usbMouseDispatchBenchmarkCallFunc);
+}
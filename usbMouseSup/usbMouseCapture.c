@@ -0,0 +1,640 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Capture stage -- record samples to one file per trial
+ *
+ * Writing 1 to the capture address starts a trial and writing 0 ends
+ * it.  Each trial goes to a file named from the prefix and the trial
+ * number.  The pipeline only copies samples into a ring; a writer
+ * thread of the stage's own creates, preallocates, fills and closes
+ * the files, so trial boundaries never hold up acquisition.  Trial
+ * starts and stops pass through the ring in order with the samples,
+ * so the first and last sample indices of a trial are exact.
+ *
+ * The writer thread packs records into blocks from a usbMouseWriter
+ * and submits all the blocks it filled from one pass over the ring
+ * together.  The pipeline wakes the writer only when a quarter of the
+ * ring is full, so a sample normally costs no system call.  If the
+ * disk falls behind, the writer thread waits for free blocks, the ring
+ * fills and samples are dropped and counted; acquisition never waits.
+ * With the direct option files are opened with O_DIRECT and the last
+ * block of a trial is padded to the alignment, then truncated.
+ *
+ * The file format is the core library's: a usbMouseCaptureHeader
+ * followed by usbMouseCaptureRecords, all in the byte order of the
+ * IOC's host.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsMessageQueue.h>
+#include <epicsTime.h>
+#include <epicsExport.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+
+#include "usbMousePvt.h"
+
+#define CAPTURE_NAME_SIZE   256
+
+/*
+ * Ring entries kept free for trial starts and stops
+ */
+#define CONTROL_RESERVE     8
+
+typedef enum { ENTRY_SAMPLE, ENTRY_START, ENTRY_STOP } entryType;
+
+typedef struct captureEntry {
+    entryType               type;
+    epicsInt32              trial;      /* ENTRY_START */
+    usbMouseCaptureRecord   rec;
+} captureEntry;
+
+typedef struct capturePvt {
+    drvPvt             *pdpvt;
+    epicsMutexId        lock;
+    epicsEventId        wakeup;
+    epicsMessageQueueId names;
+
+    /*
+     * Ring -- filled by the pipeline and records, emptied by the writer.
+     * The size is a power of two so the free-running indices stay right
+     * when they wrap.
+     */
+    captureEntry       *ring;
+    unsigned int        ringSize;
+    unsigned int        head;
+    unsigned int        tail;
+    unsigned long       dropCount;
+    unsigned int        backlog;
+    int                 recording;
+    epicsInt32          trial;
+    char                prefix[CAPTURE_NAME_SIZE - 16];
+
+    /*
+     * Writer state
+     */
+    usbMouseWriter     *writer;
+    size_t              blockSize;
+    size_t              prealloc;
+    int                 direct;
+    double              flushInterval;
+    int                 fd;
+    off_t               fileSize;
+    char               *block;
+    size_t              blockUsed;
+    off_t               blockOffset;
+    captureEntry       *batch;
+    char                fileName[CAPTURE_NAME_SIZE];
+    unsigned long       trialSamples;
+    usbMouseCaptureRecord first;
+    usbMouseCaptureRecord last;
+    double              pathLength;
+    unsigned long       writeErrors;
+    unsigned long       writerErrorsReported;
+} capturePvt;
+
+static unsigned int
+ringUsed(capturePvt *pvt)
+{
+    return pvt->head - pvt->tail;
+}
+
+/*
+ * Add an entry to the ring -- called with the lock held.  Returns the
+ * entry, or NULL if the ring is full.
+ */
+static captureEntry *
+ringPut(capturePvt *pvt, entryType type, const usbMouseCaptureRecord *rec,
+        unsigned int reserve)
+{
+    captureEntry *ep;
+
+    if (ringUsed(pvt) + reserve >= pvt->ringSize)
+        return NULL;
+    ep = &pvt->ring[pvt->head & (pvt->ringSize - 1)];
+    ep->type = type;
+    if (rec)
+        ep->rec = *rec;
+    pvt->head++;
+    return ep;
+}
+
+/*
+ * Writer thread routines
+ */
+static void
+writeError(capturePvt *pvt, const char *what)
+{
+    pvt->writeErrors++;
+    asynPrint(pvt->pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                "Capture file %s %s failed: %s\n", pvt->fileName, what,
+                strerror(errno));
+}
+
+/*
+ * Append to the current block, queueing each block as it fills
+ */
+static void
+append(capturePvt *pvt, const void *data, size_t size)
+{
+    if (pvt->block == NULL)
+        pvt->block = usbMouseWriterAcquire(pvt->writer);
+    memcpy(pvt->block + pvt->blockUsed, data, size);
+    pvt->blockUsed += size;
+    pvt->fileSize += size;
+    if (pvt->blockUsed == pvt->blockSize) {
+        usbMouseWriterQueue(pvt->writer, pvt->fd, pvt->block, pvt->blockSize,
+                                                            pvt->blockOffset);
+        pvt->blockOffset += pvt->blockSize;
+        pvt->block = NULL;
+        pvt->blockUsed = 0;
+    }
+}
+
+static void
+startTrial(capturePvt *pvt, epicsInt32 trial, const epicsTimeStamp *now)
+{
+    drvPvt *pdpvt = pvt->pdpvt;
+    usbMouseCaptureHeader header;
+
+    if (epicsMessageQueueTryReceive(pvt->names, pvt->fileName,
+                                    sizeof pvt->fileName) < 0)
+        strcpy(pvt->fileName, "?");
+    pvt->trialSamples = 0;
+    pvt->pathLength = 0;
+    pvt->fileSize = 0;
+    pvt->blockUsed = 0;
+    pvt->blockOffset = 0;
+    pvt->fd = -1;
+#ifdef O_DIRECT
+    if (pvt->direct) {
+        pvt->fd = open(pvt->fileName, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (pvt->fd < 0)
+            asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                        "Capture file %s can't use O_DIRECT: %s\n",
+                        pvt->fileName, strerror(errno));
+    }
+#endif
+    if (pvt->fd < 0)
+        pvt->fd = open(pvt->fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pvt->fd < 0) {
+        writeError(pvt, "open");
+        return;
+    }
+#ifdef __linux__
+    if (pvt->prealloc) {
+        int s = posix_fallocate(pvt->fd, 0, pvt->prealloc);
+        if (s != 0) {
+            errno = s;
+            writeError(pvt, "preallocation");
+        }
+    }
+#endif
+    usbMouseCaptureHeaderInit(&header, pdpvt->portName, trial);
+    append(pvt, &header, sizeof header);
+    usbMousePublishString(pdpvt, USBMOUSE_ADDR_CAPTURE_FILE, pvt->fileName, now);
+}
+
+static void
+stopTrial(capturePvt *pvt, const epicsTimeStamp *now)
+{
+    drvPvt *pdpvt = pvt->pdpvt;
+    double duration = 0;
+
+    if (pvt->fd >= 0) {
+        if (pvt->blockUsed) {
+            size_t length = pvt->blockUsed;
+            if (pvt->direct) {
+                length = (length + USBMOUSE_WRITER_ALIGN - 1)
+                                    / USBMOUSE_WRITER_ALIGN * USBMOUSE_WRITER_ALIGN;
+                memset(pvt->block + pvt->blockUsed, 0, length - pvt->blockUsed);
+            }
+            usbMouseWriterQueue(pvt->writer, pvt->fd, pvt->block, length,
+                                                            pvt->blockOffset);
+            pvt->block = NULL;
+            pvt->blockUsed = 0;
+        }
+        usbMouseWriterDrain(pvt->writer);
+        if (ftruncate(pvt->fd, pvt->fileSize) < 0)
+            writeError(pvt, "truncate");
+        if (close(pvt->fd) < 0)
+            writeError(pvt, "close");
+        pvt->fd = -1;
+    }
+    if (pvt->trialSamples) {
+        epicsTimeStamp t0, t1;
+        t0.secPastEpoch = pvt->first.secPastEpoch;
+        t0.nsec = pvt->first.nsec;
+        t1.secPastEpoch = pvt->last.secPastEpoch;
+        t1.nsec = pvt->last.nsec;
+        duration = epicsTimeDiffInSeconds(&t1, &t0);
+    }
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_TRIAL_STOP,
+            pvt->trialSamples ? (epicsInt32)pvt->last.sequence : -1, now);
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_TRIAL_SAMPLES,
+                                        (epicsInt32)pvt->trialSamples, now);
+    usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_TRIAL_DURATION, duration, now);
+    usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_TRIAL_PATH, pvt->pathLength, now);
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_CAPTURE_DROPS,
+                                        (epicsInt32)pvt->dropCount, now);
+}
+
+static void
+addSample(capturePvt *pvt, const usbMouseCaptureRecord *rec)
+{
+    if (pvt->trialSamples == 0) {
+        epicsTimeStamp t;
+        t.secPastEpoch = rec->secPastEpoch;
+        t.nsec = rec->nsec;
+        pvt->first = *rec;
+        usbMousePublishInt32(pvt->pdpvt, USBMOUSE_ADDR_TRIAL_START,
+                                        (epicsInt32)rec->sequence, &t);
+    }
+    else {
+        double dx = rec->x - pvt->last.x;
+        double dy = rec->y - pvt->last.y;
+        pvt->pathLength += sqrt(dx * dx + dy * dy);
+    }
+    pvt->last = *rec;
+    pvt->trialSamples++;
+    if (pvt->fd >= 0)
+        append(pvt, rec, sizeof *rec);
+}
+
+/*
+ * Publish the writer's counters and rate, and report new block write
+ * failures, about once a second
+ */
+static void
+publishStats(capturePvt *pvt, const epicsTimeStamp *now,
+             epicsTimeStamp *last, epicsUInt64 *lastBytes)
+{
+    drvPvt *pdpvt = pvt->pdpvt;
+    usbMouseWriterStats stats;
+    double dt = epicsTimeDiffInSeconds(now, last);
+    unsigned long drops;
+    unsigned int backlog;
+
+    if (dt < 1.0)
+        return;
+    usbMouseWriterGetStats(pvt->writer, &stats);
+    if (stats.errors != pvt->writerErrorsReported) {
+        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                "Capture %lu block write(s) failed, last: %s\n",
+                stats.errors - pvt->writerErrorsReported, stats.message);
+        pvt->writerErrorsReported = stats.errors;
+    }
+    epicsMutexMustLock(pvt->lock);
+    drops = pvt->dropCount;
+    backlog = pvt->backlog;
+    pvt->backlog = ringUsed(pvt);
+    epicsMutexUnlock(pvt->lock);
+    usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_CAPTURE_RATE,
+                    (stats.bytes - *lastBytes) / dt / (1024 * 1024), now);
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_CAPTURE_BACKLOG,
+                    (epicsInt32)backlog, now);
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_CAPTURE_DROPS,
+                    (epicsInt32)drops, now);
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_CAPTURE_WAITS,
+                    (epicsInt32)stats.waits, now);
+    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_CAPTURE_ERRORS,
+                    (epicsInt32)(stats.errors + pvt->writeErrors), now);
+    *last = *now;
+    *lastBytes = stats.bytes;
+}
+
+static void
+writerThread(void *arg)
+{
+    capturePvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    epicsTimeStamp now, lastStats;
+    epicsUInt64 lastBytes = 0;
+    extern volatile int interruptAccept;
+
+    while (!interruptAccept)
+        epicsThreadSleep(0.1);
+    pdpvt->clock->now(pdpvt->clock, &lastStats);
+    for (;;) {
+        unsigned int n, i;
+
+        epicsEventWaitWithTimeout(pvt->wakeup, pvt->flushInterval);
+        for (;;) {
+            epicsMutexMustLock(pvt->lock);
+            n = ringUsed(pvt);
+            if (n > pvt->ringSize / 4)
+                n = pvt->ringSize / 4;
+            for (i = 0 ; i < n ; i++)
+                pvt->batch[i] = pvt->ring[(pvt->tail + i) & (pvt->ringSize - 1)];
+            pvt->tail += n;
+            epicsMutexUnlock(pvt->lock);
+            if (n == 0)
+                break;
+            for (i = 0 ; i < n ; i++) {
+                captureEntry *ep = &pvt->batch[i];
+                switch (ep->type) {
+                case ENTRY_SAMPLE:
+                    addSample(pvt, &ep->rec);
+                    break;
+
+                case ENTRY_START:
+                    pdpvt->clock->now(pdpvt->clock, &now);
+                    startTrial(pvt, ep->trial, &now);
+                    break;
+
+                case ENTRY_STOP:
+                    pdpvt->clock->now(pdpvt->clock, &now);
+                    stopTrial(pvt, &now);
+                    break;
+                }
+            }
+            usbMouseWriterSubmit(pvt->writer);
+        }
+        pdpvt->clock->now(pdpvt->clock, &now);
+        publishStats(pvt, &now, &lastStats, &lastBytes);
+    }
+}
+
+/*
+ * Stage methods
+ */
+static void *
+captureCreate(drvPvt *pdpvt, const char *args)
+{
+    capturePvt *pvt;
+    int ringSize = usbMouseArgInt(args, "size", 8192);
+    double prealloc = usbMouseArgDouble(args, "prealloc", 16);
+    int blockKB = usbMouseArgInt(args, "block", 64);
+    int nBlocks = usbMouseArgInt(args, "blocks", 16);
+    double flush = usbMouseArgDouble(args, "flush", 0.1);
+    usbMouseWriterStats stats;
+    char threadName[40], message[160];
+
+    if ((ringSize < 4 * CONTROL_RESERVE) || (ringSize & (ringSize - 1))) {
+        printf("capture stage size must be a power of two, at least %d\n",
+                                                        4 * CONTROL_RESERVE);
+        return NULL;
+    }
+    if ((blockKB <= 0) || (blockKB * 1024 % USBMOUSE_WRITER_ALIGN) || (nBlocks < 2)) {
+        printf("capture stage needs at least 2 blocks of a multiple of %d KB\n",
+                                                USBMOUSE_WRITER_ALIGN / 1024);
+        return NULL;
+    }
+    if (flush <= 0) {
+        printf("capture stage flush interval must be positive\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "captureCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    pvt->wakeup = epicsEventMustCreate(epicsEventEmpty);
+    pvt->names = epicsMessageQueueCreate(CONTROL_RESERVE, CAPTURE_NAME_SIZE);
+    pvt->ringSize = ringSize;
+    pvt->ring = callocMustSucceed(ringSize, sizeof *pvt->ring, "captureCreate");
+    pvt->batch = callocMustSucceed(ringSize / 4, sizeof *pvt->batch, "captureCreate");
+    pvt->prealloc = prealloc > 0 ? (size_t)(prealloc * 1024 * 1024) : 0;
+    pvt->direct = usbMouseArgInt(args, "direct", 0);
+    pvt->flushInterval = flush;
+    pvt->blockSize = (size_t)blockKB * 1024;
+    pvt->fd = -1;
+    usbMouseArgString(args, "prefix", "capture", pvt->prefix, sizeof pvt->prefix);
+    epicsSnprintf(threadName, sizeof threadName, "%s_CAPTURE", pdpvt->portName);
+    pvt->writer = usbMouseWriterCreate(threadName, nBlocks, pvt->blockSize,
+                                       usbMouseArgInt(args, "uring", 1),
+                                       message, sizeof message);
+    if (pvt->writer == NULL) {
+        printf("%s\n", message);
+        return NULL;
+    }
+    usbMouseWriterGetStats(pvt->writer, &stats);
+    if (stats.message[0])
+        printf("%s: %s\n", threadName, stats.message);
+    if ((pvt->names == NULL)
+     || (epicsThreadCreate(threadName,
+                           epicsThreadPriorityLow,
+                           epicsThreadGetStackSize(epicsThreadStackMedium),
+                           writerThread,
+                           pvt) == NULL)) {
+        printf("Can't set up %s thread!\n", threadName);
+        return NULL;
+    }
+    return pvt;
+}
+
+static int
+captureProcess(void *arg, usbMouseSample *sample)
+{
+    capturePvt *pvt = arg;
+    usbMouseCaptureRecord rec;
+    int wake = 0;
+
+    usbMouseCaptureRecordSet(&rec, sample);
+    epicsMutexMustLock(pvt->lock);
+    if (pvt->recording) {
+        if (ringPut(pvt, ENTRY_SAMPLE, &rec, CONTROL_RESERVE)) {
+            unsigned int used = ringUsed(pvt);
+            wake = (used == pvt->ringSize / 4);
+            if (used > pvt->backlog)
+                pvt->backlog = used;
+        }
+        else {
+            pvt->dropCount++;
+        }
+    }
+    epicsMutexUnlock(pvt->lock);
+    if (wake)
+        epicsEventSignal(pvt->wakeup);
+    return 1;
+}
+
+static int
+captureWrite(void *arg, int addr, double value)
+{
+    capturePvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    char name[CAPTURE_NAME_SIZE];
+    epicsTimeStamp now;
+    int start = (value != 0), status = 1;
+
+    if (addr != USBMOUSE_ADDR_CAPTURE)
+        return 0;
+    epicsMutexMustLock(pvt->lock);
+    if (start && !pvt->recording) {
+        epicsSnprintf(name, sizeof name, "%s%04d.cap", pvt->prefix,
+                                                        (int)pvt->trial + 1);
+        /*
+         * Check for room in the ring first so a name is never left
+         * behind for the next trial to pick up
+         */
+        if ((ringUsed(pvt) >= pvt->ringSize)
+         || (epicsMessageQueueTrySend(pvt->names, name, sizeof name) != 0)) {
+            status = -1;
+        }
+        else {
+            pvt->trial++;
+            ringPut(pvt, ENTRY_START, NULL, 0)->trial = pvt->trial;
+            pvt->recording = 1;
+        }
+    }
+    else if (!start && pvt->recording) {
+        if (ringPut(pvt, ENTRY_STOP, NULL, 0))
+            pvt->recording = 0;
+        else
+            status = -1;
+    }
+    epicsMutexUnlock(pvt->lock);
+    epicsEventSignal(pvt->wakeup);
+    pdpvt->clock->now(pdpvt->clock, &now);
+    if (status > 0) {
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_CAPTURE, start, &now);
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_TRIAL, pvt->trial, &now);
+    }
+    return status;
+}
+
+static int
+captureWriteString(void *arg, int addr, const char *value)
+{
+    capturePvt *pvt = arg;
+
+    if (addr != USBMOUSE_ADDR_CAPTURE_PREFIX)
+        return 0;
+    if (strlen(value) >= sizeof pvt->prefix)
+        return -1;
+    epicsMutexMustLock(pvt->lock);
+    strcpy(pvt->prefix, value);
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+static void
+captureReport(void *arg, FILE *fp, int details)
+{
+    capturePvt *pvt = arg;
+
+    fprintf(fp, "prefix=%s %s trial %d", pvt->prefix,
+                    pvt->recording ? "recording" : "stopped", (int)pvt->trial);
+    if (details >= 3) {
+        usbMouseWriterStats stats;
+
+        usbMouseWriterGetStats(pvt->writer, &stats);
+        fprintf(fp, ", %lu dropped, %lu write errors", pvt->dropCount,
+                                            pvt->writeErrors + stats.errors);
+        fprintf(fp, "\n          %s%s, %lu KB blocks (%d free), %.1f MB in"
+                    " %lu blocks, %lu submissions, %lu waits (%.3f s)",
+                    stats.method, pvt->direct ? " O_DIRECT" : "",
+                    (unsigned long)(pvt->blockSize / 1024), stats.blocksFree,
+                    stats.bytes / (1024.0 * 1024.0), stats.blocks,
+                    stats.submits, stats.waits, stats.waitTime);
+        if (stats.message[0])
+            fprintf(fp, "\n          %s", stats.message);
+    }
+}
+
+const usbMouseStageType usbMouseCaptureStage = {
+    "capture", captureCreate, captureProcess, captureReport,
+    captureWrite, captureWriteString
+};
+
+/*
+ * Record one trial and show the disk rate and the stage's cost per sample
+ */
+static void
+usbMouseCaptureBenchmark(const char *portName, double seconds)
+{
+    drvPvt *pdpvt;
+    usbMouseStage *stage;
+    capturePvt *pvt;
+    usbMouseWriterStats before, after;
+    unsigned long samples, drops;
+    double stageTime, elapsed;
+    epicsTimeStamp t0, t1;
+    extern volatile int interruptAccept;
+
+    if (!interruptAccept) {
+        printf("Run the benchmark after iocInit.\n");
+        return;
+    }
+    if ((portName == NULL) || ((pdpvt = usbMouseFindPort(portName)) == NULL)) {
+        printf("No such port: %s\n", portName ? portName : "");
+        return;
+    }
+    for (stage = pdpvt->pipeline ; stage ; stage = stage->next) {
+        if (stage->type == &usbMouseCaptureStage)
+            break;
+    }
+    if (stage == NULL) {
+        printf("Port %s has no capture stage.\n", portName);
+        return;
+    }
+    pvt = stage->pvt;
+    if (pvt->recording) {
+        printf("Port %s is already recording.\n", portName);
+        return;
+    }
+    if (seconds <= 0)
+        seconds = 10;
+    samples = stage->sampleCount;
+    stageTime = stage->totalTime;
+    stage->maxTime = 0;
+    drops = pvt->dropCount;
+    usbMouseWriterGetStats(pvt->writer, &before);
+    epicsTimeGetCurrent(&t0);
+    if (captureWrite(pvt, USBMOUSE_ADDR_CAPTURE, 1) < 0) {
+        printf("Can't start a trial.\n");
+        return;
+    }
+    epicsThreadSleep(seconds);
+    usbMouseWriterGetStats(pvt->writer, &after);
+    epicsTimeGetCurrent(&t1);
+    captureWrite(pvt, USBMOUSE_ADDR_CAPTURE, 0);
+    elapsed = epicsTimeDiffInSeconds(&t1, &t0);
+    samples = stage->sampleCount - samples;
+    stageTime = stage->totalTime - stageTime;
+
+    printf("%-10s %-8s %12s %8s %8s %8s %10s %8s\n", "Port", "Method",
+        "Samples/s", "MB/s", "Mean", "Max", "Dropped", "Waits");
+    printf("%-10s %-8s %12s %8s %8s %8s %10s %8s\n", "", "",
+        "", "", "(us)", "(us)", "", "");
+    printf("%-10s %-8s %12.0f %8.1f %8.2f %8.1f %10lu %8lu\n",
+        pdpvt->portName, after.method, samples / elapsed,
+        (after.bytes - before.bytes) / elapsed / (1024 * 1024),
+        samples ? stageTime * 1e6 / samples : 0.0, stage->maxTime * 1e6,
+        pvt->dropCount - drops, after.waits - before.waits);
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseCaptureBenchmarkArg0 = { "port",iocshArgString};
+static const iocshArg usbMouseCaptureBenchmarkArg1 = { "seconds",iocshArgDouble};
+static const iocshArg *usbMouseCaptureBenchmarkArgs[] = {
+                    &usbMouseCaptureBenchmarkArg0, &usbMouseCaptureBenchmarkArg1 };
+static const iocshFuncDef usbMouseCaptureBenchmarkFuncDef =
+      {"usbMouseCaptureBenchmark",2,usbMouseCaptureBenchmarkArgs};
+static void usbMouseCaptureBenchmarkCallFunc(const iocshArgBuf *args)
+{
+    usbMouseCaptureBenchmark(args[0].sval, args[1].dval);
+}
+
+static void
+usbMouseCapture_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseCaptureBenchmarkFuncDef,usbMouseCaptureBenchmarkCallFunc);
+}
+epicsExportRegistrar(usbMouseCapture_RegisterCommands);
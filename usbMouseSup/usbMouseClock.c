@@ -0,0 +1,248 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Clocks for driver timekeeping
+ *
+ * All scheduling and timestamping in the driver goes through a port's
+ * clock.  The real clock uses the system time and sleeps.  A virtual
+ * clock starts at a fixed time and is moved on only by the thread
+ * reading the device, as the transport paces its reports.  Other
+ * threads sleeping on it are woken in deadline order as the time
+ * reaches each deadline, and the time goes no further until they have
+ * done their work and gone back to sleep.  Simulated runs go as fast
+ * as the CPU allows and produce identical timestamps every time.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsExport.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+
+#include "usbMousePvt.h"
+
+static void
+realNow(usbMouseClock *clock, epicsTimeStamp *ts)
+{
+    epicsTimeGetCurrent(ts);
+}
+
+static void
+realSleep(usbMouseClock *clock, double seconds)
+{
+    epicsThreadSleep(seconds);
+}
+
+static usbMouseClock realClock = { "real", realNow, realSleep, realSleep };
+
+usbMouseClock *
+usbMouseClockReal(void)
+{
+    return &realClock;
+}
+
+/*
+ * A thread sleeping on a virtual clock
+ */
+typedef struct clockSleeper {
+    struct clockSleeper    *next;
+    epicsTimeStamp          deadline;
+    epicsEventId            wakeup;
+    struct virtualClock    *owes;       /* woken and not yet back asleep */
+} clockSleeper;
+
+typedef struct virtualClock {
+    usbMouseClock           clock;
+    epicsMutexId            lock;
+    epicsTimeStamp          time;
+    clockSleeper           *sleepers;   /* in deadline order */
+    int                     running;
+    epicsEventId            settled;
+} virtualClock;
+
+/*
+ * A woken thread that hasn't gone back to sleep after this many
+ * seconds is assumed to be blocked elsewhere and isn't waited for
+ */
+#define SETTLE_TIMEOUT 1.0
+
+static epicsThreadOnceId sleeperOnce = EPICS_THREAD_ONCE_INIT;
+static epicsThreadPrivateId sleeperKey;
+
+static void
+sleeperInit(void *arg)
+{
+    sleeperKey = epicsThreadPrivateCreate();
+}
+
+static clockSleeper *
+sleeperSelf(void)
+{
+    clockSleeper *sp;
+
+    epicsThreadOnce(&sleeperOnce, sleeperInit, NULL);
+    sp = epicsThreadPrivateGet(sleeperKey);
+    if (sp == NULL) {
+        sp = callocMustSucceed(1, sizeof *sp, "usbMouseClock");
+        sp->wakeup = epicsEventMustCreate(epicsEventEmpty);
+        epicsThreadPrivateSet(sleeperKey, sp);
+    }
+    return sp;
+}
+
+/*
+ * Note that a woken thread is back, with the clock locked
+ */
+static void
+virtualSettle(virtualClock *vc, clockSleeper *sp)
+{
+    if (sp->owes != vc)
+        return;
+    sp->owes = NULL;
+    if ((vc->running > 0) && (--vc->running == 0))
+        epicsEventSignal(vc->settled);
+}
+
+static void
+virtualNow(usbMouseClock *clock, epicsTimeStamp *ts)
+{
+    virtualClock *vc = (virtualClock *)clock;
+
+    epicsMutexMustLock(vc->lock);
+    *ts = vc->time;
+    epicsMutexUnlock(vc->lock);
+}
+
+/*
+ * Wait until the thread reading the device moves the time on
+ */
+static void
+virtualSleep(usbMouseClock *clock, double seconds)
+{
+    virtualClock *vc = (virtualClock *)clock;
+    clockSleeper *sp = sleeperSelf(), **spp;
+
+    epicsMutexMustLock(vc->lock);
+    virtualSettle(vc, sp);
+    sp->deadline = vc->time;
+    if (seconds > 0)
+        epicsTimeAddSeconds(&sp->deadline, seconds);
+    for (spp = &vc->sleepers ; *spp != NULL ; spp = &(*spp)->next) {
+        if (epicsTimeDiffInSeconds(&(*spp)->deadline, &sp->deadline) > 0)
+            break;
+    }
+    sp->next = *spp;
+    *spp = sp;
+    epicsMutexUnlock(vc->lock);
+    epicsEventMustWait(sp->wakeup);
+    sp->owes = vc;
+}
+
+/*
+ * Move the time on, stopping at each sleeper's deadline to wake it and
+ * let it run
+ */
+static void
+virtualAdvance(usbMouseClock *clock, double seconds)
+{
+    virtualClock *vc = (virtualClock *)clock;
+    clockSleeper *sp;
+    epicsTimeStamp target;
+
+    epicsMutexMustLock(vc->lock);
+    virtualSettle(vc, sleeperSelf());
+    target = vc->time;
+    if (seconds > 0)
+        epicsTimeAddSeconds(&target, seconds);
+    while (((sp = vc->sleepers) != NULL)
+        && (epicsTimeDiffInSeconds(&sp->deadline, &target) <= 0)) {
+        vc->time = sp->deadline;
+        while (((sp = vc->sleepers) != NULL)
+            && (epicsTimeDiffInSeconds(&sp->deadline, &vc->time) <= 0)) {
+            vc->sleepers = sp->next;
+            vc->running++;
+            epicsEventSignal(sp->wakeup);
+        }
+        while (vc->running) {
+            epicsMutexUnlock(vc->lock);
+            if (epicsEventWaitWithTimeout(vc->settled, SETTLE_TIMEOUT)
+                                                    == epicsEventWaitTimeout) {
+                epicsMutexMustLock(vc->lock);
+                vc->running = 0;
+                break;
+            }
+            epicsMutexMustLock(vc->lock);
+        }
+    }
+    vc->time = target;
+    epicsMutexUnlock(vc->lock);
+}
+
+usbMouseClock *
+usbMouseClockVirtual(double start)
+{
+    virtualClock *vc = callocMustSucceed(1, sizeof *vc, "usbMouseClockVirtual");
+
+    vc->clock.name = "virtual";
+    vc->clock.now = virtualNow;
+    vc->clock.sleep = virtualSleep;
+    vc->clock.advance = virtualAdvance;
+    vc->lock = epicsMutexMustCreate();
+    vc->settled = epicsEventMustCreate(epicsEventEmpty);
+    epicsTimeAddSeconds(&vc->time, start);
+    return &vc->clock;
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseSetClockArg0 = { "port",iocshArgString};
+static const iocshArg usbMouseSetClockArg1 = { "clock",iocshArgString};
+static const iocshArg usbMouseSetClockArg2 = { "start(s past EPICS epoch)",iocshArgDouble};
+static const iocshArg *usbMouseSetClockArgs[] = {
+                    &usbMouseSetClockArg0, &usbMouseSetClockArg1,
+                    &usbMouseSetClockArg2 };
+static const iocshFuncDef usbMouseSetClockFuncDef =
+      {"usbMouseSetClock",3,usbMouseSetClockArgs};
+static void usbMouseSetClockCallFunc(const iocshArgBuf *args)
+{
+    drvPvt *pdpvt;
+    extern volatile int interruptAccept;
+
+    if ((args[0].sval == NULL) || (args[1].sval == NULL)) {
+        printf("Usage: usbMouseSetClock port real|virtual [start]\n");
+        return;
+    }
+    if (interruptAccept) {
+        printf("The clock must be set before iocInit.\n");
+        return;
+    }
+    pdpvt = usbMouseFindPort(args[0].sval);
+    if (pdpvt == NULL) {
+        printf("No such port: %s\n", args[0].sval);
+        return;
+    }
+    if (strcmp(args[1].sval, "real") == 0)
+        pdpvt->clock = usbMouseClockReal();
+    else if (strcmp(args[1].sval, "virtual") == 0)
+        pdpvt->clock = usbMouseClockVirtual(args[2].dval);
+    else
+        printf("Unknown clock \"%s\"\n", args[1].sval);
+}
+
+static void
+usbMouseClock_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseSetClockFuncDef,usbMouseSetClockCallFunc);
+}
+epicsExportRegistrar(usbMouseClock_RegisterCommands);
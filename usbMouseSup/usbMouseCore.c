@@ -0,0 +1,565 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * USB mouse acquisition core -- decoding, libusb device access and the
+ * capture file format
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <epicsStdio.h>
+
+#include "usbMouseCore.h"
+
+/*
+ * USB Setup Packet values
+ * These are gleaned from HID1_11.pdf section 7.2.1 "Get_Report Request":
+ *      bmRequestType       10100001
+ *      bRequest            00000001 (GET_REPORT)
+ *      wValue              Report type in high byte, report ID in low byte
+ *      wIndex              Interface
+ *      wLength             Report length
+ *
+ * The GET_REPORT request allows the host to receive a report via the
+ * CONTROL pipe.  A report type of 1 is 'INPUT'.
+ */
+
+/*
+ * bmRequestType bits
+ */
+#define USB_TYPE_CLASS          (0x01 << 5) /* Class device request */
+#define USB_RECIP_INTERFACE     0x01        /* Recepient is interface */
+
+/*
+ * bRequest values for HID class
+ */
+#define HID_REPORT_GET          0x01
+
+/*
+ * wValue bits (report type is high byte)
+ */
+#define HID_RT_INPUT            0x01
+
+/*
+ * How long to wait for response (milliseconds)
+ */
+#define USB_TIMEOUT             10000
+
+/*
+ * Sign-extend
+ */
+int
+usbMouseSignExtend(int size, int value)
+{
+    switch(size) {
+    default:                           break;
+    case 1: value = (epicsInt8)value;  break;
+    case 2: value = (epicsInt16)value; break;
+    case 4: value = (epicsInt32)value; break;
+    }
+    return value;
+}
+
+/*
+ * See if a HID report descriptor has a Report ID item, in which case
+ * every report starts with its ID
+ */
+int
+usbMouseUsesReportIds(const unsigned char *desc, int length)
+{
+    int i, bSize;
+
+    for (i = 0 ; i < length ; i += 1 + bSize) {
+        if (desc[i] == 0xFE) {
+            if (i + 1 >= length)
+                break;
+            bSize = 2 + desc[i+1];
+            continue;
+        }
+        bSize = desc[i] & 0x3;
+        if (bSize == 3) bSize = 4;
+        if ((desc[i] & ~0x3) == 0x84)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Pick the mouse values out of a boot protocol report
+ */
+void
+usbMouseDecodeBoot(usbMouseSample *sample, int *buttons)
+{
+    int s = sample->nRead;
+
+    sample->dx = sample->dy = sample->dWheel = 0;
+    if (s > 0) *buttons = sample->report[0];
+    if (s > 1) sample->dx = usbMouseSignExtend(1, sample->report[1]);
+    if (s > 2) sample->dy = usbMouseSignExtend(1, sample->report[2]);
+    if (s > 3) sample->dWheel = usbMouseSignExtend(1, sample->report[3]);
+}
+
+static void
+putInt32(unsigned char *cp, int value)
+{
+    cp[0] = value;
+    cp[1] = value >> 8;
+    cp[2] = value >> 16;
+    cp[3] = value >> 24;
+}
+
+static int
+getInt32(const unsigned char *cp)
+{
+    return (epicsInt32)(cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((epicsUInt32)cp[3] << 24));
+}
+
+/*
+ * Build a report from motion and buttons gathered from input events.
+ * Returns the report length.
+ */
+int
+usbMouseEncodeEvents(unsigned char *buf, int buttons, int dx, int dy,
+                     int dWheel)
+{
+    buf[0] = buttons;
+    putInt32(buf + 1, dx);
+    putInt32(buf + 5, dy);
+    putInt32(buf + 9, dWheel);
+    return USBMOUSE_EVENT_REPORT_SIZE;
+}
+
+void
+usbMouseDecodeEvents(usbMouseSample *sample, int *buttons)
+{
+    const unsigned char *cp = sample->report;
+
+    sample->dx = sample->dy = sample->dWheel = 0;
+    if (sample->nRead < USBMOUSE_EVENT_REPORT_SIZE)
+        return;
+    *buttons = cp[0];
+    sample->dx = getInt32(cp + 1);
+    sample->dy = getInt32(cp + 5);
+    sample->dWheel = getInt32(cp + 9);
+}
+
+epicsInt64
+usbMouseScaleDelta(epicsInt64 num, epicsInt64 den, epicsInt64 *remainder,
+                   int delta)
+{
+    epicsInt64 total = *remainder + (epicsInt64)delta * num;
+    epicsInt64 counts = total / den;
+
+    if ((total % den) < 0)
+        counts--;
+    *remainder = total - counts * den;
+    return counts;
+}
+
+/*
+ * Decode a report and add its motion to the running state, which the
+ * sample then carries
+ */
+void
+usbMouseAccumulate(mouseValues *state, usbMouseSample *sample,
+                   usbMouseDecoder decode)
+{
+    decode(sample, &state->buttons);
+    state->xPosition += sample->dx;
+    state->yPosition += sample->dy;
+    state->wheel += sample->dWheel;
+    sample->values = *state;
+}
+
+/*
+ * Take the button levels from a report of the device's current state.
+ * Returns 1, with the sample carrying the corrected state and no
+ * motion, if they differ from the running state and 0 if they agree.
+ */
+int
+usbMouseResyncButtons(mouseValues *state, usbMouseSample *sample,
+                      usbMouseDecoder decode)
+{
+    int buttons = state->buttons;
+
+    decode(sample, &buttons);
+    if (buttons == state->buttons)
+        return 0;
+    state->buttons = buttons;
+    sample->dx = sample->dy = sample->dWheel = 0;
+    sample->values = *state;
+    return 1;
+}
+
+/*
+ * Add to the description of what went wrong
+ */
+static void
+deviceError(usbMouseDevice *dev, const char *format, ...)
+{
+    size_t n = strlen(dev->errorMessage);
+    va_list args;
+
+    if (n && (n < sizeof dev->errorMessage - 2)) {
+        strcpy(dev->errorMessage + n, "; ");
+        n += 2;
+    }
+    va_start(args, format);
+    epicsVsnprintf(dev->errorMessage + n, sizeof dev->errorMessage - n,
+                                                            format, args);
+    va_end(args);
+}
+
+int
+usbMouseDeviceInit(usbMouseDevice *dev, int idVendor, int idProduct,
+                   int idNumber)
+{
+    int s;
+
+    memset(dev, 0, sizeof *dev);
+    dev->idVendor = idVendor;
+    dev->idProduct = idProduct;
+    dev->idNumber = idNumber;
+    dev->timeout = USB_TIMEOUT;
+    s = libusb_init(NULL);
+    if (s != 0) {
+        deviceError(dev, "libusb_init failed: %d", s);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the HID report descriptor
+ */
+static void
+getHIDreport(usbMouseDevice *dev,
+             const struct libusb_interface_descriptor *interface,
+             const unsigned char *buf)
+{
+    int s;
+
+    free(dev->HIDreport);
+    dev->HIDreportLength = (buf[8] << 8) | buf[7];
+    dev->HIDreport = calloc(dev->HIDreportLength, 1);
+    if (dev->HIDreport == NULL) {
+        dev->HIDreportLength = 0;
+        return;
+    }
+    s = libusb_control_transfer(dev->handle,
+                        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+                                             LIBUSB_RECIPIENT_INTERFACE,
+                        LIBUSB_REQUEST_GET_DESCRIPTOR,
+                        (LIBUSB_DT_REPORT << 8) | 0x00,
+                        interface->bInterfaceNumber,
+                        dev->HIDreport, dev->HIDreportLength, dev->timeout);
+    if (s != dev->HIDreportLength) {
+        deviceError(dev, "Get HID report failed: %d", s);
+        free(dev->HIDreport);
+        dev->HIDreport = NULL;
+        dev->HIDreportLength = 0;
+    }
+    dev->usesReportIds = usbMouseUsesReportIds(dev->HIDreport,
+                                               dev->HIDreportLength);
+}
+
+/*
+ * Get a string descriptor from the device
+ */
+static void
+getStringDescriptor(usbMouseDevice *dev, unsigned int descriptor,
+                    char *value, size_t size)
+{
+    unsigned char cbuf[255];
+    int i, s;
+    size_t j;
+    int languageCode;
+
+    if (descriptor == 0) {
+        epicsSnprintf(value, size, "???");
+        return;
+    }
+    if (descriptor > 255) {
+        epicsSnprintf(value, size, "Invalid desriptor (%d)", descriptor);
+        return;
+    }
+
+    /*
+     * Get the first supported language
+     */
+    s = libusb_control_transfer(dev->handle,
+          LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+          LIBUSB_REQUEST_GET_DESCRIPTOR,
+          (LIBUSB_DT_STRING << 8) | 0x00,  /* Index 0 (language identifiers) */
+          0x0000,  /* Interface number */
+          cbuf, sizeof cbuf, dev->timeout);
+    if (s <= 0) {
+        epicsSnprintf(value, size, "Can't get language descriptor");
+        return;
+    }
+    languageCode = (cbuf[3] << 8) | cbuf[2];
+
+    /*
+     * Get the string in that language
+     */
+    s = libusb_control_transfer(dev->handle,
+         LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+          LIBUSB_REQUEST_GET_DESCRIPTOR,
+         (LIBUSB_DT_STRING << 8) | descriptor,
+         languageCode,
+         cbuf, sizeof cbuf, dev->timeout);
+    if (s <= 0) {
+        epicsSnprintf(value, size, "Can't get descriptor %d", descriptor);
+        return;
+    }
+
+    /*
+     * Assume string is in ASCII subset of Unicode
+     */
+    for (i = 2, j = 0 ; (i < cbuf[0]) && (j < size - 1) ; i += 2, j++)
+        value[j] = cbuf[i];
+    value[j] = '\0';
+}
+
+/*
+ * Open the device, claim its interface and find its interrupt endpoint.
+ * If the caller has already found the device it passes it, and its
+ * identity if known, otherwise the bus is searched.
+ * Returns 0 on success, with errorMessage describing anything that went
+ * wrong without preventing it, or -1.
+ */
+int
+usbMouseDeviceOpen(usbMouseDevice *dev, libusb_device *device,
+                   const usbMouseDeviceInfo *info)
+{
+    libusb_device **list = NULL;
+    ssize_t n;
+    int i, s;
+    const struct libusb_interface_descriptor *interface;
+    const struct libusb_endpoint_descriptor *endpoint;
+
+    dev->errorMessage[0] = '\0';
+    if (device == NULL) {
+        n = libusb_get_device_list(NULL, &list);
+        if (n < 0) {
+            deviceError(dev, "libusb_get_device_list failed: %d", (int)n);
+            return -1;
+        }
+        for (i = 0 ; i < n ; i++) {
+            s = libusb_get_device_descriptor(list[i], &dev->info.descriptor);
+            if (s != 0) {
+                deviceError(dev, "libusb_get_device_descriptor failed: %d", s);
+                libusb_free_device_list(list, 1);
+                return -1;
+            }
+            if ((dev->info.descriptor.idVendor == dev->idVendor)
+             && (dev->info.descriptor.idProduct == dev->idProduct)) {
+                device = list[i];
+                break;
+            }
+        }
+        if (device == NULL) {
+            deviceError(dev,
+                "Can't find device with vendor ID:%4.4X and product ID:%4.4X",
+                                                dev->idVendor, dev->idProduct);
+            libusb_free_device_list(list, 1);
+            return -1;
+        }
+    }
+    else if (info) {
+        dev->info.descriptor = info->descriptor;
+    }
+    else if ((s = libusb_get_device_descriptor(device, &dev->info.descriptor)) != 0) {
+        deviceError(dev, "libusb_get_device_descriptor failed: %d", s);
+        return -1;
+    }
+
+    /*
+     * Open a connection to the device
+     */
+    s = libusb_open(device, &dev->handle);
+    if (s != 0) {
+        deviceError(dev, "libusb_open failed: %d", s);
+        if (list)
+            libusb_free_device_list(list, 1);
+        return -1;
+    }
+    s = libusb_kernel_driver_active(dev->handle, dev->idNumber);
+    if (s == 1) {
+        s = libusb_detach_kernel_driver(dev->handle, dev->idNumber);
+        if (s != 0)
+            deviceError(dev, "libusb_detach_kernel_driver failed: %d", s);
+    }
+    else if (s != 0) {
+        deviceError(dev, "libusb_kernel_driver_active failed: %d", s);
+        libusb_close(dev->handle);
+        dev->handle = NULL;
+        if (list)
+            libusb_free_device_list(list, 1);
+        return -1;
+    }
+    s = libusb_claim_interface(dev->handle, dev->idNumber);
+    if (s != 0)
+        deviceError(dev, "libusb_claim_interface failed: %d", s);
+
+    /*
+     * Get device information
+     */
+    if (dev->config != NULL)
+        libusb_free_config_descriptor(dev->config);
+    dev->config = NULL;
+    s = libusb_get_config_descriptor(device, 0, &dev->config);
+    if (list)
+        libusb_free_device_list(list, 1);
+    if (s != 0) {
+        deviceError(dev, "libusb_get_config_descriptor failed: %d", s);
+        libusb_close(dev->handle);
+        dev->handle = NULL;
+        return -1;
+    }
+    interface = dev->config->interface->altsetting;
+    endpoint = interface->endpoint;
+    for (i = 0 ; i < interface->bNumEndpoints ; i++) {
+        if ((interface->endpoint[i].bEndpointAddress & LIBUSB_ENDPOINT_IN)
+         && ((interface->endpoint[i].bmAttributes & 0x3) ==
+                                            LIBUSB_TRANSFER_TYPE_INTERRUPT)) {
+            endpoint = &interface->endpoint[i];
+            break;
+        }
+    }
+    dev->endpointAddress = endpoint->bEndpointAddress;
+    dev->pollInterval = 125.0e-6 * (1 << (endpoint->bInterval - 1));
+    if (interface->bInterfaceClass == LIBUSB_CLASS_HID) {
+        const unsigned char *buf = interface->extra;
+        if ((interface->extra_length >= 9)
+         && (interface->extra_length >= buf[0])
+         && (buf[1] == LIBUSB_DT_HID)
+         && (buf[5] >= 1)
+         && (buf[6] == LIBUSB_DT_REPORT)) {
+            getHIDreport(dev, interface, buf);
+        }
+    }
+    else {
+        deviceError(dev, "Interface class (%d) is not LIBUSB_CLASS_HID (%d)",
+                                interface->bInterfaceClass, LIBUSB_CLASS_HID);
+    }
+    if (info) {
+        /*
+         * The caller read the strings when the device appeared
+         */
+        strcpy(dev->info.manufacturer, info->manufacturer);
+        strcpy(dev->info.product, info->product);
+        strcpy(dev->info.serialNumber, info->serialNumber);
+    }
+    else {
+        getStringDescriptor(dev, dev->info.descriptor.iManufacturer,
+                    dev->info.manufacturer, sizeof dev->info.manufacturer);
+        getStringDescriptor(dev, dev->info.descriptor.iProduct,
+                    dev->info.product, sizeof dev->info.product);
+        getStringDescriptor(dev, dev->info.descriptor.iSerialNumber,
+                    dev->info.serialNumber, sizeof dev->info.serialNumber);
+    }
+    return 0;
+}
+
+/*
+ * Poll the device for its current report over the CONTROL pipe
+ */
+int
+usbMouseDeviceReadControl(usbMouseDevice *dev, unsigned char *buf, int size)
+{
+    int s;
+
+    s = libusb_control_transfer(dev->handle,
+                LIBUSB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                HID_REPORT_GET,
+                (HID_RT_INPUT << 8) | 0x00,
+                dev->idNumber,
+                buf, size, dev->timeout);
+    if (s <= 0) {
+        dev->errors++;
+        dev->errorMessage[0] = '\0';
+        deviceError(dev, "libusb_control_transfer failed: %d", s);
+        return -1;
+    }
+    dev->reports++;
+    return s;
+}
+
+/*
+ * Wait for the device to send a report on its INTERRUPT IN endpoint.
+ * Returns 0 if none arrived within the timeout.
+ */
+int
+usbMouseDeviceReadInterrupt(usbMouseDevice *dev, unsigned char *buf, int size)
+{
+    int s, n = 0;
+
+    s = libusb_interrupt_transfer(dev->handle, dev->endpointAddress,
+                                  buf, size, &n, dev->timeout);
+    if (s == LIBUSB_ERROR_TIMEOUT) {
+        dev->timeouts++;
+        return 0;
+    }
+    if (s != 0) {
+        dev->errors++;
+        dev->errorMessage[0] = '\0';
+        deviceError(dev, "libusb_interrupt_transfer failed: %d", s);
+        return -1;
+    }
+    dev->reports++;
+    return n;
+}
+
+void
+usbMouseDeviceClose(usbMouseDevice *dev)
+{
+    if (dev->handle) {
+        libusb_close(dev->handle);
+        dev->handle = NULL;
+    }
+}
+
+void
+usbMouseCaptureHeaderInit(usbMouseCaptureHeader *header, const char *port,
+                          int trial)
+{
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, USBMOUSE_CAPTURE_MAGIC, sizeof header->magic);
+    header->headerSize = sizeof *header;
+    header->recordSize = sizeof(usbMouseCaptureRecord);
+    header->trial = trial;
+    strncpy(header->port, port, sizeof header->port - 1);
+}
+
+/*
+ * Returns 0 if the header is one this library can read records after
+ */
+int
+usbMouseCaptureHeaderCheck(const usbMouseCaptureHeader *header)
+{
+    if ((memcmp(header->magic, USBMOUSE_CAPTURE_MAGIC, sizeof header->magic) != 0)
+     || (header->headerSize < sizeof *header)
+     || (header->recordSize < sizeof(usbMouseCaptureRecord)))
+        return -1;
+    return 0;
+}
+
+void
+usbMouseCaptureRecordSet(usbMouseCaptureRecord *rec,
+                         const usbMouseSample *sample)
+{
+    rec->secPastEpoch = sample->time.secPastEpoch;
+    rec->nsec = sample->time.nsec;
+    rec->sequence = sample->sequence;
+    rec->buttons = sample->values.buttons;
+    rec->x = sample->values.xPosition;
+    rec->y = sample->values.yPosition;
+    rec->wheel = sample->values.wheel;
+}
@@ -0,0 +1,210 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * USB mouse acquisition core
+ *
+ * Report decoding, libusb device access, the capture file format and
+ * the capture block writer.  Nothing here depends on asyn or on the IOC,
+ * so benchmarks and command-line tools link the same code as the driver,
+ * which is a thin adapter over this library.
+ *
+ * Functions that can fail return a negative value and leave a
+ * description in the device's errorMessage; none of them print.
+ */
+#ifndef INC_usbMouseCore_H
+#define INC_usbMouseCore_H
+
+#include <sys/types.h>
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <libusb-1.0/libusb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Largest report we'll read from the device
+ */
+#define USBMOUSE_REPORT_SIZE        80
+
+/*
+ * Elements of the packed sample: buttons, X, Y, wheel
+ */
+#define USBMOUSE_SAMPLE_SIZE        4
+
+/*
+ * Mouse values
+ */
+typedef struct mouseValues {
+    int buttons;
+    int xPosition;
+    int yPosition;
+    int wheel;
+} mouseValues;
+
+/*
+ * One report as it moves through the processing pipeline
+ */
+typedef struct usbMouseSample {
+    epicsTimeStamp  time;
+    unsigned long   sequence;
+    int             resync;
+    int             nRead;
+    unsigned char   report[USBMOUSE_REPORT_SIZE];
+    int             dx;
+    int             dy;
+    int             dWheel;
+    mouseValues     values;
+    double          xVelocity;
+    double          yVelocity;
+} usbMouseSample;
+
+/*
+ * Decoding.  A decoder picks the motion out of a report and updates
+ * the button levels, which it leaves alone if the report has none.
+ */
+typedef void (*usbMouseDecoder)(usbMouseSample *sample, int *buttons);
+void usbMouseDecodeBoot(usbMouseSample *sample, int *buttons);
+
+/*
+ * Reports built from input events, as by the evdev and replay
+ * transports: a button byte followed by little-endian 32-bit X, Y and
+ * wheel motion
+ */
+#define USBMOUSE_EVENT_REPORT_SIZE  13
+int usbMouseEncodeEvents(unsigned char *buf, int buttons, int dx, int dy,
+                         int dWheel);
+void usbMouseDecodeEvents(usbMouseSample *sample, int *buttons);
+
+/*
+ * Scale a delta by num/den exactly, carrying what is left over,
+ * 0 <= remainder < den, to the next delta so no rounding accumulates.
+ * num * delta must fit in 64 bits.
+ */
+epicsInt64 usbMouseScaleDelta(epicsInt64 num, epicsInt64 den,
+                              epicsInt64 *remainder, int delta);
+int usbMouseSignExtend(int size, int value);
+int usbMouseUsesReportIds(const unsigned char *desc, int length);
+void usbMouseAccumulate(mouseValues *state, usbMouseSample *sample,
+                        usbMouseDecoder decode);
+int usbMouseResyncButtons(mouseValues *state, usbMouseSample *sample,
+                          usbMouseDecoder decode);
+
+/*
+ * Device identity, as read when the device is opened or appears
+ */
+typedef struct usbMouseDeviceInfo {
+    struct libusb_device_descriptor descriptor;
+    char                            manufacturer[128];
+    char                            product[128];
+    char                            serialNumber[128];
+} usbMouseDeviceInfo;
+
+/*
+ * An open libusb device
+ */
+typedef struct usbMouseDevice {
+    int                             idVendor;
+    int                             idProduct;
+    int                             idNumber;
+    int                             timeout;        /* ms */
+    libusb_device_handle           *handle;
+    struct libusb_config_descriptor *config;
+    usbMouseDeviceInfo              info;
+    int                             endpointAddress;
+    double                          pollInterval;   /* from bInterval, s */
+    int                             HIDreportLength;
+    unsigned char                  *HIDreport;
+    int                             usesReportIds;
+
+    /*
+     * Statistics
+     */
+    unsigned long                   reports;
+    unsigned long                   timeouts;
+    unsigned long                   errors;
+
+    char                            errorMessage[160];
+} usbMouseDevice;
+
+int usbMouseDeviceInit(usbMouseDevice *dev, int idVendor, int idProduct,
+                       int idNumber);
+int usbMouseDeviceOpen(usbMouseDevice *dev, libusb_device *device,
+                       const usbMouseDeviceInfo *info);
+int usbMouseDeviceReadControl(usbMouseDevice *dev, unsigned char *buf,
+                              int size);
+int usbMouseDeviceReadInterrupt(usbMouseDevice *dev, unsigned char *buf,
+                                int size);
+void usbMouseDeviceClose(usbMouseDevice *dev);
+
+/*
+ * Capture files -- a header followed by records, all in the byte order
+ * of the host that wrote them
+ */
+#define USBMOUSE_CAPTURE_MAGIC      "USBMCAP1"
+
+typedef struct usbMouseCaptureHeader {
+    char            magic[8];
+    epicsUInt32     headerSize;
+    epicsUInt32     recordSize;
+    epicsUInt32     trial;
+    epicsUInt32     spare;
+    char            port[40];
+} usbMouseCaptureHeader;
+
+typedef struct usbMouseCaptureRecord {
+    epicsUInt32     secPastEpoch;
+    epicsUInt32     nsec;
+    epicsUInt64     sequence;
+    epicsInt32      buttons;
+    epicsInt32      x;
+    epicsInt32      y;
+    epicsInt32      wheel;
+} usbMouseCaptureRecord;
+
+void usbMouseCaptureHeaderInit(usbMouseCaptureHeader *header,
+                               const char *port, int trial);
+int usbMouseCaptureHeaderCheck(const usbMouseCaptureHeader *header);
+void usbMouseCaptureRecordSet(usbMouseCaptureRecord *rec,
+                              const usbMouseSample *sample);
+
+/*
+ * Capture block writer -- blocks are aligned, and sized in multiples,
+ * for O_DIRECT.  Failed writes are counted, with the last one described
+ * in the message, which also notes a fall back from io_uring.
+ */
+#define USBMOUSE_WRITER_ALIGN   4096
+typedef struct usbMouseWriter usbMouseWriter;
+typedef struct usbMouseWriterStats {
+    const char     *method;
+    epicsUInt64     bytes;
+    unsigned long   blocks;
+    unsigned long   submits;
+    unsigned long   waits;
+    double          waitTime;
+    unsigned long   errors;
+    int             lastError;
+    int             blocksFree;
+    char            message[160];
+} usbMouseWriterStats;
+usbMouseWriter *usbMouseWriterCreate(const char *name, int nBlocks,
+                                     size_t blockSize, int useUring,
+                                     char *errorMessage, size_t errorSize);
+char *usbMouseWriterAcquire(usbMouseWriter *w);
+void usbMouseWriterQueue(usbMouseWriter *w, int fd, char *block,
+                         size_t length, off_t offset);
+void usbMouseWriterSubmit(usbMouseWriter *w);
+void usbMouseWriterDrain(usbMouseWriter *w);
+void usbMouseWriterGetStats(usbMouseWriter *w, usbMouseWriterStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INC_usbMouseCore_H */
@@ -0,0 +1,504 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Device discovery service
+ *
+ * Keeps an inventory of the HID devices on the USB buses: IDs, bus
+ * path, interface classes, the device descriptor and the strings, read
+ * once when the device appears.  The bus is enumerated again only when
+ * libusb reports a hotplug event, or, where libusb has no hotplug
+ * support, at a fixed interval.  The libusb transports look devices up
+ * here instead of enumerating the bus on every connect and reconnect.
+ *
+ * The service has an asyn port of its own which publishes the inventory
+ * as text (address 0), the number of devices (1) and the number of
+ * changes seen (2).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <epicsExport.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+#include <asynDriver.h>
+#include <asynInt32.h>
+#include <asynOctet.h>
+#include <libusb-1.0/libusb.h>
+
+#include "usbMousePvt.h"
+
+#define DISCOVERY_ADDR_INVENTORY    0
+#define DISCOVERY_ADDR_COUNT        1
+#define DISCOVERY_ADDR_EVENTS       2
+
+#define INVENTORY_SIZE              8192
+
+typedef struct discoveryEntry {
+    struct discoveryEntry  *next;
+    libusb_device          *device;
+    int                     seen;
+    char                    path[32];
+    char                    classes[40];
+    usbMouseDeviceInfo      info;
+} discoveryEntry;
+
+typedef struct discoveryPvt {
+    char               *portName;
+    epicsMutexId        lock;
+    double              refresh;
+    int                 hotplug;
+    volatile int        pending;
+    discoveryEntry     *entries;
+    epicsInt32          count;
+    epicsInt32          events;
+    char               *inventory;
+    int                 dirty;
+    unsigned long       scans;
+
+    asynInterface       asynCommon;
+    asynInterface       asynInt32;
+    void               *asynInt32InterruptPvt;
+    asynInterface       asynOctet;
+    void               *asynOctetInterruptPvt;
+} discoveryPvt;
+
+static discoveryPvt *discovery;
+
+/*
+ * Read what the inventory keeps about a newly arrived device.
+ * Returns 0 if the device is not a HID device.
+ */
+static int
+readDevice(discoveryEntry *ep)
+{
+    struct libusb_config_descriptor *config;
+    libusb_device_handle *handle;
+    usbMouseDeviceInfo *info = &ep->info;
+    unsigned char ports[8];
+    int i, n, isHid = 0;
+    char *cp;
+
+    if (libusb_get_device_descriptor(ep->device, &info->descriptor) != 0)
+        return 0;
+    if (libusb_get_config_descriptor(ep->device, 0, &config) != 0)
+        return 0;
+    ep->classes[0] = '\0';
+    for (i = 0, cp = ep->classes ; i < config->bNumInterfaces ; i++) {
+        const struct libusb_interface_descriptor *interface =
+                                            config->interface[i].altsetting;
+        if (interface->bInterfaceClass == LIBUSB_CLASS_HID)
+            isHid = 1;
+        if (cp < ep->classes + sizeof ep->classes - 4)
+            cp += sprintf(cp, "%s%2.2x", i ? "," : "", interface->bInterfaceClass);
+    }
+    libusb_free_config_descriptor(config);
+    if (!isHid)
+        return 0;
+
+    cp = ep->path;
+    cp += sprintf(cp, "%d", libusb_get_bus_number(ep->device));
+    n = libusb_get_port_numbers(ep->device, ports, sizeof ports);
+    for (i = 0 ; i < n ; i++)
+        cp += sprintf(cp, "%c%d", i ? '.' : '-', ports[i]);
+
+    strcpy(info->manufacturer, "???");
+    strcpy(info->product, "???");
+    strcpy(info->serialNumber, "???");
+    if (libusb_open(ep->device, &handle) == 0) {
+        if (info->descriptor.iManufacturer)
+            libusb_get_string_descriptor_ascii(handle, info->descriptor.iManufacturer,
+                    (unsigned char *)info->manufacturer, sizeof info->manufacturer);
+        if (info->descriptor.iProduct)
+            libusb_get_string_descriptor_ascii(handle, info->descriptor.iProduct,
+                    (unsigned char *)info->product, sizeof info->product);
+        if (info->descriptor.iSerialNumber)
+            libusb_get_string_descriptor_ascii(handle, info->descriptor.iSerialNumber,
+                    (unsigned char *)info->serialNumber, sizeof info->serialNumber);
+        libusb_close(handle);
+    }
+    return 1;
+}
+
+/*
+ * Rebuild the inventory text -- called with the lock held
+ */
+static void
+buildInventory(discoveryPvt *pvt)
+{
+    discoveryEntry *ep;
+    char *cp = pvt->inventory, *end = pvt->inventory + INVENTORY_SIZE;
+
+    *cp = '\0';
+    for (ep = pvt->entries ; ep ; ep = ep->next) {
+        int n = epicsSnprintf(cp, end - cp, "%4.4x:%4.4x %-12s if %-8s S/N %s  %s %s\n",
+                    ep->info.descriptor.idVendor, ep->info.descriptor.idProduct,
+                    ep->path, ep->classes, ep->info.serialNumber,
+                    ep->info.manufacturer, ep->info.product);
+        if ((n < 0) || (n >= end - cp)) {
+            strcpy(end - 5, "...\n");
+            break;
+        }
+        cp += n;
+    }
+}
+
+/*
+ * Enumerate the bus and bring the inventory up to date
+ */
+static void
+rescan(discoveryPvt *pvt)
+{
+    libusb_device **list;
+    discoveryEntry *ep, **epp;
+    ssize_t n;
+    int i, changed = 0;
+
+    n = libusb_get_device_list(NULL, &list);
+    if (n < 0) {
+        printf("usbMouseDiscovery: libusb_get_device_list failed: %d\n", (int)n);
+        return;
+    }
+    epicsMutexMustLock(pvt->lock);
+    pvt->scans++;
+    for (ep = pvt->entries ; ep ; ep = ep->next)
+        ep->seen = 0;
+    for (i = 0 ; i < n ; i++) {
+        for (ep = pvt->entries ; ep ; ep = ep->next) {
+            if (ep->device == list[i]) {
+                ep->seen = 1;
+                break;
+            }
+        }
+        if (ep)
+            continue;
+        ep = callocMustSucceed(1, sizeof *ep, "usbMouseDiscovery");
+        ep->device = list[i];
+        if (!readDevice(ep)) {
+            free(ep);
+            continue;
+        }
+        libusb_ref_device(ep->device);
+        ep->seen = 1;
+        for (epp = &pvt->entries ; *epp ; epp = &(*epp)->next)
+            continue;
+        *epp = ep;
+        changed = 1;
+    }
+    for (epp = &pvt->entries ; (ep = *epp) != NULL ; ) {
+        if (ep->seen) {
+            epp = &ep->next;
+            continue;
+        }
+        *epp = ep->next;
+        libusb_unref_device(ep->device);
+        free(ep);
+        changed = 1;
+    }
+    if (changed) {
+        pvt->count = 0;
+        for (ep = pvt->entries ; ep ; ep = ep->next)
+            pvt->count++;
+        pvt->events++;
+        buildInventory(pvt);
+        pvt->dirty = 1;
+    }
+    epicsMutexUnlock(pvt->lock);
+    libusb_free_device_list(list, 1);
+}
+
+static void
+publish(discoveryPvt *pvt)
+{
+    ELLLIST *pclientList;
+    interruptNode *pnode;
+    epicsTimeStamp now;
+    epicsInt32 value[3];
+
+    epicsTimeGetCurrent(&now);
+    epicsMutexMustLock(pvt->lock);
+    value[DISCOVERY_ADDR_COUNT] = pvt->count;
+    value[DISCOVERY_ADDR_EVENTS] = pvt->events;
+    pvt->dirty = 0;
+    pasynManager->interruptStart(pvt->asynOctetInterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynOctetInterrupt *octetInterrupt = pnode->drvPvt;
+        if (octetInterrupt->addr == DISCOVERY_ADDR_INVENTORY) {
+            octetInterrupt->pasynUser->timestamp = now;
+            octetInterrupt->callback(octetInterrupt->userPvt,
+                                     octetInterrupt->pasynUser,
+                                     pvt->inventory, strlen(pvt->inventory),
+                                     ASYN_EOM_END);
+        }
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pvt->asynOctetInterruptPvt);
+    epicsMutexUnlock(pvt->lock);
+    pasynManager->interruptStart(pvt->asynInt32InterruptPvt, &pclientList);
+    pnode = (interruptNode *)ellFirst(pclientList);
+    while (pnode) {
+        asynInt32Interrupt *int32Interrupt = pnode->drvPvt;
+        int addr = int32Interrupt->addr;
+        if ((addr == DISCOVERY_ADDR_COUNT) || (addr == DISCOVERY_ADDR_EVENTS)) {
+            int32Interrupt->pasynUser->timestamp = now;
+            int32Interrupt->callback(int32Interrupt->userPvt,
+                                     int32Interrupt->pasynUser, value[addr]);
+        }
+        pnode = (interruptNode *)ellNext(&pnode->node);
+    }
+    pasynManager->interruptEnd(pvt->asynInt32InterruptPvt);
+}
+
+static int
+hotplugCallback(libusb_context *ctx, libusb_device *device,
+                libusb_hotplug_event event, void *arg)
+{
+    discoveryPvt *pvt = arg;
+
+    /*
+     * May run in any thread handling libusb events, so just note it
+     */
+    pvt->pending = 1;
+    return 0;
+}
+
+static void
+discoveryThread(void *arg)
+{
+    discoveryPvt *pvt = arg;
+    extern volatile int interruptAccept;
+
+    for (;;) {
+        if (pvt->hotplug) {
+            struct timeval tv;
+            tv.tv_sec = 0;
+            tv.tv_usec = 200000;
+            libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+        }
+        else {
+            epicsThreadSleep(pvt->refresh);
+            pvt->pending = 1;
+        }
+        if (pvt->pending) {
+            pvt->pending = 0;
+            rescan(pvt);
+        }
+        if (interruptAccept && pvt->dirty)
+            publish(pvt);
+    }
+}
+
+/*
+ * Look a device up in the inventory.  Returns 1 with a reference to the
+ * device if it is there, 0 if it is not, or -1 if there is no inventory.
+ */
+int
+usbMouseDiscoveryFind(int idVendor, int idProduct, libusb_device **device,
+                      usbMouseDeviceInfo *info)
+{
+    discoveryEntry *ep;
+
+    if (discovery == NULL)
+        return -1;
+    epicsMutexMustLock(discovery->lock);
+    for (ep = discovery->entries ; ep ; ep = ep->next) {
+        if ((ep->info.descriptor.idVendor == idVendor)
+         && (ep->info.descriptor.idProduct == idProduct)) {
+            *device = libusb_ref_device(ep->device);
+            *info = ep->info;
+            break;
+        }
+    }
+    epicsMutexUnlock(discovery->lock);
+    return ep != NULL;
+}
+
+/*
+ * asyn methods
+ */
+static void
+report(void *arg, FILE *fp, int details)
+{
+    discoveryPvt *pvt = arg;
+
+    epicsMutexMustLock(pvt->lock);
+    fprintf(fp, "    %d devices, %d changes, %lu scans (%s)\n",
+                (int)pvt->count, (int)pvt->events, pvt->scans,
+                pvt->hotplug ? "hotplug" : "polled");
+    if (details >= 1)
+        fprintf(fp, "%s", pvt->inventory);
+    epicsMutexUnlock(pvt->lock);
+}
+
+static asynStatus
+connect(void *arg, asynUser *pasynUser)
+{
+    pasynManager->exceptionConnect(pasynUser);
+    return asynSuccess;
+}
+
+static asynStatus
+disconnect(void *arg, asynUser *pasynUser)
+{
+    pasynManager->exceptionDisconnect(pasynUser);
+    return asynSuccess;
+}
+static asynCommon commonMethods = { report, connect, disconnect };
+
+static asynStatus
+int32Read(void *arg, asynUser *pasynUser, epicsInt32 *value)
+{
+    discoveryPvt *pvt = arg;
+    int addr;
+    asynStatus status;
+
+    status = pasynManager->getAddr(pasynUser, &addr);
+    if (status != asynSuccess)
+        return status;
+    switch (addr) {
+    case DISCOVERY_ADDR_COUNT:  *value = pvt->count;    break;
+    case DISCOVERY_ADDR_EVENTS: *value = pvt->events;   break;
+    default:
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                                        "No integer at address %d", addr);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+static asynStatus
+octetRead(void *arg, asynUser *pasynUser, char *data, size_t maxchars,
+          size_t *nbytesTransfered, int *eomReason)
+{
+    discoveryPvt *pvt = arg;
+    size_t n;
+
+    epicsMutexMustLock(pvt->lock);
+    n = strlen(pvt->inventory);
+    if (n > maxchars)
+        n = maxchars;
+    memcpy(data, pvt->inventory, n);
+    epicsMutexUnlock(pvt->lock);
+    *nbytesTransfered = n;
+    if (eomReason)
+        *eomReason = ASYN_EOM_END;
+    return asynSuccess;
+}
+
+static asynInt32 int32Methods = { NULL, int32Read };
+static asynOctet octetMethods = { NULL, octetRead };
+
+static void
+usbMouseDiscovery(const char *portName, double refresh)
+{
+    discoveryPvt *pvt;
+    asynStatus status;
+    char threadName[40];
+
+    if (discovery) {
+        printf("The discovery service is already running on %s.\n",
+                                                    discovery->portName);
+        return;
+    }
+    if ((portName == NULL) || (*portName == '\0')) {
+        printf("Usage: usbMouseDiscovery port [refresh]\n");
+        return;
+    }
+    if (libusb_init(NULL) != 0) {
+        printf("usbMouseDiscovery: libusb_init failed\n");
+        return;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, portName);
+    pvt->portName = epicsStrDup(portName);
+    pvt->lock = epicsMutexMustCreate();
+    pvt->refresh = refresh > 0 ? refresh : 2.0;
+    pvt->inventory = callocMustSucceed(1, INVENTORY_SIZE, portName);
+
+    status = pasynManager->registerPort(pvt->portName, ASYN_MULTIDEVICE, 1, 0, 0);
+    if (status != asynSuccess) {
+        printf("registerPort failed\n");
+        return;
+    }
+    pvt->asynCommon.interfaceType = asynCommonType;
+    pvt->asynCommon.pinterface  = &commonMethods;
+    pvt->asynCommon.drvPvt = pvt;
+    status = pasynManager->registerInterface(pvt->portName, &pvt->asynCommon);
+    if (status != asynSuccess) {
+        printf("registerInterface failed\n");
+        return;
+    }
+    pvt->asynInt32.interfaceType = asynInt32Type;
+    pvt->asynInt32.pinterface  = &int32Methods;
+    pvt->asynInt32.drvPvt = pvt;
+    status = pasynInt32Base->initialize(pvt->portName, &pvt->asynInt32);
+    if (status != asynSuccess) {
+        printf("pasynInt32Base->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pvt->portName, &pvt->asynInt32,
+                                                &pvt->asynInt32InterruptPvt);
+    pvt->asynOctet.interfaceType = asynOctetType;
+    pvt->asynOctet.pinterface  = &octetMethods;
+    pvt->asynOctet.drvPvt = pvt;
+    status = pasynOctetBase->initialize(pvt->portName, &pvt->asynOctet, 0, 0, 0);
+    if (status != asynSuccess) {
+        printf("pasynOctetBase->initialize failed\n");
+        return;
+    }
+    pasynManager->registerInterruptSource(pvt->portName, &pvt->asynOctet,
+                                                &pvt->asynOctetInterruptPvt);
+
+    /*
+     * Take the first inventory now so that ports configured next can use it
+     */
+    rescan(pvt);
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+     && (libusb_hotplug_register_callback(NULL,
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                    LIBUSB_HOTPLUG_NO_FLAGS, LIBUSB_HOTPLUG_MATCH_ANY,
+                    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                    hotplugCallback, pvt, NULL) == 0)) {
+        pvt->hotplug = 1;
+    }
+    epicsSnprintf(threadName, sizeof threadName, "%s_DISCOVERY", pvt->portName);
+    if (epicsThreadCreate(threadName,
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          discoveryThread,
+                          pvt) == NULL) {
+        printf("Can't set up %s thread!\n", threadName);
+        return;
+    }
+    discovery = pvt;
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseDiscoveryArg0 = { "port",iocshArgString};
+static const iocshArg usbMouseDiscoveryArg1 = { "refresh(s)",iocshArgDouble};
+static const iocshArg *usbMouseDiscoveryArgs[] = {
+                    &usbMouseDiscoveryArg0, &usbMouseDiscoveryArg1 };
+static const iocshFuncDef usbMouseDiscoveryFuncDef =
+      {"usbMouseDiscovery",2,usbMouseDiscoveryArgs};
+static void usbMouseDiscoveryCallFunc(const iocshArgBuf *args)
+{
+    usbMouseDiscovery(args[0].sval, args[1].dval);
+}
+
+static void
+usbMouseDiscovery_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseDiscoveryFuncDef,usbMouseDiscoveryCallFunc);
+}
+epicsExportRegistrar(usbMouseDiscovery_RegisterCommands);
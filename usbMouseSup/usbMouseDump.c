@@ -0,0 +1,100 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Read a mouse without an IOC, through the acquisition core library
+ *
+ *  usbMouseDump idVendor idProduct [interface] [count] [capture file]
+ *
+ * Each report is decoded and printed, and optionally written to a file
+ * in the capture stage's format.  A count of 0 reads until interrupted.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <epicsTime.h>
+
+#include "usbMouseCore.h"
+
+int
+main(int argc, char **argv)
+{
+    usbMouseDevice dev;
+    usbMouseSample sample;
+    mouseValues state;
+    FILE *fp = NULL;
+    unsigned long count = 0;
+    int idVendor, idProduct, idNumber = 0;
+    int s;
+
+    if ((argc < 3) || (argc > 6)) {
+        fprintf(stderr, "Usage: %s idVendor idProduct [interface] [count] [capture file]\n",
+                                                                        argv[0]);
+        return 2;
+    }
+    idVendor = strtol(argv[1], NULL, 0);
+    idProduct = strtol(argv[2], NULL, 0);
+    if (argc > 3)
+        idNumber = strtol(argv[3], NULL, 0);
+    if (argc > 4)
+        count = strtoul(argv[4], NULL, 0);
+    if (usbMouseDeviceInit(&dev, idVendor, idProduct, idNumber) != 0) {
+        fprintf(stderr, "%s\n", dev.errorMessage);
+        return 1;
+    }
+    if (usbMouseDeviceOpen(&dev, NULL, NULL) != 0) {
+        fprintf(stderr, "%s\n", dev.errorMessage);
+        return 1;
+    }
+    if (dev.errorMessage[0])
+        fprintf(stderr, "Warning -- %s\n", dev.errorMessage);
+    printf("%s %s (%s), endpoint %#x, %.3g ms\n", dev.info.manufacturer,
+                    dev.info.product, dev.info.serialNumber,
+                    dev.endpointAddress, dev.pollInterval * 1000);
+    if (argc > 5) {
+        usbMouseCaptureHeader header;
+
+        if ((fp = fopen(argv[5], "wb")) == NULL) {
+            perror(argv[5]);
+            usbMouseDeviceClose(&dev);
+            return 1;
+        }
+        usbMouseCaptureHeaderInit(&header, "usbMouseDump", 0);
+        fwrite(&header, sizeof header, 1, fp);
+    }
+    memset(&state, 0, sizeof state);
+    memset(&sample, 0, sizeof sample);
+    while ((count == 0) || (sample.sequence < count)) {
+        s = usbMouseDeviceReadInterrupt(&dev, sample.report,
+                                        sizeof sample.report);
+        if (s < 0) {
+            fprintf(stderr, "%s\n", dev.errorMessage);
+            break;
+        }
+        if (s == 0)
+            continue;
+        epicsTimeGetCurrent(&sample.time);
+        sample.nRead = s;
+        usbMouseAccumulate(&state, &sample, usbMouseDecodeBoot);
+        printf("%lu %u.%09u %#4x %6d %6d %6d\n", sample.sequence,
+                    sample.time.secPastEpoch, sample.time.nsec,
+                    state.buttons, state.xPosition, state.yPosition, state.wheel);
+        if (fp) {
+            usbMouseCaptureRecord rec;
+            usbMouseCaptureRecordSet(&rec, &sample);
+            fwrite(&rec, sizeof rec, 1, fp);
+        }
+        sample.sequence++;
+    }
+    printf("%lu reports, %lu timeouts, %lu errors\n", dev.reports,
+                                                dev.timeouts, dev.errors);
+    if (fp)
+        fclose(fp);
+    usbMouseDeviceClose(&dev);
+    return s < 0;
+}
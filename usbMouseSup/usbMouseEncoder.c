@@ -0,0 +1,242 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Encoder stage -- treat an axis of a trackball or dial as a rotary
+ * encoder
+ *
+ * Each axis given a number of counts per revolution keeps a 64-bit
+ * count, the whole revolutions and the position within the current
+ * revolution.  The position is held as an exact fraction of a
+ * revolution, so the angle is the same after a million turns as after
+ * one.  The angle, revolutions and count are worked out once per report
+ * and sent, when they change, on addresses of their own, so records need
+ * no CALC chains running at the report rate.
+ *
+ * Homing makes the current position zero.  It happens when the button
+ * named by the home argument is pressed, or when a non-zero value is
+ * written to an axis's home address, for example by a record with its
+ * DOL linked to an index or limit PV.  Each axis sends whether it has
+ * been homed on that address too.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsStdio.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+#define NAXES 3
+
+typedef struct encoderAxis {
+    int             addr;
+    epicsInt64      num;            /* counts per revolution is num/den */
+    epicsInt64      den;
+    epicsInt64      count;
+    epicsInt64      phase;          /* 0 <= phase < num, in 1/den counts */
+    epicsInt64      revolutions;
+    int             homed;
+    unsigned long   homeCount;
+    int             publishAll;
+    epicsInt64      publishedCount;
+    epicsInt64      publishedRevolutions;
+} encoderAxis;
+
+typedef struct encoderPvt {
+    drvPvt         *pdpvt;
+    epicsMutexId    lock;
+    int             homeButton;
+    int             buttons;
+    encoderAxis    *axes[NAXES];
+    encoderAxis     axis[NAXES];
+} encoderPvt;
+
+static const char *const axisNames[NAXES] = { "x", "y", "wheel" };
+
+/*
+ * Set an axis from its counts per revolution, a decimal such as 1024
+ * or 360.5.  Returns 0 if the axis isn't used, -1 if the value is bad.
+ */
+static int
+encoderAxisInit(encoderAxis *ax, const char *args, const char *key)
+{
+    char buf[40];
+    const char *cp;
+
+    usbMouseArgString(args, key, "", buf, sizeof buf);
+    if (buf[0] == '\0')
+        return 0;
+    cp = usbMouseParseDecimal(buf, &ax->num, &ax->den);
+    if ((cp == NULL) || (*cp != '\0') || (ax->num <= 0)) {
+        printf("encoder stage %s must be a positive number of counts per revolution\n", key);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Move an axis.  A count is den/num of a revolution, so whole
+ * revolutions come out of the phase as a delta scaled by that.
+ */
+static void
+encoderAxisMove(encoderAxis *ax, int delta)
+{
+    ax->count += delta;
+    ax->revolutions += usbMouseScaleDelta(ax->den, ax->num, &ax->phase, delta);
+}
+
+static void
+encoderAxisHome(encoderAxis *ax)
+{
+    ax->count = 0;
+    ax->phase = 0;
+    ax->revolutions = 0;
+    ax->homed = 1;
+    ax->homeCount++;
+    ax->publishAll = 1;
+}
+
+static void
+encoderAxisPublish(drvPvt *pdpvt, encoderAxis *ax, const epicsTimeStamp *time)
+{
+    if (ax->publishAll || (ax->count != ax->publishedCount)) {
+        usbMousePublishFloat64(pdpvt, ax->addr + USBMOUSE_ENCODER_ANGLE,
+                                    ax->phase * 360.0 / ax->num, time);
+        usbMousePublishFloat64(pdpvt, ax->addr + USBMOUSE_ENCODER_COUNT,
+                                    (epicsFloat64)ax->count, time);
+#ifdef USBMOUSE_HAVE_INT64
+        usbMousePublishInt64(pdpvt, ax->addr + USBMOUSE_ENCODER_COUNT,
+                                    ax->count, time);
+#endif
+        ax->publishedCount = ax->count;
+    }
+    if (ax->publishAll || (ax->revolutions != ax->publishedRevolutions)) {
+        usbMousePublishInt32(pdpvt, ax->addr + USBMOUSE_ENCODER_REVOLUTIONS,
+                                    (epicsInt32)ax->revolutions, time);
+        ax->publishedRevolutions = ax->revolutions;
+    }
+    if (ax->publishAll)
+        usbMousePublishInt32(pdpvt, ax->addr + USBMOUSE_ENCODER_HOME,
+                                    ax->homed, time);
+    ax->publishAll = 0;
+}
+
+static void *
+encoderCreate(drvPvt *pdpvt, const char *args)
+{
+    encoderPvt *pvt;
+    int i, s, nAxes = 0;
+
+    pvt = callocMustSucceed(1, sizeof *pvt, "encoderCreate");
+    for (i = 0 ; i < NAXES ; i++) {
+        encoderAxis *ax = &pvt->axis[i];
+        if ((s = encoderAxisInit(ax, args, axisNames[i])) < 0) {
+            free(pvt);
+            return NULL;
+        }
+        if (s) {
+            ax->addr = USBMOUSE_ADDR_ENCODER + i * USBMOUSE_ENCODER_STRIDE;
+            ax->publishAll = 1;
+            pvt->axes[i] = ax;
+            nAxes++;
+        }
+    }
+    if (nAxes == 0) {
+        printf("encoder stage needs x, y or wheel=<counts per revolution>\n");
+        free(pvt);
+        return NULL;
+    }
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    pvt->homeButton = usbMouseArgInt(args, "home", -1);
+    return pvt;
+}
+
+static int
+encoderProcess(void *arg, usbMouseSample *sample)
+{
+    encoderPvt *pvt = arg;
+    int delta[NAXES], pressed, i;
+
+    delta[0] = sample->dx;
+    delta[1] = sample->dy;
+    delta[2] = sample->dWheel;
+    epicsMutexMustLock(pvt->lock);
+    pressed = sample->values.buttons & ~pvt->buttons;
+    pvt->buttons = sample->values.buttons;
+    for (i = 0 ; i < NAXES ; i++) {
+        encoderAxis *ax = pvt->axes[i];
+        if (ax == NULL)
+            continue;
+        if (delta[i])
+            encoderAxisMove(ax, delta[i]);
+        if ((pvt->homeButton >= 0) && (pressed & (1 << pvt->homeButton)))
+            encoderAxisHome(ax);
+        encoderAxisPublish(pvt->pdpvt, ax, &sample->time);
+    }
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+/*
+ * A non-zero value written to an axis's home address homes the axis.
+ * Zero is accepted and ignored, so a record can follow a level.
+ */
+static int
+encoderWrite(void *arg, int addr, double value)
+{
+    encoderPvt *pvt = arg;
+    encoderAxis *ax;
+    int i = (addr - USBMOUSE_ADDR_ENCODER) / USBMOUSE_ENCODER_STRIDE;
+    epicsTimeStamp now;
+
+    if ((addr < USBMOUSE_ADDR_ENCODER) || (i >= NAXES)
+     || ((ax = pvt->axes[i]) == NULL)
+     || (addr != ax->addr + USBMOUSE_ENCODER_HOME))
+        return 0;
+    if (value == 0)
+        return 1;
+    epicsMutexMustLock(pvt->lock);
+    encoderAxisHome(ax);
+    pvt->pdpvt->clock->now(pvt->pdpvt->clock, &now);
+    encoderAxisPublish(pvt->pdpvt, ax, &now);
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+static void
+encoderReport(void *arg, FILE *fp, int details)
+{
+    encoderPvt *pvt = arg;
+    int i, n = 0;
+
+    epicsMutexMustLock(pvt->lock);
+    for (i = 0 ; i < NAXES ; i++) {
+        encoderAxis *ax = pvt->axes[i];
+        if (ax == NULL)
+            continue;
+        fprintf(fp, "%s%s=%.9g", n++ ? " " : "", axisNames[i],
+                                            (double)ax->num / ax->den);
+        if (details >= 3)
+            fprintf(fp, " (count %lld, %lld rev + %.3f deg, %s %lu times)",
+                                (long long)ax->count,
+                                (long long)ax->revolutions,
+                                ax->phase * 360.0 / ax->num,
+                                ax->homed ? "homed" : "not homed",
+                                ax->homeCount);
+    }
+    if (pvt->homeButton >= 0)
+        fprintf(fp, " home=%d", pvt->homeButton);
+    epicsMutexUnlock(pvt->lock);
+}
+
+const usbMouseStageType usbMouseEncoderStage = {
+    "encoder", encoderCreate, encoderProcess, encoderReport, encoderWrite
+};
@@ -0,0 +1,700 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Software USB mouse on a virtual bus
+ *
+ * Uses the kernel's raw-gadget interface to present a boot protocol HID
+ * mouse through a USB device controller, normally the dummy_udc of the
+ * dummy_hcd module, which loops it back to a virtual host controller on
+ * the same machine.  The mouse then enumerates like hardware, so the
+ * libusb transports open, claim and read it through usbfs and the
+ * kernel's own HID driver binds to it for the hidraw and evdev
+ * transports.
+ *
+ * Reports are queued and handed to the interrupt IN endpoint one at a
+ * time.  A GET_REPORT request takes everything still queued, summed
+ * into one report, so every count of motion is delivered once whichever
+ * pipe the host reads, except that a report already handed to the
+ * endpoint waits there for the next interrupt transfer.  If nothing
+ * reads the mouse the queue coalesces motion into its newest entry, as
+ * a real mouse does between polls.
+ *
+ * Faults can be injected from the IOC shell: stalled GET_REPORT
+ * requests, dropped reports, short reports and a disconnect from the
+ * bus followed by a fresh enumeration.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+
+#include "usbMousePvt.h"
+
+#define REPORT_SIZE     4
+#define QUEUE_SIZE      1024
+#define EP0_MAX_DATA    256
+
+#define HID_DT_HID          0x21
+#define HID_DT_REPORT       0x22
+#define HID_REQ_GET_REPORT  0x01
+#define HID_REQ_GET_IDLE    0x02
+#define HID_REQ_GET_PROTOCOL 0x03
+#define HID_REQ_SET_IDLE    0x0A
+#define HID_REQ_SET_PROTOCOL 0x0B
+
+typedef struct gadgetReport {
+    int             buttons;
+    int             dx;
+    int             dy;
+    int             wheel;
+} gadgetReport;
+
+static struct gadget {
+    int             fd;
+    char            udcDevice[UDC_NAME_LENGTH_MAX];
+    int             idVendor;
+    int             idProduct;
+    epicsMutexId    lock;
+    epicsEventId    reportReady;
+    epicsEventId    configured;
+    int             epAddress;
+    int             epHandle;
+    int             configuration;
+    gadgetReport    queue[QUEUE_SIZE];
+    int             head;
+    int             count;
+    int             buttons;
+    int             stallCount;
+    int             dropCount;
+    int             shortCount;
+    unsigned long   interruptCount;
+    unsigned long   controlCount;
+} gadget = { -1 };
+
+/*
+ * Descriptors -- high speed so that bInterval 1 allows 8000 reports/s
+ */
+static unsigned char deviceDescriptor[USB_DT_DEVICE_SIZE] = {
+    USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x00, 0x02, 0, 0, 0, 64,
+    0, 0, 0, 0, 0x00, 0x01, 1, 2, 3, 1
+};
+
+static unsigned char configDescriptor[] = {
+    /* Configuration */
+    USB_DT_CONFIG_SIZE, USB_DT_CONFIG, 34, 0, 1, 1, 0, 0xA0, 50,
+    /* Interface: HID, boot subclass, mouse protocol */
+    USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 1, USB_CLASS_HID, 1, 2, 0,
+    /* HID: version 1.11, one report descriptor */
+    9, HID_DT_HID, 0x11, 0x01, 0, 1, HID_DT_REPORT, 0, 0,
+    /* Endpoint: interrupt IN, 8 bytes, every microframe */
+    USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 0, USB_ENDPOINT_XFER_INT, 8, 0, 1
+};
+#define CONFIG_HID_OFFSET       18
+#define CONFIG_ENDPOINT_OFFSET  27
+
+static const char *strings[] = {
+    NULL, "usbMouse", "usbMouse test gadget", "0001"
+};
+
+static int
+clamp8(int v)
+{
+    return v > 127 ? 127 : v < -127 ? -127 : v;
+}
+
+static void
+packReport(const gadgetReport *r, unsigned char *buf)
+{
+    buf[0] = r->buttons;
+    buf[1] = (signed char)r->dx;
+    buf[2] = (signed char)r->dy;
+    buf[3] = (signed char)r->wheel;
+}
+
+/*
+ * Add a report to the queue -- called with the lock held
+ */
+static void
+queuePush(const gadgetReport *r)
+{
+    if (gadget.count == QUEUE_SIZE) {
+        gadgetReport *last = &gadget.queue[(gadget.head + gadget.count - 1) % QUEUE_SIZE];
+        if ((last->buttons == r->buttons)
+         && (abs(last->dx + r->dx) <= 127)
+         && (abs(last->dy + r->dy) <= 127)
+         && (abs(last->wheel + r->wheel) <= 127)) {
+            last->dx += r->dx;
+            last->dy += r->dy;
+            last->wheel += r->wheel;
+            return;
+        }
+        gadget.head = (gadget.head + 1) % QUEUE_SIZE;
+        gadget.count--;
+    }
+    gadget.queue[(gadget.head + gadget.count) % QUEUE_SIZE] = *r;
+    gadget.count++;
+}
+
+/*
+ * Sum the queue into one report for GET_REPORT -- called with the lock held.
+ * Motion beyond the range of one report stays queued, split into reports
+ * in range.  The queue held at least one report per 127 counts, so the
+ * remainder always fits.
+ */
+static void
+queueDrain(gadgetReport *r)
+{
+    gadgetReport rest;
+
+    memset(r, 0, sizeof *r);
+    r->buttons = gadget.buttons;
+    memset(&rest, 0, sizeof rest);
+    while (gadget.count) {
+        gadgetReport *q = &gadget.queue[gadget.head];
+        rest.dx += q->dx;
+        rest.dy += q->dy;
+        rest.wheel += q->wheel;
+        gadget.head = (gadget.head + 1) % QUEUE_SIZE;
+        gadget.count--;
+    }
+    r->dx = clamp8(rest.dx);
+    r->dy = clamp8(rest.dy);
+    r->wheel = clamp8(rest.wheel);
+    rest.dx -= r->dx;
+    rest.dy -= r->dy;
+    rest.wheel -= r->wheel;
+    while (rest.dx || rest.dy || rest.wheel) {
+        gadgetReport part;
+        part.buttons = r->buttons;
+        part.dx = clamp8(rest.dx);
+        part.dy = clamp8(rest.dy);
+        part.wheel = clamp8(rest.wheel);
+        rest.dx -= part.dx;
+        rest.dy -= part.dy;
+        rest.wheel -= part.wheel;
+        queuePush(&part);
+    }
+}
+
+static void
+ep0Stall(void)
+{
+    ioctl(gadget.fd, USB_RAW_IOCTL_EP0_STALL, 0);
+}
+
+static void
+ep0Reply(const void *data, int length, int wLength)
+{
+    struct {
+        struct usb_raw_ep_io inner;
+        unsigned char        data[EP0_MAX_DATA];
+    } io;
+
+    if (length > wLength)
+        length = wLength;
+    if (length > EP0_MAX_DATA)
+        length = EP0_MAX_DATA;
+    io.inner.ep = 0;
+    io.inner.flags = 0;
+    io.inner.length = length;
+    memcpy(io.data, data, length);
+    if (ioctl(gadget.fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+        printf("usbMouseGadget: ep0 write failed: %s\n", strerror(errno));
+}
+
+static void
+ep0Ack(void)
+{
+    struct usb_raw_ep_io io;
+
+    io.ep = 0;
+    io.flags = 0;
+    io.length = 0;
+    if (ioctl(gadget.fd, USB_RAW_IOCTL_EP0_READ, &io) < 0)
+        printf("usbMouseGadget: ep0 ack failed: %s\n", strerror(errno));
+}
+
+/*
+ * Pick an interrupt IN endpoint from those the UDC offers
+ */
+static int
+findEndpoint(void)
+{
+    struct usb_raw_eps_info info;
+    int n, i;
+
+    memset(&info, 0, sizeof info);
+    n = ioctl(gadget.fd, USB_RAW_IOCTL_EPS_INFO, &info);
+    for (i = 0 ; i < n ; i++) {
+        if (info.eps[i].caps.type_int && info.eps[i].caps.dir_in) {
+            if (info.eps[i].addr == USB_RAW_EP_ADDR_ANY)
+                return USB_DIR_IN | 1;
+            return USB_DIR_IN | info.eps[i].addr;
+        }
+    }
+    return -1;
+}
+
+/*
+ * EP_ENABLE copies a whole struct usb_endpoint_descriptor, audio fields
+ * and all, so it gets one of those rather than the 7 bytes in the
+ * configuration descriptor
+ */
+static int
+setConfiguration(int value)
+{
+    const unsigned char *ep = &configDescriptor[CONFIG_ENDPOINT_OFFSET];
+    struct usb_endpoint_descriptor desc;
+
+    epicsMutexMustLock(gadget.lock);
+    if (gadget.epHandle >= 0) {
+        ioctl(gadget.fd, USB_RAW_IOCTL_EP_DISABLE, gadget.epHandle);
+        gadget.epHandle = -1;
+    }
+    gadget.configuration = 0;
+    if (value == 1) {
+        memset(&desc, 0, sizeof desc);
+        desc.bLength = ep[0];
+        desc.bDescriptorType = ep[1];
+        desc.bEndpointAddress = ep[2];
+        desc.bmAttributes = ep[3];
+        desc.wMaxPacketSize = htole16(ep[4] | (ep[5] << 8));
+        desc.bInterval = ep[6];
+        gadget.epHandle = ioctl(gadget.fd, USB_RAW_IOCTL_EP_ENABLE, &desc);
+        if (gadget.epHandle < 0) {
+            printf("usbMouseGadget: can't enable endpoint: %s\n", strerror(errno));
+            epicsMutexUnlock(gadget.lock);
+            return -1;
+        }
+        ioctl(gadget.fd, USB_RAW_IOCTL_VBUS_DRAW, configDescriptor[8] * 2);
+        ioctl(gadget.fd, USB_RAW_IOCTL_CONFIGURE, 0);
+        gadget.configuration = 1;
+        epicsEventSignal(gadget.configured);
+    }
+    epicsMutexUnlock(gadget.lock);
+    return 0;
+}
+
+static void
+getDescriptor(const struct usb_ctrlrequest *ctrl)
+{
+    int type = ctrl->wValue >> 8, index = ctrl->wValue & 0xFF;
+    unsigned char buf[EP0_MAX_DATA];
+    const char *cp;
+    int n;
+
+    switch (type) {
+    case USB_DT_DEVICE:
+        ep0Reply(deviceDescriptor, sizeof deviceDescriptor, ctrl->wLength);
+        return;
+
+    case USB_DT_CONFIG:
+        ep0Reply(configDescriptor, sizeof configDescriptor, ctrl->wLength);
+        return;
+
+    case USB_DT_STRING:
+        if (index == 0) {
+            static const unsigned char languages[] = { 4, USB_DT_STRING, 0x09, 0x04 };
+            ep0Reply(languages, sizeof languages, ctrl->wLength);
+            return;
+        }
+        if (index >= (int)(sizeof strings / sizeof strings[0]))
+            break;
+        for (cp = strings[index], n = 2 ; *cp && (n < EP0_MAX_DATA - 1) ; cp++) {
+            buf[n++] = *cp;
+            buf[n++] = 0;
+        }
+        buf[0] = n;
+        buf[1] = USB_DT_STRING;
+        ep0Reply(buf, n, ctrl->wLength);
+        return;
+
+    case HID_DT_HID:
+        ep0Reply(&configDescriptor[CONFIG_HID_OFFSET], 9, ctrl->wLength);
+        return;
+
+    case HID_DT_REPORT:
+        ep0Reply(usbMouseBootReportDescriptor, usbMouseBootReportDescriptorSize,
+                                                                ctrl->wLength);
+        return;
+    }
+    ep0Stall();
+}
+
+static void
+getReport(const struct usb_ctrlrequest *ctrl)
+{
+    gadgetReport r;
+    unsigned char buf[REPORT_SIZE];
+    int stall;
+
+    epicsMutexMustLock(gadget.lock);
+    stall = (gadget.stallCount > 0);
+    if (stall)
+        gadget.stallCount--;
+    else
+        queueDrain(&r);
+    gadget.controlCount++;
+    epicsMutexUnlock(gadget.lock);
+    if (stall) {
+        ep0Stall();
+        return;
+    }
+    packReport(&r, buf);
+    ep0Reply(buf, sizeof buf, ctrl->wLength);
+}
+
+static void
+handleControl(const struct usb_ctrlrequest *ctrl)
+{
+    static const unsigned char zeros[2], one = 1;
+    unsigned char configuration;
+
+    switch (ctrl->bRequestType & USB_TYPE_MASK) {
+    case USB_TYPE_STANDARD:
+        switch (ctrl->bRequest) {
+        case USB_REQ_GET_DESCRIPTOR:
+            getDescriptor(ctrl);
+            return;
+
+        case USB_REQ_SET_CONFIGURATION:
+            if (setConfiguration(ctrl->wValue & 0xFF) == 0)
+                ep0Ack();
+            else
+                ep0Stall();
+            return;
+
+        case USB_REQ_GET_CONFIGURATION:
+            configuration = gadget.configuration;
+            ep0Reply(&configuration, 1, ctrl->wLength);
+            return;
+
+        case USB_REQ_SET_INTERFACE:
+            ep0Ack();
+            return;
+
+        case USB_REQ_GET_INTERFACE:
+        case USB_REQ_GET_STATUS:
+            ep0Reply(zeros, ctrl->bRequest == USB_REQ_GET_STATUS ? 2 : 1,
+                                                                ctrl->wLength);
+            return;
+        }
+        break;
+
+    case USB_TYPE_CLASS:
+        switch (ctrl->bRequest) {
+        case HID_REQ_GET_REPORT:
+            getReport(ctrl);
+            return;
+
+        case HID_REQ_GET_IDLE:
+            ep0Reply(zeros, 1, ctrl->wLength);
+            return;
+
+        case HID_REQ_GET_PROTOCOL:
+            ep0Reply(&one, 1, ctrl->wLength);
+            return;
+
+        case HID_REQ_SET_IDLE:
+        case HID_REQ_SET_PROTOCOL:
+            ep0Ack();
+            return;
+        }
+        break;
+    }
+    ep0Stall();
+}
+
+/*
+ * Answer everything that arrives on the default control pipe
+ */
+static void
+ep0Thread(void *arg)
+{
+    struct {
+        struct usb_raw_event    inner;
+        struct usb_ctrlrequest  ctrl;
+    } ev;
+
+    for (;;) {
+        ev.inner.type = 0;
+        ev.inner.length = sizeof ev.ctrl;
+        if (ioctl(gadget.fd, USB_RAW_IOCTL_EVENT_FETCH, &ev) < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("usbMouseGadget: event fetch failed: %s\n", strerror(errno));
+            return;
+        }
+        switch (ev.inner.type) {
+        case USB_RAW_EVENT_CONNECT:
+            gadget.epAddress = findEndpoint();
+            if (gadget.epAddress < 0) {
+                printf("usbMouseGadget: UDC has no interrupt IN endpoint.\n");
+                return;
+            }
+            configDescriptor[CONFIG_ENDPOINT_OFFSET + 2] = gadget.epAddress;
+            break;
+
+        case USB_RAW_EVENT_CONTROL:
+            handleControl(&ev.ctrl);
+            break;
+
+        default:
+            /* Reset, suspend and friends on newer kernels */
+            break;
+        }
+    }
+}
+
+/*
+ * Hand queued reports to the interrupt IN endpoint.  A write finishes
+ * only when the host has taken the report.
+ */
+static void
+epThread(void *arg)
+{
+    struct {
+        struct usb_raw_ep_io inner;
+        unsigned char        data[REPORT_SIZE];
+    } io;
+    gadgetReport r;
+
+    for (;;) {
+        epicsMutexMustLock(gadget.lock);
+        if (!gadget.configuration) {
+            epicsMutexUnlock(gadget.lock);
+            epicsEventMustWait(gadget.configured);
+            continue;
+        }
+        if (gadget.count == 0) {
+            epicsMutexUnlock(gadget.lock);
+            epicsEventMustWait(gadget.reportReady);
+            continue;
+        }
+        r = gadget.queue[gadget.head];
+        gadget.head = (gadget.head + 1) % QUEUE_SIZE;
+        gadget.count--;
+        io.inner.ep = gadget.epHandle;
+        io.inner.flags = 0;
+        io.inner.length = REPORT_SIZE;
+        if (gadget.shortCount > 0) {
+            gadget.shortCount--;
+            io.inner.length = 2;
+        }
+        epicsMutexUnlock(gadget.lock);
+        packReport(&r, io.data);
+        if (ioctl(gadget.fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0) {
+            /*
+             * Unconfigured or disconnected -- keep the report for the next
+             * configuration unless a GET_REPORT has overtaken it
+             */
+            epicsMutexMustLock(gadget.lock);
+            if (gadget.count < QUEUE_SIZE) {
+                gadget.head = (gadget.head + QUEUE_SIZE - 1) % QUEUE_SIZE;
+                gadget.queue[gadget.head] = r;
+                gadget.count++;
+            }
+            if (gadget.configuration && (errno != EINTR))
+                gadget.configuration = 0;
+            epicsMutexUnlock(gadget.lock);
+            continue;
+        }
+        epicsMutexMustLock(gadget.lock);
+        gadget.interruptCount++;
+        epicsMutexUnlock(gadget.lock);
+    }
+}
+
+/*
+ * Create the mouse and attach it to the bus
+ */
+int
+usbMouseGadgetCreate(int idVendor, int idProduct, const char *udc)
+{
+    struct usb_raw_init init;
+    char driver[UDC_NAME_LENGTH_MAX];
+    char *cp;
+    int n;
+
+    if (gadget.fd >= 0) {
+        printf("Gadget mouse already exists.\n");
+        return -1;
+    }
+    if ((udc == NULL) || (*udc == '\0'))
+        udc = "dummy_udc.0";
+
+    /*
+     * The driver name is the device name without its instance number
+     */
+    epicsSnprintf(driver, sizeof driver, "%s", udc);
+    if ((cp = strrchr(driver, '.')) != NULL)
+        *cp = '\0';
+    if ((gadget.fd = open("/dev/raw-gadget", O_RDWR | O_CLOEXEC)) < 0) {
+        printf("Can't open /dev/raw-gadget: %s\n", strerror(errno));
+        return -1;
+    }
+    epicsSnprintf(gadget.udcDevice, sizeof gadget.udcDevice, "%s", udc);
+    gadget.idVendor = idVendor;
+    gadget.idProduct = idProduct;
+    gadget.epHandle = -1;
+    gadget.lock = epicsMutexMustCreate();
+    gadget.reportReady = epicsEventMustCreate(epicsEventEmpty);
+    gadget.configured = epicsEventMustCreate(epicsEventEmpty);
+    deviceDescriptor[8] = idVendor & 0xFF;
+    deviceDescriptor[9] = (idVendor >> 8) & 0xFF;
+    deviceDescriptor[10] = idProduct & 0xFF;
+    deviceDescriptor[11] = (idProduct >> 8) & 0xFF;
+    n = usbMouseBootReportDescriptorSize;
+    configDescriptor[CONFIG_HID_OFFSET + 7] = n & 0xFF;
+    configDescriptor[CONFIG_HID_OFFSET + 8] = (n >> 8) & 0xFF;
+
+    memset(&init, 0, sizeof init);
+    strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+    strncpy((char *)init.device_name, udc, UDC_NAME_LENGTH_MAX - 1);
+    init.speed = USB_SPEED_HIGH;
+    if ((ioctl(gadget.fd, USB_RAW_IOCTL_INIT, &init) < 0)
+     || (ioctl(gadget.fd, USB_RAW_IOCTL_RUN, 0) < 0)) {
+        printf("Can't start gadget on %s: %s\n", udc, strerror(errno));
+        close(gadget.fd);
+        gadget.fd = -1;
+        return -1;
+    }
+    if ((epicsThreadCreate("usbMouseGadget", epicsThreadPriorityHigh,
+                           epicsThreadGetStackSize(epicsThreadStackSmall),
+                           ep0Thread, NULL) == NULL)
+     || (epicsThreadCreate("usbMouseGadgetEP", epicsThreadPriorityHigh,
+                           epicsThreadGetStackSize(epicsThreadStackSmall),
+                           epThread, NULL) == NULL)) {
+        printf("Can't set up gadget threads!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Queue a report from the mouse
+ */
+int
+usbMouseGadgetInject(const unsigned char *report, int size)
+{
+    gadgetReport r;
+
+    if ((gadget.fd < 0) || (size < 3)) {
+        errno = ENODEV;
+        return -1;
+    }
+    r.buttons = report[0];
+    r.dx = (signed char)report[1];
+    r.dy = (signed char)report[2];
+    r.wheel = size > 3 ? (signed char)report[3] : 0;
+    epicsMutexMustLock(gadget.lock);
+    gadget.buttons = r.buttons;
+    if (gadget.dropCount > 0)
+        gadget.dropCount--;
+    else
+        queuePush(&r);
+    epicsMutexUnlock(gadget.lock);
+    epicsEventSignal(gadget.reportReady);
+    return 0;
+}
+
+/*
+ * Take the mouse off the bus and put it back, through the UDC's sysfs node
+ */
+static int
+softConnect(const char *how)
+{
+    char path[200];
+    int fd, ok;
+
+    epicsSnprintf(path, sizeof path, "/sys/class/udc/%s/soft_connect",
+                                                            gadget.udcDevice);
+    if ((fd = open(path, O_WRONLY)) < 0) {
+        printf("Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ok = (write(fd, how, strlen(how)) == (ssize_t)strlen(how));
+    if (!ok)
+        printf("Can't %s: %s\n", how, strerror(errno));
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static void
+usbMouseGadgetFault(const char *fault, int count)
+{
+    if (gadget.fd < 0) {
+        printf("No gadget mouse.\n");
+        return;
+    }
+    if ((fault == NULL) || (*fault == '\0')) {
+        epicsMutexMustLock(gadget.lock);
+        printf("Gadget mouse %04x:%04x on %s, %sconfigured, endpoint %#x\n",
+                    gadget.idVendor, gadget.idProduct, gadget.udcDevice,
+                    gadget.configuration ? "" : "not ", gadget.epAddress);
+        printf("  %lu interrupt transfers, %lu GET_REPORT requests, %d queued\n",
+                    gadget.interruptCount, gadget.controlCount, gadget.count);
+        printf("  pending faults: stall %d, drop %d, short %d\n",
+                    gadget.stallCount, gadget.dropCount, gadget.shortCount);
+        epicsMutexUnlock(gadget.lock);
+        return;
+    }
+    if (count <= 0)
+        count = 1;
+    if (strcmp(fault, "disconnect") == 0) {
+        if (softConnect("disconnect") == 0) {
+            epicsThreadSleep(count * 1.0e-3);
+            softConnect("connect");
+        }
+        return;
+    }
+    epicsMutexMustLock(gadget.lock);
+    if (strcmp(fault, "stall") == 0)
+        gadget.stallCount = count;
+    else if (strcmp(fault, "drop") == 0)
+        gadget.dropCount = count;
+    else if (strcmp(fault, "short") == 0)
+        gadget.shortCount = count;
+    else if (strcmp(fault, "clear") == 0)
+        gadget.stallCount = gadget.dropCount = gadget.shortCount = 0;
+    else
+        printf("Faults are stall, drop, short, disconnect or clear.\n");
+    epicsMutexUnlock(gadget.lock);
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseGadgetFaultArg0 = { "fault",iocshArgString};
+static const iocshArg usbMouseGadgetFaultArg1 = { "count or ms",iocshArgInt};
+static const iocshArg *usbMouseGadgetFaultArgs[] = {
+                    &usbMouseGadgetFaultArg0, &usbMouseGadgetFaultArg1 };
+static const iocshFuncDef usbMouseGadgetFaultFuncDef =
+      {"usbMouseGadgetFault",2,usbMouseGadgetFaultArgs};
+static void usbMouseGadgetFaultCallFunc(const iocshArgBuf *args)
+{
+    usbMouseGadgetFault(args[0].sval, args[1].ival);
+}
+
+void
+usbMouseGadget_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseGadgetFaultFuncDef,usbMouseGadgetFaultCallFunc);
+}
@@ -0,0 +1,248 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Histogram stage -- 2D occupancy map of position or velocity
+ *
+ * Every sample adds one count to the bin it falls in, a constant amount
+ * of work however many bins there are.  A thread of the stage's own
+ * sends the bins to a waveform record at a low rate.  It swaps in an
+ * empty set of bins under the lock and adds the counts taken out to its
+ * own totals after, so the pipeline never waits while the bins are
+ * copied.  Records
+ * can clear the histogram and change the region it covers, which also
+ * clears it.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+typedef struct histogramPvt {
+    drvPvt         *pdpvt;
+    epicsMutexId    lock;
+    int             useVelocity;
+    int             nx;
+    int             ny;
+    double          interval;
+    double          xMin, xMax;
+    double          yMin, yMax;
+    double          xScale;
+    double          yScale;
+    epicsInt32     *bins;           /* counts since the last swap */
+    epicsInt32     *spare;          /* empty, owned by the publish thread */
+    epicsInt32     *total;          /* owned by the publish thread */
+    epicsInt32      count;
+    epicsInt32      outside;
+    int             regionChanged;
+    int             cleared;
+} histogramPvt;
+
+/*
+ * Set the bin scale factors and clear the bins -- called with the lock held
+ */
+static void
+histogramClear(histogramPvt *pvt)
+{
+    pvt->xScale = pvt->nx / (pvt->xMax - pvt->xMin);
+    pvt->yScale = pvt->ny / (pvt->yMax - pvt->yMin);
+    memset(pvt->bins, 0, pvt->nx * pvt->ny * sizeof *pvt->bins);
+    pvt->count = 0;
+    pvt->outside = 0;
+    pvt->cleared = 1;
+}
+
+static void
+publishThread(void *arg)
+{
+    histogramPvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    epicsTimeStamp now;
+    epicsInt32 count, outside, *taken;
+    double region[4];
+    int n = pvt->nx * pvt->ny;
+    int regionChanged, cleared, i;
+    extern volatile int interruptAccept;
+
+    while (!interruptAccept)
+        epicsThreadSleep(0.1);
+    for (;;) {
+        epicsMutexMustLock(pvt->lock);
+        taken = pvt->bins;
+        pvt->bins = pvt->spare;
+        cleared = pvt->cleared;
+        pvt->cleared = 0;
+        count = pvt->count;
+        outside = pvt->outside;
+        regionChanged = pvt->regionChanged;
+        pvt->regionChanged = 0;
+        region[0] = pvt->xMin;
+        region[1] = pvt->xMax;
+        region[2] = pvt->yMin;
+        region[3] = pvt->yMax;
+        epicsMutexUnlock(pvt->lock);
+
+        if (cleared)
+            memset(pvt->total, 0, n * sizeof *pvt->total);
+        for (i = 0 ; i < n ; i++)
+            pvt->total[i] += taken[i];
+        memset(taken, 0, n * sizeof *taken);
+        pvt->spare = taken;
+
+        pdpvt->clock->now(pdpvt->clock, &now);
+        if (regionChanged) {
+            for (i = 0 ; i < 4 ; i++)
+                usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_HIST_X_MIN + i,
+                                                            region[i], &now);
+        }
+        usbMousePublishInt32Array(pdpvt, USBMOUSE_ADDR_HIST, pvt->total, n, &now);
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_HIST_COUNT, count, &now);
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_HIST_OUTSIDE, outside, &now);
+        pdpvt->clock->sleep(pdpvt->clock, pvt->interval);
+    }
+}
+
+static void *
+histogramCreate(drvPvt *pdpvt, const char *args)
+{
+    histogramPvt *pvt;
+    int nx = usbMouseArgInt(args, "nx", 64);
+    int ny = usbMouseArgInt(args, "ny", nx);
+    double rate = usbMouseArgDouble(args, "rate", 1.0);
+    double xMin = usbMouseArgDouble(args, "xmin", -1000);
+    double xMax = usbMouseArgDouble(args, "xmax", 1000);
+    double yMin = usbMouseArgDouble(args, "ymin", xMin);
+    double yMax = usbMouseArgDouble(args, "ymax", xMax);
+    char threadName[40];
+
+    if ((nx <= 0) || (ny <= 0) || (nx * ny > 1000000)) {
+        printf("histogram stage needs 1 to 1000000 bins\n");
+        return NULL;
+    }
+    if ((xMax <= xMin) || (yMax <= yMin)) {
+        printf("histogram stage region is empty\n");
+        return NULL;
+    }
+    if (rate <= 0) {
+        printf("histogram stage rate must be positive\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "histogramCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    pvt->useVelocity = usbMouseArgInt(args, "velocity", 0);
+    pvt->nx = nx;
+    pvt->ny = ny;
+    pvt->interval = 1.0 / rate;
+    pvt->xMin = xMin;
+    pvt->xMax = xMax;
+    pvt->yMin = yMin;
+    pvt->yMax = yMax;
+    pvt->bins = callocMustSucceed(nx * ny, sizeof *pvt->bins, "histogramCreate");
+    pvt->spare = callocMustSucceed(nx * ny, sizeof *pvt->spare, "histogramCreate");
+    pvt->total = callocMustSucceed(nx * ny, sizeof *pvt->total, "histogramCreate");
+    pvt->regionChanged = 1;
+    histogramClear(pvt);
+    epicsSnprintf(threadName, sizeof threadName, "%s_HISTOGRAM", pdpvt->portName);
+    if (epicsThreadCreate(threadName,
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackSmall),
+                          publishThread,
+                          pvt) == NULL) {
+        printf("Can't set up %s thread!\n", threadName);
+        return NULL;
+    }
+    return pvt;
+}
+
+static int
+histogramProcess(void *arg, usbMouseSample *sample)
+{
+    histogramPvt *pvt = arg;
+    double x, y;
+    int ix, iy;
+
+    if (pvt->useVelocity) {
+        x = sample->xVelocity;
+        y = sample->yVelocity;
+    }
+    else {
+        x = sample->values.xPosition;
+        y = sample->values.yPosition;
+    }
+    epicsMutexMustLock(pvt->lock);
+    pvt->count++;
+    if ((x >= pvt->xMin) && (x < pvt->xMax)
+     && (y >= pvt->yMin) && (y < pvt->yMax)) {
+        ix = (int)((x - pvt->xMin) * pvt->xScale);
+        iy = (int)((y - pvt->yMin) * pvt->yScale);
+        if (ix >= pvt->nx) ix = pvt->nx - 1;
+        if (iy >= pvt->ny) iy = pvt->ny - 1;
+        pvt->bins[iy * pvt->nx + ix]++;
+    }
+    else {
+        pvt->outside++;
+    }
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+static int
+histogramWrite(void *arg, int addr, double value)
+{
+    histogramPvt *pvt = arg;
+    double *limit;
+    int status = 1;
+
+    switch (addr) {
+    case USBMOUSE_ADDR_HIST_RESET:  limit = NULL;           break;
+    case USBMOUSE_ADDR_HIST_X_MIN:  limit = &pvt->xMin;     break;
+    case USBMOUSE_ADDR_HIST_X_MAX:  limit = &pvt->xMax;     break;
+    case USBMOUSE_ADDR_HIST_Y_MIN:  limit = &pvt->yMin;     break;
+    case USBMOUSE_ADDR_HIST_Y_MAX:  limit = &pvt->yMax;     break;
+    default:                        return 0;
+    }
+    epicsMutexMustLock(pvt->lock);
+    if (limit) {
+        double old = *limit;
+        *limit = value;
+        if ((pvt->xMax <= pvt->xMin) || (pvt->yMax <= pvt->yMin)) {
+            *limit = old;
+            status = -1;
+        }
+        pvt->regionChanged = 1;
+    }
+    if (status > 0)
+        histogramClear(pvt);
+    epicsMutexUnlock(pvt->lock);
+    return status;
+}
+
+static void
+histogramReport(void *arg, FILE *fp, int details)
+{
+    histogramPvt *pvt = arg;
+
+    fprintf(fp, "%s %dx%d x=[%g,%g) y=[%g,%g) rate=%g",
+                    pvt->useVelocity ? "velocity" : "position",
+                    pvt->nx, pvt->ny, pvt->xMin, pvt->xMax,
+                    pvt->yMin, pvt->yMax, 1.0 / pvt->interval);
+    if (details >= 3)
+        fprintf(fp, " %d samples, %d outside", (int)pvt->count,
+                                               (int)pvt->outside);
+}
+
+const usbMouseStageType usbMouseHistogramStage = {
+    "histogram", histogramCreate, histogramProcess, histogramReport,
+    histogramWrite
+};
@@ -0,0 +1,272 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Jog stage -- turn mouse motion into motor setpoints
+ *
+ * Motion is gathered from the pipeline and converted into setpoints on
+ * a thread of the stage's own, running at a fixed rate on the port's
+ * clock.  The setpoints go out on asynFloat64 addresses where output
+ * records with DB links pass them on to motors, so the motor records
+ * see at most one write per axis per tick no matter how fast the mouse
+ * reports.
+ *
+ * In velocity mode the setpoint is gain times the mouse speed in counts
+ * per second and is sent whenever it changes.  In position mode the
+ * setpoint is a relative move of gain times the counts, meant for a
+ * motor record RLV field.  In both modes the rate of change of the
+ * commanded velocity is limited, and mouse speeds below the deadband
+ * are ignored.  Position mode carries counts over from tick to tick so
+ * an acceleration-limited move still covers the full distance.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+#define MODE_VELOCITY   0
+#define MODE_POSITION   1
+
+typedef struct jogAxis {
+    int             addr;
+    double          pending;
+    double          velocity;
+    double          lastSent;
+} jogAxis;
+
+typedef struct jogPvt {
+    drvPvt         *pdpvt;
+    epicsMutexId    lock;
+    double          interval;
+    double          gain;
+    double          deadband;
+    double          accel;
+    int             enableButton;
+    int             modeButton;
+    int             enable;
+    int             mode;
+    int             buttons;
+    int             active;
+    int             modeChanged;
+    jogAxis         axis[2];
+    unsigned long   sendCount;
+} jogPvt;
+
+static int
+buttonDown(int buttons, int button)
+{
+    return (button >= 0) && (buttons & (1 << button));
+}
+
+/*
+ * Work out one axis for one tick and send its setpoint
+ */
+static void
+jogAxisTick(jogPvt *pvt, jogAxis *ax, double dt, const epicsTimeStamp *now)
+{
+    double target = 0, dv, limit, step;
+
+    if (pvt->active && (pvt->gain != 0)) {
+        double speed = ax->pending / dt;
+        if (fabs(speed) >= pvt->deadband)
+            target = pvt->gain * speed;
+        else
+            ax->pending = 0;
+    }
+    else {
+        ax->pending = 0;
+    }
+    dv = target - ax->velocity;
+    if (pvt->accel > 0) {
+        limit = pvt->accel * dt;
+        if (dv > limit) dv = limit;
+        if (dv < -limit) dv = -limit;
+    }
+    ax->velocity += dv;
+
+    if (pvt->mode == MODE_VELOCITY) {
+        ax->pending = 0;
+        if (ax->velocity != ax->lastSent) {
+            ax->lastSent = ax->velocity;
+            usbMousePublishFloat64(pvt->pdpvt, ax->addr, ax->velocity, now);
+            pvt->sendCount++;
+        }
+    }
+    else {
+        step = ax->velocity * dt;
+        if ((pvt->gain == 0) || (step * ax->pending <= 0)) {
+            step = 0;
+        }
+        else if (fabs(step) > fabs(pvt->gain * ax->pending)) {
+            step = pvt->gain * ax->pending;
+            ax->velocity = step / dt;
+        }
+        if (step != 0) {
+            ax->pending -= step / pvt->gain;
+            usbMousePublishFloat64(pvt->pdpvt, ax->addr, step, now);
+            pvt->sendCount++;
+        }
+    }
+}
+
+static void
+jogThread(void *arg)
+{
+    jogPvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    epicsTimeStamp now, then;
+    extern volatile int interruptAccept;
+
+    while (!interruptAccept)
+        epicsThreadSleep(0.1);
+    pdpvt->clock->now(pdpvt->clock, &then);
+    for (;;) {
+        double dt;
+        int active, i;
+
+        pdpvt->clock->sleep(pdpvt->clock, pvt->interval);
+        pdpvt->clock->now(pdpvt->clock, &now);
+        dt = epicsTimeDiffInSeconds(&now, &then);
+        if (dt <= 0)
+            continue;
+        then = now;
+        epicsMutexMustLock(pvt->lock);
+        if (pvt->modeChanged) {
+            pvt->modeChanged = 0;
+            for (i = 0 ; i < 2 ; i++) {
+                pvt->axis[i].pending = 0;
+                pvt->axis[i].velocity = 0;
+            }
+            usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_JOG_MODE, pvt->mode, &now);
+        }
+        active = pvt->enable && ((pvt->enableButton < 0)
+                                || buttonDown(pvt->buttons, pvt->enableButton));
+        if (active != pvt->active) {
+            pvt->active = active;
+            usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_JOG_ACTIVE, active, &now);
+        }
+        for (i = 0 ; i < 2 ; i++)
+            jogAxisTick(pvt, &pvt->axis[i], dt, &now);
+        epicsMutexUnlock(pvt->lock);
+    }
+}
+
+static void *
+jogCreate(drvPvt *pdpvt, const char *args)
+{
+    jogPvt *pvt;
+    double rate = usbMouseArgDouble(args, "rate", 20.0);
+    char threadName[40];
+
+    if ((rate <= 0) || (rate > 1000)) {
+        printf("jog stage rate must be in (0,1000]\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "jogCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    pvt->interval = 1.0 / rate;
+    pvt->gain = usbMouseArgDouble(args, "gain", 1.0);
+    pvt->deadband = fabs(usbMouseArgDouble(args, "deadband", 0.0));
+    pvt->accel = usbMouseArgDouble(args, "accel", 0.0);
+    pvt->enableButton = usbMouseArgInt(args, "enable", -1);
+    pvt->modeButton = usbMouseArgInt(args, "select", -1);
+    pvt->mode = usbMouseArgInt(args, "mode", MODE_VELOCITY) ? MODE_POSITION
+                                                            : MODE_VELOCITY;
+    pvt->enable = 1;
+    pvt->modeChanged = 1;
+    pvt->active = -1;
+    pvt->axis[0].addr = USBMOUSE_ADDR_JOG_X;
+    pvt->axis[1].addr = USBMOUSE_ADDR_JOG_Y;
+    epicsSnprintf(threadName, sizeof threadName, "%s_JOG", pdpvt->portName);
+    if (epicsThreadCreate(threadName,
+                          pdpvt->priority,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          jogThread,
+                          pvt) == NULL) {
+        printf("Can't set up %s thread!\n", threadName);
+        return NULL;
+    }
+    return pvt;
+}
+
+static int
+jogProcess(void *arg, usbMouseSample *sample)
+{
+    jogPvt *pvt = arg;
+    int pressed;
+
+    epicsMutexMustLock(pvt->lock);
+    pressed = sample->values.buttons & ~pvt->buttons;
+    if (buttonDown(pressed, pvt->modeButton)) {
+        pvt->mode = !pvt->mode;
+        pvt->modeChanged = 1;
+    }
+    pvt->buttons = sample->values.buttons;
+    pvt->axis[0].pending += sample->dx;
+    pvt->axis[1].pending += sample->dy;
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+static int
+jogWrite(void *arg, int addr, double value)
+{
+    jogPvt *pvt = arg;
+    int status = 1;
+
+    epicsMutexMustLock(pvt->lock);
+    switch (addr) {
+    case USBMOUSE_ADDR_JOG_ENABLE:
+        pvt->enable = (value != 0);
+        break;
+
+    case USBMOUSE_ADDR_JOG_MODE:
+        if ((value != MODE_VELOCITY) && (value != MODE_POSITION)) {
+            status = -1;
+            break;
+        }
+        if ((int)value != pvt->mode) {
+            pvt->mode = (int)value;
+            pvt->modeChanged = 1;
+        }
+        break;
+
+    case USBMOUSE_ADDR_JOG_GAIN:
+        pvt->gain = value;
+        break;
+
+    default:
+        status = 0;
+        break;
+    }
+    epicsMutexUnlock(pvt->lock);
+    return status;
+}
+
+static void
+jogReport(void *arg, FILE *fp, int details)
+{
+    jogPvt *pvt = arg;
+
+    fprintf(fp, "rate=%g gain=%g deadband=%g accel=%g %s %s",
+                    1.0 / pvt->interval, pvt->gain, pvt->deadband, pvt->accel,
+                    pvt->mode == MODE_POSITION ? "position" : "velocity",
+                    pvt->active > 0 ? "active" : "idle");
+    if (details >= 3)
+        fprintf(fp, " %lu setpoints sent", pvt->sendCount);
+}
+
+const usbMouseStageType usbMouseJogStage = {
+    "jog", jogCreate, jogProcess, jogReport, jogWrite
+};
@@ -0,0 +1,345 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Latch stage -- the position at the time of an external event
+ *
+ * The stage keeps a short history of the samples passing through it.
+ * An event, such as a camera frame or a timing system event, is given
+ * to the stage by writing to one of its addresses, either the number of
+ * a timing event whose time is to be looked up or the time itself.  The
+ * X, Y and wheel positions at that time are interpolated from the
+ * samples either side of it and sent with the event's time as their
+ * timestamp, so the positions line up with the event exactly without
+ * the records following the mouse at the full report rate.
+ *
+ * A mouse sends a report only when it moves, so the motion in a report
+ * is taken to have happened during the span before it, not all the way
+ * back to the report before.  An event later than the newest sample
+ * waits for the next one, which may be on its way, for the wait time
+ * on the port's clock, checked every half wait; if none comes the mouse
+ * hasn't moved and the newest position holds.  Events older than the history are counted as missed and get
+ * the oldest position kept.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+#define LATCH_PENDING   16
+
+typedef struct latchEntry {
+    epicsTimeStamp  time;
+    int             buttons;
+    int             position[3];
+} latchEntry;
+
+typedef struct latchEvent {
+    epicsTimeStamp  time;
+    epicsTimeStamp  deadline;
+} latchEvent;
+
+typedef struct latchPvt {
+    drvPvt         *pdpvt;
+    epicsMutexId    lock;
+    double          span;
+    double          wait;
+
+    /*
+     * History, a ring of the last depth samples with head the next
+     * slot to fill
+     */
+    latchEntry     *history;
+    int             depth;
+    int             head;
+    int             count;
+
+    latchEvent      pending[LATCH_PENDING];
+    int             nPending;
+
+    unsigned long   latched;
+    unsigned long   missed;
+    unsigned long   held;
+    unsigned long   publishedMissed;
+} latchPvt;
+
+static latchEntry *
+latchEntryAt(latchPvt *pvt, int age)
+{
+    int i = pvt->head - 1 - age;
+
+    if (i < 0)
+        i += pvt->depth;
+    return &pvt->history[i];
+}
+
+/*
+ * Work out the position at an event's time and send it
+ */
+static void
+latchResolve(latchPvt *pvt, const epicsTimeStamp *time)
+{
+    drvPvt *pdpvt = pvt->pdpvt;
+    latchEntry *before = NULL, *after = NULL;
+    double position[3];
+    int age, i;
+
+    if (pvt->count == 0) {
+        pvt->missed++;
+    }
+    else {
+        for (age = 0 ; age < pvt->count ; age++) {
+            latchEntry *e = latchEntryAt(pvt, age);
+            if (epicsTimeDiffInSeconds(time, &e->time) >= 0) {
+                before = e;
+                break;
+            }
+            after = e;
+        }
+        if (before == NULL) {
+            before = after;
+            after = NULL;
+            pvt->missed++;
+        }
+        else if (after == NULL) {
+            pvt->held++;
+        }
+        for (i = 0 ; i < 3 ; i++)
+            position[i] = before->position[i];
+        if (after) {
+            double gap = epicsTimeDiffInSeconds(&after->time, &before->time);
+            double into = epicsTimeDiffInSeconds(time, &before->time);
+            double moving = gap < pvt->span ? gap : pvt->span;
+
+            into -= gap - moving;
+            if ((into > 0) && (moving > 0)) {
+                for (i = 0 ; i < 3 ; i++)
+                    position[i] += (after->position[i] - before->position[i])
+                                                            * into / moving;
+            }
+        }
+        usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_LATCH_X, position[0], time);
+        usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_LATCH_Y, position[1], time);
+        usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_LATCH_WHEEL, position[2], time);
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_LATCH_BUTTONS,
+                                                    before->buttons, time);
+        pvt->latched++;
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_LATCH_COUNT,
+                                                    pvt->latched, time);
+    }
+    if (pvt->missed != pvt->publishedMissed) {
+        pvt->publishedMissed = pvt->missed;
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_LATCH_MISSED,
+                                                    pvt->missed, time);
+    }
+}
+
+static void
+latchRemove(latchPvt *pvt, int i)
+{
+    pvt->nPending--;
+    memmove(&pvt->pending[i], &pvt->pending[i+1],
+                                (pvt->nPending - i) * sizeof pvt->pending[0]);
+}
+
+/*
+ * Settle the events whose wait is over
+ */
+static void
+latchExpire(latchPvt *pvt, const epicsTimeStamp *now)
+{
+    int i = 0;
+
+    while (i < pvt->nPending) {
+        latchEvent *ev = &pvt->pending[i];
+        if (epicsTimeDiffInSeconds(&ev->deadline, now) <= 0) {
+            latchResolve(pvt, &ev->time);
+            latchRemove(pvt, i);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+static void
+latchThread(void *arg)
+{
+    latchPvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    epicsTimeStamp now;
+
+    for (;;) {
+        pdpvt->clock->sleep(pdpvt->clock, pvt->wait / 2);
+        pdpvt->clock->now(pdpvt->clock, &now);
+        epicsMutexMustLock(pvt->lock);
+        latchExpire(pvt, &now);
+        epicsMutexUnlock(pvt->lock);
+    }
+}
+
+/*
+ * Latch now if the history already reaches the event or there's no
+ * waiting, otherwise wait
+ */
+static int
+latchTrigger(latchPvt *pvt, const epicsTimeStamp *time)
+{
+    drvPvt *pdpvt = pvt->pdpvt;
+    int status = 1;
+
+    epicsMutexMustLock(pvt->lock);
+    if ((pvt->wait <= 0)
+     || ((pvt->count > 0)
+      && (epicsTimeDiffInSeconds(time, &latchEntryAt(pvt, 0)->time) <= 0))) {
+        latchResolve(pvt, time);
+    }
+    else if (pvt->nPending >= LATCH_PENDING) {
+        pvt->missed++;
+        status = -1;
+    }
+    else {
+        latchEvent *ev = &pvt->pending[pvt->nPending++];
+        ev->time = *time;
+        pdpvt->clock->now(pdpvt->clock, &ev->deadline);
+        epicsTimeAddSeconds(&ev->deadline, pvt->wait);
+    }
+    epicsMutexUnlock(pvt->lock);
+    return status;
+}
+
+static void *
+latchCreate(drvPvt *pdpvt, const char *args)
+{
+    latchPvt *pvt;
+    int depth = usbMouseArgInt(args, "depth", 256);
+    double span = usbMouseArgDouble(args, "span", 0.01);
+    double wait = usbMouseArgDouble(args, "wait", 0.02);
+    char threadName[40];
+
+    if ((depth < 2) || (depth > 100000)) {
+        printf("latch stage depth must be in [2,100000]\n");
+        return NULL;
+    }
+    if ((span < 0) || (wait < 0)) {
+        printf("latch stage span and wait can't be negative\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "latchCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    pvt->depth = depth;
+    pvt->span = span;
+    pvt->wait = wait;
+    pvt->history = callocMustSucceed(depth, sizeof *pvt->history, "latchCreate");
+    if (wait <= 0)
+        return pvt;
+    epicsSnprintf(threadName, sizeof threadName, "%s_LATCH", pdpvt->portName);
+    if (epicsThreadCreate(threadName,
+                          pdpvt->priority,
+                          epicsThreadGetStackSize(epicsThreadStackSmall),
+                          latchThread,
+                          pvt) == NULL) {
+        printf("Can't set up %s thread!\n", threadName);
+        return NULL;
+    }
+    return pvt;
+}
+
+static int
+latchProcess(void *arg, usbMouseSample *sample)
+{
+    latchPvt *pvt = arg;
+    latchEntry *e;
+    int i = 0;
+
+    epicsMutexMustLock(pvt->lock);
+    e = &pvt->history[pvt->head];
+    e->time = sample->time;
+    e->buttons = sample->values.buttons;
+    e->position[0] = sample->values.xPosition;
+    e->position[1] = sample->values.yPosition;
+    e->position[2] = sample->values.wheel;
+    if (++pvt->head == pvt->depth)
+        pvt->head = 0;
+    if (pvt->count < pvt->depth)
+        pvt->count++;
+
+    /*
+     * Settle the events this sample reaches
+     */
+    while (i < pvt->nPending) {
+        latchEvent *ev = &pvt->pending[i];
+        if (epicsTimeDiffInSeconds(&ev->time, &sample->time) <= 0) {
+            latchResolve(pvt, &ev->time);
+            latchRemove(pvt, i);
+        }
+        else {
+            i++;
+        }
+    }
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+/*
+ * Writing a timing event number to the latch address latches at the
+ * time of that event, or at the port's time for 0.  Writing seconds
+ * past the EPICS epoch to the next address latches at that time.
+ */
+static int
+latchWrite(void *arg, int addr, double value)
+{
+    latchPvt *pvt = arg;
+    epicsTimeStamp time;
+
+    switch (addr) {
+    case USBMOUSE_ADDR_LATCH:
+        if (value == 0)
+            pvt->pdpvt->clock->now(pvt->pdpvt->clock, &time);
+        else if (epicsTimeGetEvent(&time, (int)value) != 0)
+            return -1;
+        break;
+
+    case USBMOUSE_ADDR_LATCH_AT:
+        if (value < 0)
+            return -1;
+        time.secPastEpoch = (epicsUInt32)value;
+        time.nsec = (epicsUInt32)((value - floor(value)) * 1e9);
+        if (time.nsec >= 1000000000)
+            time.nsec = 999999999;
+        break;
+
+    default:
+        return 0;
+    }
+    return latchTrigger(pvt, &time);
+}
+
+static void
+latchReport(void *arg, FILE *fp, int details)
+{
+    latchPvt *pvt = arg;
+
+    epicsMutexMustLock(pvt->lock);
+    fprintf(fp, "depth=%d span=%g wait=%g", pvt->depth, pvt->span, pvt->wait);
+    if (details >= 3)
+        fprintf(fp, " %lu latched, %lu held, %lu missed, %d waiting",
+                            pvt->latched, pvt->held, pvt->missed, pvt->nPending);
+    epicsMutexUnlock(pvt->lock);
+}
+
+const usbMouseStageType usbMouseLatchStage = {
+    "latch", latchCreate, latchProcess, latchReport, latchWrite
+};
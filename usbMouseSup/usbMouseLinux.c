@@ -0,0 +1,349 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Linux hidraw and evdev transports
+ *
+ * These read from the kernel's HID and input drivers rather than
+ * claiming the interface through libusb, so the kernel driver stays
+ * attached and reports are queued by the kernel between reads.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <epicsStdio.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+/*
+ * Highest device node number to look at
+ */
+#define MAX_NODES 64
+
+/*
+ * Check that a 'physical path' like usb-0000:00:14.0-1/input0 refers
+ * to the configured interface.  Paths without an interface suffix match.
+ */
+static int
+physMatches(drvPvt *pdpvt, const char *phys)
+{
+    const char *cp = strrchr(phys, '/');
+
+    if ((cp == NULL) || (strncmp(cp, "/input", 6) != 0))
+        return 1;
+    return atoi(cp + 6) == pdpvt->idNumber;
+}
+
+static void
+connected(drvPvt *pdpvt, int fd, const char *node, const char *name)
+{
+    pdpvt->fd = fd;
+    usbMouseReplaceString(&pdpvt->deviceNode, node);
+    usbMouseReplaceString(&pdpvt->manufacturerString, "???");
+    usbMouseReplaceString(&pdpvt->productString, name);
+    usbMouseReplaceString(&pdpvt->serialNumberString, "???");
+    pdpvt->transferDone = 0;
+    pdpvt->isConnected = 1;
+}
+
+static void
+fdDisconnect(drvPvt *pdpvt)
+{
+    close(pdpvt->fd);
+    pdpvt->fd = -1;
+}
+
+static int
+fdRead(drvPvt *pdpvt, void *buf, size_t size, const char *what)
+{
+    ssize_t n;
+
+    /*
+     * A reader thread of the port's own waits no longer than the resync
+     * interval, so resyncs happen while the mouse is idle too
+     */
+    if ((pdpvt->resyncInterval > 0) && (pdpvt->loop == NULL)) {
+        struct pollfd pfd;
+        pfd.fd = pdpvt->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, (int)(pdpvt->resyncInterval * 1000)) == 0)
+            return 0;
+    }
+    n = read(pdpvt->fd, buf, size);
+
+    if (n < 0) {
+        if ((errno == EINTR) || (errno == EAGAIN))
+            return 0;
+        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                                "%s read failed: %s\n", what, strerror(errno));
+        return -1;
+    }
+    return (int)n;
+}
+
+/*
+ *****************************************************
+ * hidraw -- raw reports from the kernel HID driver  *
+ *****************************************************
+ */
+static void
+hidrawDescriptor(drvPvt *pdpvt, int fd)
+{
+    struct hidraw_report_descriptor rd;
+    int size;
+
+    free(pdpvt->HIDreport);
+    pdpvt->HIDreport = NULL;
+    pdpvt->HIDreportLength = 0;
+    if ((ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0)
+     || (size <= 0) || (size > HID_MAX_DESCRIPTOR_SIZE))
+        return;
+    rd.size = size;
+    if (ioctl(fd, HIDIOCGRDESC, &rd) < 0)
+        return;
+    pdpvt->HIDreport = callocMustSucceed(size, 1, "hidrawDescriptor");
+    memcpy(pdpvt->HIDreport, rd.value, size);
+    pdpvt->HIDreportLength = size;
+    pdpvt->usesReportIds = usbMouseUsesReportIds(pdpvt->HIDreport, size);
+}
+
+static asynStatus
+hidrawConnect(drvPvt *pdpvt)
+{
+    int i;
+
+    for (i = 0 ; i < MAX_NODES ; i++) {
+        char node[40], phys[256], name[256];
+        struct hidraw_devinfo info;
+        int fd;
+
+        epicsSnprintf(node, sizeof node, "/dev/hidraw%d", i);
+        if ((fd = open(node, O_RDWR)) < 0)
+            continue;
+        if ((ioctl(fd, HIDIOCGRAWINFO, &info) == 0)
+         && ((info.vendor & 0xFFFF) == pdpvt->idVendor)
+         && ((info.product & 0xFFFF) == pdpvt->idProduct)
+         && ((ioctl(fd, HIDIOCGRAWPHYS(sizeof phys), phys) < 0)
+                                            || physMatches(pdpvt, phys))) {
+            if (ioctl(fd, HIDIOCGRAWNAME(sizeof name), name) < 0)
+                strcpy(name, "???");
+            hidrawDescriptor(pdpvt, fd);
+            connected(pdpvt, fd, node, name);
+            return asynSuccess;
+        }
+        close(fd);
+    }
+    asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+        "Can't find hidraw device with vendor ID:%4.4X and product ID:%4.4X.\n",
+                                         pdpvt->idVendor,  pdpvt->idProduct);
+    return asynError;
+}
+
+static int
+hidrawRead(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    return fdRead(pdpvt, buf, size, "hidraw");
+}
+
+/*
+ * Current input report -- needs HIDIOCGINPUT, from Linux 5.11.  The
+ * report number goes in the first byte; the kernel leaves it there
+ * even for devices that don't number their reports, so drop it then.
+ */
+static int
+hidrawResync(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+#ifdef HIDIOCGINPUT
+    int n;
+
+    buf[0] = pdpvt->usesReportIds ? pdpvt->sample.report[0] : 0;
+    n = ioctl(pdpvt->fd, HIDIOCGINPUT(size), buf);
+    if (n <= 0)
+        return -1;
+    if (!pdpvt->usesReportIds) {
+        memmove(buf, buf + 1, n - 1);
+        n--;
+    }
+    return n;
+#else
+    return -1;
+#endif
+}
+
+const usbMouseTransport usbMouseHidrawTransport = {
+    "hidraw", 0, hidrawConnect, hidrawRead, fdDisconnect, usbMouseDecodeBoot, 1,
+    hidrawResync
+};
+
+/*
+ *****************************************************
+ * evdev -- events from the kernel input driver      *
+ *****************************************************
+ */
+typedef struct evdevPvt {
+    struct input_event  events[64];
+    int                 nEvents;
+    int                 nextEvent;
+    int                 dropped;
+    int                 buttons;
+    int                 dx;
+    int                 dy;
+    int                 dWheel;
+} evdevPvt;
+
+#define TEST_BIT(bits, bit) \
+    ((bits)[(bit) / (8 * sizeof (bits)[0])] & (1UL << ((bit) % (8 * sizeof (bits)[0]))))
+
+static asynStatus
+evdevConnect(drvPvt *pdpvt)
+{
+    evdevPvt *pvt = pdpvt->transportPvt;
+    int i;
+
+    if (pvt == NULL)
+        pdpvt->transportPvt = pvt = callocMustSucceed(1, sizeof *pvt, "evdevConnect");
+    for (i = 0 ; i < MAX_NODES ; i++) {
+        char node[40], phys[256], name[256];
+        unsigned long evBits[(EV_MAX + 8 * sizeof(long)) / (8 * sizeof(long))];
+        unsigned long keyBits[(KEY_MAX + 8 * sizeof(long)) / (8 * sizeof(long))];
+        struct input_id id;
+        int fd, b;
+
+        epicsSnprintf(node, sizeof node, "/dev/input/event%d", i);
+        if ((fd = open(node, O_RDONLY)) < 0)
+            continue;
+        memset(evBits, 0, sizeof evBits);
+        if ((ioctl(fd, EVIOCGID, &id) == 0)
+         && (id.vendor == pdpvt->idVendor)
+         && (id.product == pdpvt->idProduct)
+         && (ioctl(fd, EVIOCGBIT(0, sizeof evBits), evBits) >= 0)
+         && TEST_BIT(evBits, EV_REL)
+         && ((ioctl(fd, EVIOCGPHYS(sizeof phys), phys) < 0)
+                                            || physMatches(pdpvt, phys))) {
+            if (ioctl(fd, EVIOCGNAME(sizeof name), name) < 0)
+                strcpy(name, "???");
+            memset(pvt, 0, sizeof *pvt);
+            memset(keyBits, 0, sizeof keyBits);
+            if (ioctl(fd, EVIOCGKEY(sizeof keyBits), keyBits) >= 0) {
+                for (b = 0 ; b < 8 ; b++) {
+                    if (TEST_BIT(keyBits, BTN_MOUSE + b))
+                        pvt->buttons |= 1 << b;
+                }
+            }
+            connected(pdpvt, fd, node, name);
+            return asynSuccess;
+        }
+        close(fd);
+    }
+    asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+        "Can't find evdev device with vendor ID:%4.4X and product ID:%4.4X.\n",
+                                         pdpvt->idVendor,  pdpvt->idProduct);
+    return asynError;
+}
+
+/*
+ * Gather events up to the next SYN_REPORT into one report
+ */
+static int
+evdevRead(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    evdevPvt *pvt = pdpvt->transportPvt;
+    int s;
+
+    if (size < USBMOUSE_EVENT_REPORT_SIZE)
+        return -1;
+    for (;;) {
+        struct input_event *ev;
+
+        if (pvt->nextEvent >= pvt->nEvents) {
+            int n = fdRead(pdpvt, pvt->events, sizeof pvt->events, "evdev");
+            if (n <= 0)
+                return n;
+            pvt->nEvents = n / sizeof pvt->events[0];
+            pvt->nextEvent = 0;
+            continue;
+        }
+        ev = &pvt->events[pvt->nextEvent++];
+        switch (ev->type) {
+        case EV_REL:
+            switch (ev->code) {
+            case REL_X:     pvt->dx += ev->value;       break;
+            case REL_Y:     pvt->dy += ev->value;       break;
+            case REL_WHEEL: pvt->dWheel += ev->value;   break;
+            }
+            break;
+
+        case EV_KEY:
+            if ((ev->code >= BTN_MOUSE) && (ev->code < BTN_MOUSE + 8)) {
+                int bit = 1 << (ev->code - BTN_MOUSE);
+                if (ev->value)
+                    pvt->buttons |= bit;
+                else
+                    pvt->buttons &= ~bit;
+            }
+            break;
+
+        case EV_SYN:
+            /*
+             * After an overrun the kernel drops events up to the
+             * next SYN_REPORT, so the motion gathered so far is suspect.
+             */
+            if (ev->code == SYN_DROPPED) {
+                pvt->dropped = 1;
+            }
+            else if (ev->code == SYN_REPORT) {
+                if (pvt->dropped) {
+                    pvt->dropped = 0;
+                    pvt->dx = pvt->dy = pvt->dWheel = 0;
+                    break;
+                }
+                s = usbMouseEncodeEvents(buf, pvt->buttons, pvt->dx, pvt->dy,
+                                                                pvt->dWheel);
+                pvt->dx = pvt->dy = pvt->dWheel = 0;
+                return s;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Current button levels as a report with no motion.  The levels
+ * replace those gathered from events, which catch up from here.
+ */
+static int
+evdevResync(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    evdevPvt *pvt = pdpvt->transportPvt;
+    unsigned long keyBits[(KEY_MAX + 8 * sizeof(long)) / (8 * sizeof(long))];
+    int b, buttons = 0;
+
+    if (size < USBMOUSE_EVENT_REPORT_SIZE)
+        return -1;
+    memset(keyBits, 0, sizeof keyBits);
+    if (ioctl(pdpvt->fd, EVIOCGKEY(sizeof keyBits), keyBits) < 0)
+        return -1;
+    for (b = 0 ; b < 8 ; b++) {
+        if (TEST_BIT(keyBits, BTN_MOUSE + b))
+            buttons |= 1 << b;
+    }
+    pvt->buttons = buttons;
+    return usbMouseEncodeEvents(buf, buttons, 0, 0, 0);
+}
+
+const usbMouseTransport usbMouseEvdevTransport = {
+    "evdev", 0, evdevConnect, evdevRead, fdDisconnect, usbMouseDecodeEvents, 1,
+    evdevResync
+};
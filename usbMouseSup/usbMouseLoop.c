@@ -0,0 +1,582 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Event loop pool
+ *
+ * Ports whose transport reads from a file descriptor can share a small
+ * pool of threads, each waiting in poll() on the ports assigned to it,
+ * rather than having a reader thread apiece.  The CPU time spent on
+ * each port is measured and every so often the ports are reassigned so
+ * that busy ports are spread across the threads.
+ *
+ * A port is handed from one thread to another only by the thread that
+ * owns it, between calls to poll(), so it is never read by two threads
+ * at once.  Reports arriving during the hand-off wait in the kernel's
+ * queue for the new owner.
+ *
+ * In busy-poll mode a thread that has just handled a report keeps
+ * checking its ports with a zero-timeout poll() for a spin time before
+ * parking in a blocking one, so a report arriving while it spins is
+ * read with no wakeup at all.  The threads can be pinned to CPUs set
+ * aside for them.
+ *
+ * Samples that reach inline publish stages during one wakeup are
+ * dispatched together at the end of it, port by port.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <epicsExport.h>
+#include <errlog.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+
+#include "usbMousePvt.h"
+
+/*
+ * Don't bother moving ports unless it cuts the busiest thread's load
+ * by at least this fraction
+ */
+#define REBALANCE_GAIN  0.1
+
+#define RECONNECT_INTERVAL 10.0
+
+typedef struct usbMouseLoop {
+    int             index;
+    int             wakeFd[2];
+    double          load;
+    int             nPorts;
+
+    /*
+     * Busy-poll statistics, written by the loop thread.  Spin time,
+     * in ns, is time spent polling without finding a report.
+     */
+    epicsUInt64     spinTime;
+    epicsUInt64     spinTimeLast;
+    double          spinLoad;
+    unsigned long   spinWakes;
+    unsigned long   parkWakes;
+    unsigned long   parks;
+
+    /*
+     * Batched dispatch statistics
+     */
+    unsigned long   batches;
+    unsigned long   batchSamples;
+    unsigned long   batchPorts;
+} usbMouseLoop;
+
+typedef struct loopPool {
+    epicsMutexId    lock;
+    usbMouseLoop   *loops;
+    int             nLoops;
+    double          rebalancePeriod;
+    drvPvt        **ports;
+    int             nPorts;
+    int             maxPorts;
+    unsigned long   moveCount;
+
+    /*
+     * Busy poll -- spin time in seconds, 0 to always block and negative
+     * to never park, and the CPU for thread 0, 0 to leave them unpinned
+     */
+    volatile double spin;
+    volatile int    cpu;
+    volatile int    cpuGeneration;
+} loopPool;
+
+static loopPool *pool;
+
+static double
+monotonicSeconds(void)
+{
+    return epicsMonotonicGet() * 1.0e-9;
+}
+
+static epicsUInt64
+threadCpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (epicsUInt64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+wake(usbMouseLoop *loop)
+{
+    char c = 0;
+
+    if (write(loop->wakeFd[1], &c, 1) < 0) {
+        /* Pipe full means a wakeup is already pending */
+    }
+}
+
+/*
+ * Pin the calling loop thread to its CPU, or free it
+ */
+static void
+setAffinity(usbMouseLoop *loop, int cpu)
+{
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    if (cpu > 0) {
+        CPU_SET(cpu + loop->index, &set);
+    }
+    else {
+        for (i = 0 ; i < CPU_SETSIZE ; i++)
+            CPU_SET(i, &set);
+    }
+    if (sched_setaffinity(0, sizeof set, &set) != 0)
+        errlogPrintf("usbMouseLoop%d: can't set CPU affinity: %s\n",
+                                            loop->index, strerror(errno));
+}
+
+static void
+setNonBlocking(drvPvt *pdpvt)
+{
+    if (pdpvt->fd >= 0)
+        fcntl(pdpvt->fd, F_SETFL, fcntl(pdpvt->fd, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Read everything the kernel has queued for a port
+ */
+static void
+serviceFd(drvPvt *pdpvt)
+{
+    int s;
+
+    for (;;) {
+        s = pdpvt->transport->read(pdpvt, pdpvt->cbuf, sizeof pdpvt->cbuf);
+        if (s < 0) {
+            pdpvt->transport->disconnect(pdpvt);
+            pdpvt->isConnected = 0;
+            pdpvt->loopLastConnect = monotonicSeconds();
+            return;
+        }
+        if (s == 0)
+            return;
+        usbMouseHandleReport(pdpvt, s);
+    }
+}
+
+static void
+loopThread(void *arg)
+{
+    usbMouseLoop *loop = arg;
+    drvPvt **active = NULL;
+    struct pollfd *fds = NULL;
+    usbMouseBatch batch;
+    int maxActive = 0, cpuGeneration = 0, parked = 0;
+    double lastReport = 0;
+
+    for (;;) {
+        int i, n = 0, nfds = 1, timeout = 1000, ready;
+        double spin;
+        epicsUInt64 pollStart;
+        char junk[64];
+
+        if (cpuGeneration != pool->cpuGeneration) {
+            cpuGeneration = pool->cpuGeneration;
+            setAffinity(loop, pool->cpu);
+        }
+
+        /*
+         * Hand off ports that are to move, and pick up ones handed to us
+         */
+        epicsMutexMustLock(pool->lock);
+        if (maxActive < pool->nPorts) {
+            maxActive = pool->maxPorts;
+            active = realloc(active, maxActive * sizeof *active);
+            fds = realloc(fds, (maxActive + 1) * sizeof *fds);
+            if ((active == NULL) || (fds == NULL))
+                cantProceed("loopThread");
+        }
+        for (i = 0 ; i < pool->nPorts ; i++) {
+            drvPvt *pdpvt = pool->ports[i];
+            if (pdpvt->loop != loop)
+                continue;
+            if (pdpvt->loopNext != loop) {
+                pdpvt->loop = pdpvt->loopNext;
+                wake(pdpvt->loop);
+                pool->moveCount++;
+                continue;
+            }
+            active[n++] = pdpvt;
+        }
+        epicsMutexUnlock(pool->lock);
+
+        fds[0].fd = loop->wakeFd[0];
+        fds[0].events = POLLIN;
+        for (i = 0 ; i < n ; i++) {
+            fds[nfds].fd = active[i]->isConnected ? active[i]->fd : -1;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+
+        /*
+         * Spin for a while after the last report, then park
+         */
+        spin = pool->spin;
+        if ((spin < 0)
+         || ((spin > 0) && (monotonicSeconds() - lastReport < spin))) {
+            timeout = 0;
+            parked = 0;
+        }
+        else if ((spin > 0) && !parked) {
+            parked = 1;
+            loop->parks++;
+        }
+        pollStart = epicsMonotonicGet();
+        ready = poll(fds, nfds, timeout);
+        if (ready < 0) {
+            if (errno != EINTR)
+                epicsThreadSleep(0.1);
+            continue;
+        }
+        if (fds[0].revents) {
+            ready--;
+            while (read(loop->wakeFd[0], junk, sizeof junk) == sizeof junk)
+                continue;
+        }
+        if (ready > 0) {
+            lastReport = monotonicSeconds();
+            if (timeout == 0)
+                loop->spinWakes++;
+            else
+                loop->parkWakes++;
+        }
+        else if (timeout == 0) {
+            loop->spinTime += epicsMonotonicGet() - pollStart;
+        }
+        usbMouseBatchBegin(&batch);
+        for (i = 0 ; i < n ; i++) {
+            drvPvt *pdpvt = active[i];
+            epicsUInt64 start = threadCpu();
+            if (!pdpvt->isConnected) {
+                double now = monotonicSeconds();
+                if (now - pdpvt->loopLastConnect < RECONNECT_INTERVAL)
+                    continue;
+                pdpvt->loopLastConnect = now;
+                if (pdpvt->transport->connect(pdpvt) == asynSuccess)
+                    setNonBlocking(pdpvt);
+            }
+            else {
+                if (fds[i+1].revents)
+                    serviceFd(pdpvt);
+                if (pdpvt->isConnected)
+                    usbMouseResyncCheck(pdpvt);
+            }
+            pdpvt->loopCpu += threadCpu() - start;
+        }
+        usbMouseBatchEnd(&batch);
+        if (batch.nSamples) {
+            loop->batches++;
+            loop->batchSamples += batch.nSamples;
+            loop->batchPorts += batch.nPorts;
+        }
+    }
+}
+
+static int
+compareLoad(const void *a, const void *b)
+{
+    double la = (*(drvPvt *const *)a)->loopLoad;
+    double lb = (*(drvPvt *const *)b)->loopLoad;
+
+    return (la < lb) - (la > lb);
+}
+
+/*
+ * Measure the ports and, if it helps enough, reassign them by placing
+ * the busiest first, each on the least loaded thread
+ */
+static void
+rebalance(double period)
+{
+    drvPvt **sorted;
+    double *load, oldMax = 0, newMax = 0;
+    int i, j, n;
+
+    epicsMutexMustLock(pool->lock);
+    n = pool->nPorts;
+    sorted = callocMustSucceed(n + 1, sizeof *sorted, "rebalance");
+    load = callocMustSucceed(pool->nLoops, sizeof *load, "rebalance");
+    for (i = 0 ; i < pool->nLoops ; i++)
+        pool->loops[i].load = 0;
+    for (i = 0 ; i < n ; i++) {
+        drvPvt *pdpvt = pool->ports[i];
+        epicsUInt64 cpu = pdpvt->loopCpu;
+        pdpvt->loopLoad = (cpu - pdpvt->loopCpuLast) * 1.0e-9 / period;
+        pdpvt->loopCpuLast = cpu;
+        pdpvt->loopNext->load += pdpvt->loopLoad;
+        sorted[i] = pdpvt;
+    }
+    for (i = 0 ; i < pool->nLoops ; i++) {
+        usbMouseLoop *loop = &pool->loops[i];
+        epicsUInt64 spinTime = loop->spinTime;
+        loop->spinLoad = (spinTime - loop->spinTimeLast) * 1.0e-9 / period;
+        loop->spinTimeLast = spinTime;
+    }
+    for (i = 0 ; i < pool->nLoops ; i++)
+        if (pool->loops[i].load > oldMax)
+            oldMax = pool->loops[i].load;
+    qsort(sorted, n, sizeof *sorted, compareLoad);
+    for (i = 0 ; i < n ; i++) {
+        int best = 0;
+        for (j = 1 ; j < pool->nLoops ; j++)
+            if (load[j] < load[best])
+                best = j;
+        load[best] += sorted[i]->loopLoad;
+        if (load[best] > newMax)
+            newMax = load[best];
+    }
+    if (newMax < oldMax * (1.0 - REBALANCE_GAIN)) {
+        for (j = 0 ; j < pool->nLoops ; j++) {
+            load[j] = 0;
+            pool->loops[j].load = 0;
+            pool->loops[j].nPorts = 0;
+        }
+        for (i = 0 ; i < n ; i++) {
+            drvPvt *pdpvt = sorted[i];
+            int best = 0;
+            for (j = 1 ; j < pool->nLoops ; j++)
+                if (load[j] < load[best])
+                    best = j;
+            load[best] += pdpvt->loopLoad;
+            pool->loops[best].load += pdpvt->loopLoad;
+            pool->loops[best].nPorts++;
+            if (pdpvt->loopNext != &pool->loops[best]) {
+                pdpvt->loopNext = &pool->loops[best];
+                wake(pdpvt->loop);
+            }
+        }
+    }
+    epicsMutexUnlock(pool->lock);
+
+    for (i = 0 ; i < n ; i++) {
+        drvPvt *pdpvt = sorted[i];
+        epicsTimeStamp now;
+        pdpvt->clock->now(pdpvt->clock, &now);
+        usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_LOOP,
+                                        pdpvt->loopNext->index, &now);
+        usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_LOOP_LOAD,
+                                        pdpvt->loopLoad, &now);
+        usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_LOOP_THREAD_LOAD,
+                                        pdpvt->loopNext->load, &now);
+        if (pool->spin != 0) {
+            usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_LOOP_SPIN,
+                                        pdpvt->loopNext->spinLoad, &now);
+            usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_LOOP_SPIN_WAKES,
+                                        pdpvt->loopNext->spinWakes, &now);
+            usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_LOOP_PARK_WAKES,
+                                        pdpvt->loopNext->parkWakes, &now);
+        }
+    }
+    free(sorted);
+    free(load);
+}
+
+static void
+rebalanceThread(void *arg)
+{
+    for (;;) {
+        epicsThreadSleep(pool->rebalancePeriod);
+        rebalance(pool->rebalancePeriod);
+    }
+}
+
+/*
+ * Give a port to the pool, on the thread with the fewest ports
+ */
+asynStatus
+usbMouseLoopAdd(drvPvt *pdpvt)
+{
+    usbMouseLoop *loop;
+    int i;
+
+    if ((pool == NULL) || !pdpvt->transport->selectable)
+        return asynError;
+    setNonBlocking(pdpvt);
+    pdpvt->loopLastConnect = monotonicSeconds();
+    epicsMutexMustLock(pool->lock);
+    if (pool->nPorts == pool->maxPorts) {
+        pool->maxPorts = pool->maxPorts ? 2 * pool->maxPorts : 8;
+        pool->ports = realloc(pool->ports, pool->maxPorts * sizeof *pool->ports);
+        if (pool->ports == NULL)
+            cantProceed("usbMouseLoopAdd");
+    }
+    loop = &pool->loops[0];
+    for (i = 1 ; i < pool->nLoops ; i++)
+        if (pool->loops[i].nPorts < loop->nPorts)
+            loop = &pool->loops[i];
+    loop->nPorts++;
+    pdpvt->loop = pdpvt->loopNext = loop;
+    pool->ports[pool->nPorts++] = pdpvt;
+    epicsMutexUnlock(pool->lock);
+    wake(loop);
+    return asynSuccess;
+}
+
+void
+usbMouseLoopReport(drvPvt *pdpvt, FILE *fp, int details)
+{
+    if ((details < 1) || (pdpvt->loopNext == NULL))
+        return;
+    fprintf(fp, "        Loop thread: %d (port %.1f%%, thread %.1f%% of a CPU)\n",
+                                        pdpvt->loopNext->index,
+                                        pdpvt->loopLoad * 100,
+                                        pdpvt->loopNext->load * 100);
+    if (pool->spin != 0)
+        fprintf(fp, "          Busy poll: %.1f%% spinning, %lu wakes spinning, "
+                                "%lu parked, %lu parks\n",
+                                        pdpvt->loopNext->spinLoad * 100,
+                                        pdpvt->loopNext->spinWakes,
+                                        pdpvt->loopNext->parkWakes,
+                                        pdpvt->loopNext->parks);
+    if (details >= 3) {
+        usbMouseLoop *loop = pdpvt->loopNext;
+        fprintf(fp, "      Ports moved: %lu in all\n", pool->moveCount);
+        if (loop->batches)
+            fprintf(fp, "   Batched dispatch: %lu wakeups, %.2f samples from %.2f ports each\n",
+                            loop->batches,
+                            (double)loop->batchSamples / loop->batches,
+                            (double)loop->batchPorts / loop->batches);
+    }
+}
+
+/*
+ * Set the busy-poll policy.  Can be run at any time, to compare it
+ * with blocking on the same ports.
+ */
+static void
+usbMouseLoopBusyPoll(double spin, int cpu)
+{
+    int i;
+
+    if (pool == NULL) {
+        printf("No event loop pool -- run usbMouseLoopPool first.\n");
+        return;
+    }
+    pool->spin = spin * 1.0e-6;
+    if (cpu != pool->cpu) {
+        pool->cpu = cpu;
+        pool->cpuGeneration++;
+    }
+    for (i = 0 ; i < pool->nLoops ; i++)
+        wake(&pool->loops[i]);
+    if (spin < 0)
+        printf("Loop threads spin without parking");
+    else if (spin > 0)
+        printf("Loop threads spin for %g us after each report", spin);
+    else
+        printf("Loop threads block");
+    if (cpu > 0)
+        printf(", pinned to CPUs %d-%d.\n", cpu, cpu + pool->nLoops - 1);
+    else
+        printf(".\n");
+}
+
+static void
+usbMouseLoopPool(int nThreads, double rebalancePeriod, int priority)
+{
+    int i;
+    char threadName[40];
+    extern volatile int interruptAccept;
+
+    if (pool != NULL) {
+        printf("The event loop pool has already been created.\n");
+        return;
+    }
+    if (interruptAccept) {
+        printf("The event loop pool must be created before iocInit.\n");
+        return;
+    }
+    if (nThreads <= 0) nThreads = 2;
+    if (rebalancePeriod <= 0) rebalancePeriod = 5.0;
+    if (priority <= 0) priority = epicsThreadPriorityMedium;
+    pool = callocMustSucceed(1, sizeof *pool, "usbMouseLoopPool");
+    pool->lock = epicsMutexMustCreate();
+    pool->nLoops = nThreads;
+    pool->rebalancePeriod = rebalancePeriod;
+    pool->loops = callocMustSucceed(nThreads, sizeof *pool->loops, "usbMouseLoopPool");
+    for (i = 0 ; i < nThreads ; i++) {
+        usbMouseLoop *loop = &pool->loops[i];
+        loop->index = i;
+        if ((pipe(loop->wakeFd) < 0)
+         || (fcntl(loop->wakeFd[0], F_SETFL, O_NONBLOCK) < 0)
+         || (fcntl(loop->wakeFd[1], F_SETFL, O_NONBLOCK) < 0)) {
+            printf("Can't create event loop wakeup pipe: %s\n", strerror(errno));
+            return;
+        }
+        epicsSnprintf(threadName, sizeof threadName, "usbMouseLoop%d", i);
+        if (epicsThreadCreate(threadName,
+                              priority,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              loopThread,
+                              loop) == NULL) {
+            printf("Can't set up %s thread!\n", threadName);
+            return;
+        }
+    }
+    if (epicsThreadCreate("usbMouseBalance",
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackSmall),
+                          rebalanceThread,
+                          NULL) == NULL)
+        printf("Can't set up usbMouseBalance thread!\n");
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseLoopPoolArg0 = { "threads",iocshArgInt};
+static const iocshArg usbMouseLoopPoolArg1 = { "rebalance period(s)",iocshArgDouble};
+static const iocshArg usbMouseLoopPoolArg2 = { "priority",iocshArgInt};
+static const iocshArg *usbMouseLoopPoolArgs[] = {
+                    &usbMouseLoopPoolArg0, &usbMouseLoopPoolArg1,
+                    &usbMouseLoopPoolArg2 };
+static const iocshFuncDef usbMouseLoopPoolFuncDef =
+      {"usbMouseLoopPool",3,usbMouseLoopPoolArgs};
+static void usbMouseLoopPoolCallFunc(const iocshArgBuf *args)
+{
+    usbMouseLoopPool(args[0].ival, args[1].dval, args[2].ival);
+}
+
+static const iocshArg usbMouseLoopBusyPollArg0 = { "spin(us)",iocshArgDouble};
+static const iocshArg usbMouseLoopBusyPollArg1 = { "first cpu",iocshArgInt};
+static const iocshArg *usbMouseLoopBusyPollArgs[] = {
+                    &usbMouseLoopBusyPollArg0, &usbMouseLoopBusyPollArg1 };
+static const iocshFuncDef usbMouseLoopBusyPollFuncDef =
+      {"usbMouseLoopBusyPoll",2,usbMouseLoopBusyPollArgs};
+static void usbMouseLoopBusyPollCallFunc(const iocshArgBuf *args)
+{
+    usbMouseLoopBusyPoll(args[0].dval, args[1].ival);
+}
+
+void
+usbMouseLoop_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseLoopPoolFuncDef,usbMouseLoopPoolCallFunc);
+    iocshRegister(&usbMouseLoopBusyPollFuncDef,usbMouseLoopBusyPollCallFunc);
+}
@@ -0,0 +1,711 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Processing pipeline for USB mouse reports
+ *
+ * Each port passes its reports through a list of stages assembled from
+ * the IOC shell.  A stage can run inline in the thread that feeds it or
+ * on its own thread fed through a bounded queue.  A port with no stages
+ * configured gets the default "raw decode publish" pipeline.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsMessageQueue.h>
+#include <epicsExport.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+
+#include "usbMousePvt.h"
+
+/*
+ * Find 'key=value' in a stage argument string
+ */
+static const char *
+findArg(const char *args, const char *key)
+{
+    size_t n = strlen(key);
+    const char *cp = args;
+
+    if (cp == NULL)
+        return NULL;
+    while (*cp) {
+        while (isspace((unsigned char)*cp))
+            cp++;
+        if ((strncmp(cp, key, n) == 0) && (cp[n] == '='))
+            return cp + n + 1;
+        while (*cp && !isspace((unsigned char)*cp))
+            cp++;
+    }
+    return NULL;
+}
+
+double
+usbMouseArgDouble(const char *args, const char *key, double defaultValue)
+{
+    const char *cp = findArg(args, key);
+
+    if (cp == NULL)
+        return defaultValue;
+    return strtod(cp, NULL);
+}
+
+int
+usbMouseArgInt(const char *args, const char *key, int defaultValue)
+{
+    const char *cp = findArg(args, key);
+
+    if (cp == NULL)
+        return defaultValue;
+    return (int)strtol(cp, NULL, 0);
+}
+
+/*
+ * Copy the value of 'key=value' into buf, or the default if key is absent
+ */
+void
+usbMouseArgString(const char *args, const char *key, const char *defaultValue,
+                  char *buf, size_t size)
+{
+    const char *cp = findArg(args, key);
+    size_t n;
+
+    if (cp == NULL)
+        cp = defaultValue;
+    n = strcspn(cp, " \t");
+    if (n >= size)
+        n = size - 1;
+    memcpy(buf, cp, n);
+    buf[n] = '\0';
+}
+
+/*
+ *****************************************************
+ * Scale stage -- apply a gain to each axis.         *
+ * Each axis keeps the fraction of a count left over *
+ * by the gain as an exact remainder, so motion too  *
+ * small to make a count adds up instead of being    *
+ * lost, and positions never drift.                  *
+ *****************************************************
+ */
+#define SCALE_LIMIT ((epicsInt64)1 << 31)
+
+typedef struct scaleAxis {
+    epicsInt64  num;
+    epicsInt64  den;
+    epicsInt64  remainder;
+    double      published;
+} scaleAxis;
+
+typedef struct scalePvt {
+    drvPvt     *pdpvt;
+    scaleAxis   axis[3];
+    mouseValues values;
+} scalePvt;
+
+static epicsInt64
+gcd64(epicsInt64 a, epicsInt64 b)
+{
+    while (b) {
+        epicsInt64 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*
+ * Read a decimal number exactly as a fraction.  Returns a pointer to
+ * the character after the number, or NULL if there is no number or it
+ * has too many digits to hold.
+ */
+const char *
+usbMouseParseDecimal(const char *cp, epicsInt64 *num, epicsInt64 *den)
+{
+    int neg = 0, digits = 0;
+
+    *num = 0;
+    *den = 1;
+    if ((*cp == '-') || (*cp == '+'))
+        neg = (*cp++ == '-');
+    for ( ; isdigit((unsigned char)*cp) ; cp++, digits++) {
+        if (*num > 100000000)
+            return NULL;
+        *num = *num * 10 + (*cp - '0');
+    }
+    if (*cp == '.') {
+        for (cp++ ; isdigit((unsigned char)*cp) ; cp++, digits++) {
+            if ((*num > 100000000) || (*den > 100000000))
+                return NULL;
+            *num = *num * 10 + (*cp - '0');
+            *den *= 10;
+        }
+    }
+    if (digits == 0)
+        return NULL;
+    if (neg)
+        *num = -*num;
+    return cp;
+}
+
+/*
+ * Set an axis gain from "1.25", "25.4/800" and the like, kept as an
+ * exact fraction.  Other numbers, such as "1e-3", are rounded to 30
+ * fraction bits.  Returns -1 if the gain is bad.
+ */
+static int
+scaleAxisInit(scaleAxis *ax, const char *args, const char *key)
+{
+    char buf[40];
+    const char *cp;
+    char *end;
+    epicsInt64 num, den, n2, d2, g;
+
+    usbMouseArgString(args, key, "1", buf, sizeof buf);
+    cp = usbMouseParseDecimal(buf, &num, &den);
+    if (cp && (*cp == '/')) {
+        cp = usbMouseParseDecimal(cp + 1, &n2, &d2);
+        if ((cp == NULL) || (*cp != '\0') || (n2 == 0)) {
+            printf("scale stage %s must be a ratio of numbers with a non-zero divisor\n", key);
+            return -1;
+        }
+        num *= d2;
+        den *= n2;
+    }
+    if (cp && (*cp == '\0')) {
+        if (den < 0) {
+            num = -num;
+            den = -den;
+        }
+        g = gcd64(num < 0 ? -num : num, den);
+        if (g > 1) {
+            num /= g;
+            den /= g;
+        }
+    }
+
+    /*
+     * Keep delta * num well inside 64 bits
+     */
+    if ((cp == NULL) || (*cp != '\0')
+     || (num > SCALE_LIMIT) || (num < -SCALE_LIMIT) || (den > SCALE_LIMIT)) {
+        double gain;
+        if (cp && (*cp == '\0')) {
+            gain = (double)num / den;
+        }
+        else {
+            gain = strtod(buf, &end);
+            if ((end == buf) || (*end != '\0')) {
+                printf("scale stage %s must be a number or a ratio such as 25.4/800\n", key);
+                return -1;
+            }
+        }
+        den = (epicsInt64)1 << 30;
+        if ((gain > (double)SCALE_LIMIT / den) || (gain < -(double)SCALE_LIMIT / den)) {
+            printf("scale stage %s is out of range\n", key);
+            return -1;
+        }
+        num = (epicsInt64)(gain * den + (gain < 0 ? -0.5 : 0.5));
+    }
+    ax->num = num;
+    ax->den = den;
+    ax->remainder = 0;
+    ax->published = 0;
+    return 0;
+}
+
+static int
+scaleAxisDelta(scaleAxis *ax, int delta)
+{
+    return (int)usbMouseScaleDelta(ax->num, ax->den, &ax->remainder, delta);
+}
+
+static void *
+scaleCreate(drvPvt *pdpvt, const char *args)
+{
+    scalePvt *pvt = callocMustSucceed(1, sizeof *pvt, "scaleCreate");
+
+    pvt->pdpvt = pdpvt;
+    if ((scaleAxisInit(&pvt->axis[0], args, "x") < 0)
+     || (scaleAxisInit(&pvt->axis[1], args, "y") < 0)
+     || (scaleAxisInit(&pvt->axis[2], args, "wheel") < 0)) {
+        free(pvt);
+        return NULL;
+    }
+    return pvt;
+}
+
+static int
+scaleProcess(void *arg, usbMouseSample *sample)
+{
+    scalePvt *pvt = arg;
+    int *position[3], i;
+
+    sample->dx = scaleAxisDelta(&pvt->axis[0], sample->dx);
+    sample->dy = scaleAxisDelta(&pvt->axis[1], sample->dy);
+    sample->dWheel = scaleAxisDelta(&pvt->axis[2], sample->dWheel);
+    pvt->values.buttons = sample->values.buttons;
+    pvt->values.xPosition += sample->dx;
+    pvt->values.yPosition += sample->dy;
+    pvt->values.wheel += sample->dWheel;
+    sample->values = pvt->values;
+
+    /*
+     * Positions including the fractions of a count
+     */
+    position[0] = &pvt->values.xPosition;
+    position[1] = &pvt->values.yPosition;
+    position[2] = &pvt->values.wheel;
+    for (i = 0 ; i < 3 ; i++) {
+        scaleAxis *ax = &pvt->axis[i];
+        double value = *position[i] + (double)ax->remainder / ax->den;
+        if (value != ax->published) {
+            ax->published = value;
+            usbMousePublishFloat64(pvt->pdpvt, USBMOUSE_ADDR_SCALED_X + i,
+                                                        value, &sample->time);
+        }
+    }
+    return 1;
+}
+
+static void
+scaleReport(void *arg, FILE *fp, int details)
+{
+    scalePvt *pvt = arg;
+    static const char *const names[3] = { "x", "y", "wheel" };
+    int i;
+
+    for (i = 0 ; i < 3 ; i++) {
+        scaleAxis *ax = &pvt->axis[i];
+        fprintf(fp, "%s%s=%lld/%lld", i ? " " : "", names[i],
+                                (long long)ax->num, (long long)ax->den);
+        if (details >= 3)
+            fprintf(fp, " (%.9g)", ax->published);
+    }
+}
+
+static const usbMouseStageType scaleStage = {
+    "scale", scaleCreate, scaleProcess, scaleReport
+};
+
+/*
+ *****************************************************
+ * Filter stage -- limit the rate of samples passed  *
+ * on.  Button changes always get through.           *
+ *****************************************************
+ */
+typedef struct filterPvt {
+    double          minInterval;
+    int             havePassed;
+    int             lastButtons;
+    epicsTimeStamp  lastTime;
+} filterPvt;
+
+static void *
+filterCreate(drvPvt *pdpvt, const char *args)
+{
+    filterPvt *pvt;
+    double rate = usbMouseArgDouble(args, "rate", 0.0);
+
+    if (rate <= 0) {
+        printf("filter stage needs rate=<Hz>\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "filterCreate");
+    pvt->minInterval = 1.0 / rate;
+    return pvt;
+}
+
+static int
+filterProcess(void *arg, usbMouseSample *sample)
+{
+    filterPvt *pvt = arg;
+
+    if (pvt->havePassed
+     && (sample->values.buttons == pvt->lastButtons)
+     && (epicsTimeDiffInSeconds(&sample->time, &pvt->lastTime) < pvt->minInterval))
+        return 0;
+    pvt->havePassed = 1;
+    pvt->lastButtons = sample->values.buttons;
+    pvt->lastTime = sample->time;
+    return 1;
+}
+
+static void
+filterReport(void *arg, FILE *fp, int details)
+{
+    filterPvt *pvt = arg;
+
+    fprintf(fp, "rate=%g", 1.0 / pvt->minInterval);
+}
+
+static const usbMouseStageType filterStage = {
+    "filter", filterCreate, filterProcess, filterReport
+};
+
+/*
+ *****************************************************
+ * Derive stage -- compute velocities                *
+ *****************************************************
+ */
+typedef struct derivePvt {
+    double          smoothing;
+    int             havePrevious;
+    epicsTimeStamp  lastTime;
+    int             lastX;
+    int             lastY;
+    double          xVelocity;
+    double          yVelocity;
+} derivePvt;
+
+static void *
+deriveCreate(drvPvt *pdpvt, const char *args)
+{
+    derivePvt *pvt;
+    double smoothing = usbMouseArgDouble(args, "smoothing", 0.0);
+
+    if ((smoothing < 0) || (smoothing >= 1)) {
+        printf("derive stage smoothing must be in [0,1)\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "deriveCreate");
+    pvt->smoothing = smoothing;
+    return pvt;
+}
+
+static int
+deriveProcess(void *arg, usbMouseSample *sample)
+{
+    derivePvt *pvt = arg;
+
+    if (pvt->havePrevious) {
+        double dt = epicsTimeDiffInSeconds(&sample->time, &pvt->lastTime);
+        if (dt > 0) {
+            double vx = (sample->values.xPosition - pvt->lastX) / dt;
+            double vy = (sample->values.yPosition - pvt->lastY) / dt;
+            pvt->xVelocity += (1.0 - pvt->smoothing) * (vx - pvt->xVelocity);
+            pvt->yVelocity += (1.0 - pvt->smoothing) * (vy - pvt->yVelocity);
+        }
+    }
+    pvt->havePrevious = 1;
+    pvt->lastTime = sample->time;
+    pvt->lastX = sample->values.xPosition;
+    pvt->lastY = sample->values.yPosition;
+    sample->xVelocity = pvt->xVelocity;
+    sample->yVelocity = pvt->yVelocity;
+    return 1;
+}
+
+static void
+deriveReport(void *arg, FILE *fp, int details)
+{
+    derivePvt *pvt = arg;
+
+    fprintf(fp, "smoothing=%g", pvt->smoothing);
+}
+
+static const usbMouseStageType deriveStage = {
+    "derive", deriveCreate, deriveProcess, deriveReport
+};
+
+/*
+ * Known stage types
+ */
+static const usbMouseStageType *const stageTypes[] = {
+    &usbMouseRawStage,
+    &usbMouseDecodeStage,
+    &scaleStage,
+    &filterStage,
+    &deriveStage,
+    &usbMouseJogStage,
+    &usbMouseSimplifyStage,
+    &usbMouseHistogramStage,
+    &usbMouseCaptureStage,
+    &usbMouseEncoderStage,
+    &usbMouseLatchStage,
+    &usbMousePublishStage,
+    &usbMouseNativeStage,
+};
+#define NSTAGETYPES (sizeof stageTypes / sizeof stageTypes[0])
+
+/*
+ * Pass a sample down the pipeline, starting at the given stage.
+ * A sample reaching a queued stage is handed to that stage's thread,
+ * which then carries it on through the stages that follow.
+ */
+static void
+runStages(usbMouseStage *stage, usbMouseSample *sample, int dequeued)
+{
+    for ( ; stage != NULL ; stage = stage->next, dequeued = 0) {
+        epicsUInt64 start;
+        double t;
+        int pass;
+
+        if ((stage->queue != NULL) && !dequeued) {
+            if (epicsMessageQueueTrySend(stage->queue, sample, sizeof *sample) != 0)
+                stage->dropCount++;
+            return;
+        }
+        start = epicsMonotonicGet();
+        pass = stage->type->process(stage->pvt, sample);
+        t = (epicsMonotonicGet() - start) * 1.0e-9;
+        stage->sampleCount++;
+        stage->totalTime += t;
+        if (t > stage->maxTime)
+            stage->maxTime = t;
+        if (!pass)
+            return;
+    }
+}
+
+void
+usbMousePipelineRun(usbMouseStage *stage, usbMouseSample *sample)
+{
+    runStages(stage, sample, 0);
+}
+
+static void
+stageThread(void *arg)
+{
+    usbMouseStage *stage = arg;
+
+    /*
+     * An empty message means the stage couldn't be set up
+     */
+    for (;;) {
+        int n = epicsMessageQueueReceive(stage->queue, &stage->sample,
+                                                    sizeof stage->sample);
+        if (n == 0)
+            break;
+        if (n == sizeof stage->sample)
+            runStages(stage, &stage->sample, 1);
+    }
+    epicsMessageQueueDestroy(stage->queue);
+}
+
+/*
+ * Append a stage to a port's pipeline
+ */
+asynStatus
+usbMouseStageAdd(drvPvt *pdpvt, const char *typeName, int queueSize,
+                 const char *args)
+{
+    const usbMouseStageType *type = NULL;
+    usbMouseStage *stage, **spp;
+    int i;
+
+    for (i = 0 ; i < NSTAGETYPES ; i++) {
+        if (strcmp(stageTypes[i]->name, typeName) == 0) {
+            type = stageTypes[i];
+            break;
+        }
+    }
+    if (type == NULL) {
+        printf("Unknown stage type \"%s\"\n", typeName);
+        return asynError;
+    }
+
+    /*
+     * The stage's own queue and thread are set up before the stage
+     * itself, which may start threads of its own and can't be torn
+     * down again.  The aligned storage isn't freed if anything fails.
+     */
+    stage = usbMouseCallocAligned(sizeof *stage, "usbMouseStageAdd");
+    stage->type = type;
+    stage->pdpvt = pdpvt;
+    if (queueSize > 0) {
+        char threadName[40];
+        stage->queueSize = queueSize;
+        stage->queue = epicsMessageQueueCreate(queueSize, sizeof(usbMouseSample));
+        epicsSnprintf(threadName, sizeof threadName, "%s_%s",
+                                                pdpvt->portName, type->name);
+        if (stage->queue == NULL) {
+            printf("Can't set up %s queue!\n", threadName);
+            return asynError;
+        }
+        if (epicsThreadCreate(threadName,
+                              pdpvt->priority,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              stageThread,
+                              stage) == NULL) {
+            printf("Can't set up %s thread!\n", threadName);
+            epicsMessageQueueDestroy(stage->queue);
+            return asynError;
+        }
+    }
+    stage->pvt = type->create(pdpvt, args);
+    if (stage->pvt == NULL) {
+        if (stage->queue)
+            epicsMessageQueueSend(stage->queue, NULL, 0);
+        return asynError;
+    }
+    for (spp = &pdpvt->pipeline ; *spp != NULL ; spp = &(*spp)->next)
+        continue;
+    *spp = stage;
+    return asynSuccess;
+}
+
+void
+usbMousePipelineDefault(drvPvt *pdpvt)
+{
+    usbMouseStageAdd(pdpvt, usbMouseRawStage.name, 0, NULL);
+    usbMouseStageAdd(pdpvt, usbMouseDecodeStage.name, 0, NULL);
+    usbMouseStageAdd(pdpvt, usbMousePublishStage.name, 0, NULL);
+}
+
+void
+usbMousePipelineReport(drvPvt *pdpvt, FILE *fp, int details)
+{
+    usbMouseStage *stage;
+
+    if ((details < 1) || (pdpvt->pipeline == NULL))
+        return;
+    fprintf(fp, "           Pipeline:\n");
+    for (stage = pdpvt->pipeline ; stage != NULL ; stage = stage->next) {
+        fprintf(fp, "%19s", stage->type->name);
+        if (stage->queue)
+            fprintf(fp, " (queue %d, %lu dropped)", stage->queueSize,
+                                                    stage->dropCount);
+        if (stage->type->report) {
+            fprintf(fp, " ");
+            stage->type->report(stage->pvt, fp, details);
+        }
+        fprintf(fp, "\n");
+        if ((details >= 3) && (stage->sampleCount != 0))
+            fprintf(fp, "%19s %lu samples, %.3g us mean, %.3g us max\n", "",
+                                stage->sampleCount,
+                                stage->totalTime * 1e6 / stage->sampleCount,
+                                stage->maxTime * 1e6);
+    }
+}
+
+/*
+ * Pass a value written from a record to the stage that owns the address
+ */
+asynStatus
+usbMousePipelineWrite(drvPvt *pdpvt, int addr, double value)
+{
+    usbMouseStage *stage;
+
+    for (stage = pdpvt->pipeline ; stage != NULL ; stage = stage->next) {
+        if (stage->type->write) {
+            int s = stage->type->write(stage->pvt, addr, value);
+            if (s)
+                return s > 0 ? asynSuccess : asynError;
+        }
+    }
+    return asynError;
+}
+
+asynStatus
+usbMousePipelineWriteString(drvPvt *pdpvt, int addr, const char *value)
+{
+    usbMouseStage *stage;
+
+    for (stage = pdpvt->pipeline ; stage != NULL ; stage = stage->next) {
+        if (stage->type->writeString) {
+            int s = stage->type->writeString(stage->pvt, addr, value);
+            if (s)
+                return s > 0 ? asynSuccess : asynError;
+        }
+    }
+    return asynError;
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMouseStageArg0 = { "port",iocshArgString};
+static const iocshArg usbMouseStageArg1 = { "stage",iocshArgString};
+static const iocshArg usbMouseStageArg2 = { "queue size",iocshArgInt};
+static const iocshArg usbMouseStageArg3 = { "arguments",iocshArgString};
+static const iocshArg *usbMouseStageArgs[] = {
+                    &usbMouseStageArg0, &usbMouseStageArg1,
+                    &usbMouseStageArg2, &usbMouseStageArg3 };
+static const iocshFuncDef usbMouseStageFuncDef =
+      {"usbMouseStage",4,usbMouseStageArgs};
+static void usbMouseStageCallFunc(const iocshArgBuf *args)
+{
+    drvPvt *pdpvt;
+    extern volatile int interruptAccept;
+
+    if ((args[0].sval == NULL) || (args[1].sval == NULL)) {
+        printf("Usage: usbMouseStage port stage [queueSize] [\"arguments\"]\n");
+        return;
+    }
+    if (interruptAccept) {
+        printf("Pipeline stages must be added before iocInit.\n");
+        return;
+    }
+    pdpvt = usbMouseFindPort(args[0].sval);
+    if (pdpvt == NULL) {
+        printf("No such port: %s\n", args[0].sval);
+        return;
+    }
+    usbMouseStageAdd(pdpvt, args[1].sval, args[2].ival, args[3].sval);
+}
+
+/*
+ * Time spent in each of a port's stages over an interval
+ */
+static void
+usbMouseStageTiming(const char *portName, double seconds)
+{
+    drvPvt *pdpvt;
+    usbMouseStage *stage;
+    unsigned long count[32];
+    double total[32], elapsed;
+    epicsUInt64 start;
+    int i;
+
+    if ((portName == NULL) || ((pdpvt = usbMouseFindPort(portName)) == NULL)) {
+        printf("Usage: usbMouseStageTiming port [seconds]\n");
+        return;
+    }
+    if (seconds <= 0)
+        seconds = 5;
+    for (stage = pdpvt->pipeline, i = 0 ; stage && (i < 32) ; stage = stage->next, i++) {
+        count[i] = stage->sampleCount;
+        total[i] = stage->totalTime;
+    }
+    start = epicsMonotonicGet();
+    epicsThreadSleep(seconds);
+    elapsed = (epicsMonotonicGet() - start) * 1.0e-9;
+    printf("%-12s %12s %12s %12s %10s\n", "Stage", "Samples", "Samples/s",
+                                                    "Mean (us)", "CPU (%)");
+    for (stage = pdpvt->pipeline, i = 0 ; stage && (i < 32) ; stage = stage->next, i++) {
+        unsigned long n = stage->sampleCount - count[i];
+        double t = stage->totalTime - total[i];
+        printf("%-12s %12lu %12.0f %12.3f %10.2f\n", stage->type->name, n,
+                                n / elapsed, n ? t * 1e6 / n : 0.0,
+                                t * 100 / elapsed);
+    }
+}
+
+static const iocshArg usbMouseStageTimingArg0 = { "port",iocshArgString};
+static const iocshArg usbMouseStageTimingArg1 = { "seconds",iocshArgDouble};
+static const iocshArg *usbMouseStageTimingArgs[] = {
+                    &usbMouseStageTimingArg0, &usbMouseStageTimingArg1 };
+static const iocshFuncDef usbMouseStageTimingFuncDef =
+      {"usbMouseStageTiming",2,usbMouseStageTimingArgs};
+static void usbMouseStageTimingCallFunc(const iocshArgBuf *args)
+{
+    usbMouseStageTiming(args[0].sval, args[1].dval);
+}
+
+static void
+usbMousePipeline_RegisterCommands(void)
+{
+    iocshRegister(&usbMouseStageFuncDef,usbMouseStageCallFunc);
+    iocshRegister(&usbMouseStageTimingFuncDef,usbMouseStageTimingCallFunc);
+}
+epicsExportRegistrar(usbMousePipeline_RegisterCommands);
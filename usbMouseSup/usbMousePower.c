@@ -0,0 +1,294 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Power management latency control
+ *
+ * Deep CPU idle states can add hundreds of microseconds to the time
+ * taken to wake a thread for each report.  While any port reads reports
+ * faster than a threshold rate this holds a PM QoS request through
+ * /dev/cpu_dma_latency, which keeps the CPUs out of idle states slower
+ * to leave than the requested latency, and sets the timer slack of the
+ * threads reading reports.  Both are released once every port has been
+ * below the threshold for a hold time.
+ *
+ * Timer slack belongs to each thread, so the reading threads pick up a
+ * change themselves, the next time they handle a report.
+ *
+ * Each port publishes whether the control is active (address 130) and
+ * its own report rate (131) once a second.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <errlog.h>
+#include <cantProceed.h>
+#include <iocsh.h>
+
+#include "usbMousePvt.h"
+
+#define POWER_INTERVAL  1.0
+
+typedef struct powerPortState {
+    struct powerPortState  *next;
+    drvPvt                 *pdpvt;
+    unsigned long           lastCount;
+    double                  rate;
+} powerPortState;
+
+typedef struct powerPvt {
+    epicsMutexId        lock;
+    double              threshold;
+    int                 latency;
+    int                 slack;
+    double              hold;
+    int                 qosFd;
+    int                 active;
+    int                 published;
+    double              idleTime;
+    unsigned long       engaged;
+    powerPortState     *ports;
+} powerPvt;
+
+static powerPvt *power;
+
+/*
+ * Timer slack the reading threads are to use, 0 for their default, and
+ * a count of changes to it so each thread can tell when to catch up.
+ */
+static volatile int slackWanted;
+static volatile int slackGeneration;
+static __thread int slackApplied;
+
+void
+usbMousePowerApply(void)
+{
+    int generation = slackGeneration;
+
+    if (generation != slackApplied) {
+        slackApplied = generation;
+        prctl(PR_SET_TIMERSLACK, (unsigned long)slackWanted, 0, 0, 0);
+    }
+}
+
+static void
+setSlack(int slack)
+{
+    slackWanted = slack;
+    slackGeneration++;
+}
+
+static void
+engage(powerPvt *pvt)
+{
+    epicsInt32 latency = pvt->latency;
+
+    pvt->qosFd = open("/dev/cpu_dma_latency", O_WRONLY);
+    if (pvt->qosFd < 0) {
+        errlogPrintf("usbMousePower: can't open /dev/cpu_dma_latency: %s\n",
+                                                            strerror(errno));
+    }
+    else if (write(pvt->qosFd, &latency, sizeof latency) != sizeof latency) {
+        errlogPrintf("usbMousePower: can't set PM QoS latency: %s\n",
+                                                            strerror(errno));
+        close(pvt->qosFd);
+        pvt->qosFd = -1;
+    }
+    if (pvt->slack > 0)
+        setSlack(pvt->slack);
+    pvt->active = 1;
+    pvt->engaged++;
+}
+
+/*
+ * Closing the file drops the PM QoS request
+ */
+static void
+release(powerPvt *pvt)
+{
+    if (pvt->qosFd >= 0) {
+        close(pvt->qosFd);
+        pvt->qosFd = -1;
+    }
+    if (slackWanted != 0)
+        setSlack(0);
+    pvt->active = 0;
+}
+
+/*
+ * Add ports configured since the last look
+ */
+static void
+findPorts(powerPvt *pvt)
+{
+    drvPvt *pdpvt;
+    powerPortState *pp;
+
+    for (pdpvt = usbMousePortList() ; pdpvt != NULL ; pdpvt = pdpvt->next) {
+        for (pp = pvt->ports ; pp ; pp = pp->next) {
+            if (pp->pdpvt == pdpvt)
+                break;
+        }
+        if (pp == NULL) {
+            pp = callocMustSucceed(1, sizeof *pp, "usbMousePower");
+            pp->pdpvt = pdpvt;
+            pp->lastCount = pdpvt->packetCount;
+            pp->next = pvt->ports;
+            pvt->ports = pp;
+        }
+    }
+}
+
+static void
+powerThread(void *arg)
+{
+    powerPvt *pvt = arg;
+    epicsUInt64 last = epicsMonotonicGet(), now;
+    extern volatile int interruptAccept;
+
+    for (;;) {
+        powerPortState *pp;
+        int busy = 0, active, publish;
+        double elapsed;
+
+        epicsThreadSleep(POWER_INTERVAL);
+        now = epicsMonotonicGet();
+        elapsed = (now - last) * 1.0e-9;
+        last = now;
+        epicsMutexMustLock(pvt->lock);
+        findPorts(pvt);
+        for (pp = pvt->ports ; pp ; pp = pp->next) {
+            unsigned long count = pp->pdpvt->packetCount;
+            pp->rate = (count - pp->lastCount) / elapsed;
+            pp->lastCount = count;
+            if ((pvt->threshold > 0) && (pp->rate >= pvt->threshold))
+                busy = 1;
+        }
+        if (busy) {
+            pvt->idleTime = 0;
+            if (!pvt->active)
+                engage(pvt);
+        }
+        else if (pvt->active) {
+            pvt->idleTime += elapsed;
+            if ((pvt->idleTime >= pvt->hold) || (pvt->threshold <= 0))
+                release(pvt);
+        }
+        active = pvt->active;
+        epicsMutexUnlock(pvt->lock);
+        if (interruptAccept) {
+            epicsTimeStamp ts;
+            publish = active != pvt->published;
+            pvt->published = active;
+            for (pp = pvt->ports ; pp ; pp = pp->next) {
+                drvPvt *pdpvt = pp->pdpvt;
+                pdpvt->clock->now(pdpvt->clock, &ts);
+                if (publish)
+                    usbMousePublishInt32(pdpvt, USBMOUSE_ADDR_POWER_ACTIVE,
+                                                            active, &ts);
+                usbMousePublishFloat64(pdpvt, USBMOUSE_ADDR_POWER_RATE,
+                                                            pp->rate, &ts);
+            }
+        }
+    }
+}
+
+static void
+powerReport(powerPvt *pvt)
+{
+    powerPortState *pp;
+
+    printf("Threshold %g reports/s, latency %d us, timer slack %d ns, hold %g s\n",
+                pvt->threshold, pvt->latency, pvt->slack, pvt->hold);
+    printf("%s, PM QoS request %s, engaged %lu times\n",
+                pvt->active ? "Active" : "Idle",
+                pvt->qosFd >= 0 ? "held" : "not held", pvt->engaged);
+    for (pp = pvt->ports ; pp ; pp = pp->next)
+        printf("%12s %10.1f reports/s\n", pp->pdpvt->portName, pp->rate);
+}
+
+/*
+ * Set the rate above which to hold down latency.  Can be run again at
+ * any time to change the settings; a negative threshold turns the
+ * control off and no arguments show its state.
+ */
+static void
+usbMousePowerQos(double threshold, int latency, int slack, double hold)
+{
+    powerPvt *pvt = power;
+
+    if (threshold == 0) {
+        if (pvt) {
+            epicsMutexMustLock(pvt->lock);
+            powerReport(pvt);
+            epicsMutexUnlock(pvt->lock);
+        }
+        else
+            printf("Usage: usbMousePowerQos threshold [latency] [slack] [hold]\n");
+        return;
+    }
+    if (pvt == NULL) {
+        pvt = callocMustSucceed(1, sizeof *pvt, "usbMousePowerQos");
+        pvt->qosFd = -1;
+        pvt->published = -1;
+        pvt->lock = epicsMutexMustCreate();
+    }
+    epicsMutexMustLock(pvt->lock);
+    pvt->latency = latency > 0 ? latency : 0;
+    pvt->slack = slack > 0 ? slack : 0;
+    pvt->hold = hold > 0 ? hold : 5;
+    pvt->threshold = threshold;
+    if (pvt->active) {
+        /*
+         * Apply the new settings the next time the control engages
+         */
+        release(pvt);
+    }
+    epicsMutexUnlock(pvt->lock);
+    if (power == NULL) {
+        if (epicsThreadCreate("usbMousePower",
+                              epicsThreadPriorityLow,
+                              epicsThreadGetStackSize(epicsThreadStackSmall),
+                              powerThread,
+                              pvt) == NULL) {
+            printf("Can't set up usbMousePower thread!\n");
+            return;
+        }
+        power = pvt;
+    }
+}
+
+/*
+ * IOC shell command registration
+ */
+static const iocshArg usbMousePowerQosArg0 = { "threshold(reports/s)",iocshArgDouble};
+static const iocshArg usbMousePowerQosArg1 = { "latency(us)",iocshArgInt};
+static const iocshArg usbMousePowerQosArg2 = { "timer slack(ns)",iocshArgInt};
+static const iocshArg usbMousePowerQosArg3 = { "hold(s)",iocshArgDouble};
+static const iocshArg *usbMousePowerQosArgs[] = {
+                    &usbMousePowerQosArg0, &usbMousePowerQosArg1,
+                    &usbMousePowerQosArg2, &usbMousePowerQosArg3 };
+static const iocshFuncDef usbMousePowerQosFuncDef =
+      {"usbMousePowerQos",4,usbMousePowerQosArgs};
+static void usbMousePowerQosCallFunc(const iocshArgBuf *args)
+{
+    usbMousePowerQos(args[0].dval, args[1].ival, args[2].ival, args[3].dval);
+}
+
+void
+usbMousePower_RegisterCommands(void)
+{
+    iocshRegister(&usbMousePowerQosFuncDef,usbMousePowerQosCallFunc);
+}
@@ -0,0 +1,479 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Definitions shared by the USB mouse support source files
+ */
+#ifndef INC_usbMousePvt_H
+#define INC_usbMousePvt_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <epicsMessageQueue.h>
+#include <asynDriver.h>
+#include <libusb-1.0/libusb.h>
+
+#include "usbMouseCore.h"
+
+/*
+ * ASYN addresses.  Records can also name a field in their drvInfo, as
+ * in "@asyn(M0 0 0)X".  The name is looked up once, when the record is
+ * initialized, and the field's address kept in the reason of the
+ * record's asynUser, offset by one so that a reason of 0 is left to
+ * mean a record that gave the address alone.  USBMOUSE_FIELD gives the
+ * field either way.
+ */
+#define USBMOUSE_REASON_OFFSET      1
+#define USBMOUSE_FIELD(pasynUser, addr) ((pasynUser)->reason ? \
+            (pasynUser)->reason - USBMOUSE_REASON_OFFSET : (addr))
+#define USBMOUSE_ADDR_BUTTON_FIRST  0
+#define USBMOUSE_ADDR_BUTTON_LAST   7
+#define USBMOUSE_ADDR_X             10
+#define USBMOUSE_ADDR_Y             11
+#define USBMOUSE_ADDR_WHEEL         12
+#define USBMOUSE_ADDR_X_VELOCITY    13
+#define USBMOUSE_ADDR_Y_VELOCITY    14
+#define USBMOUSE_ADDR_SAMPLE        15
+
+/*
+ * Addresses from here up belong to stages other than publish
+ */
+#define USBMOUSE_ADDR_STAGE_FIRST   20
+#define USBMOUSE_ADDR_RAW           20
+#define USBMOUSE_ADDR_RAW_LENGTH    21
+#define USBMOUSE_ADDR_RAW_REPORT_ID 22
+#define USBMOUSE_ADDR_JOG_X         30
+#define USBMOUSE_ADDR_JOG_Y         31
+#define USBMOUSE_ADDR_JOG_ENABLE    32
+#define USBMOUSE_ADDR_JOG_MODE      33
+#define USBMOUSE_ADDR_JOG_GAIN      34
+#define USBMOUSE_ADDR_JOG_ACTIVE    35
+#define USBMOUSE_ADDR_VERTEX_X      40
+#define USBMOUSE_ADDR_VERTEX_Y      41
+#define USBMOUSE_ADDR_VERTEX_COUNT  42
+#define USBMOUSE_ADDR_LOOP          50
+#define USBMOUSE_ADDR_LOOP_LOAD     51
+#define USBMOUSE_ADDR_LOOP_THREAD_LOAD 52
+#define USBMOUSE_ADDR_LOOP_SPIN     53
+#define USBMOUSE_ADDR_LOOP_SPIN_WAKES 54
+#define USBMOUSE_ADDR_LOOP_PARK_WAKES 55
+#define USBMOUSE_ADDR_HIST          70
+#define USBMOUSE_ADDR_HIST_RESET    71
+#define USBMOUSE_ADDR_HIST_X_MIN    72
+#define USBMOUSE_ADDR_HIST_X_MAX    73
+#define USBMOUSE_ADDR_HIST_Y_MIN    74
+#define USBMOUSE_ADDR_HIST_Y_MAX    75
+#define USBMOUSE_ADDR_HIST_COUNT    76
+#define USBMOUSE_ADDR_HIST_OUTSIDE  77
+#define USBMOUSE_ADDR_CAPTURE       80
+#define USBMOUSE_ADDR_TRIAL         81
+#define USBMOUSE_ADDR_TRIAL_START   82
+#define USBMOUSE_ADDR_TRIAL_STOP    83
+#define USBMOUSE_ADDR_TRIAL_SAMPLES 84
+#define USBMOUSE_ADDR_TRIAL_DURATION 85
+#define USBMOUSE_ADDR_TRIAL_PATH    86
+#define USBMOUSE_ADDR_CAPTURE_PREFIX 87
+#define USBMOUSE_ADDR_CAPTURE_FILE  88
+#define USBMOUSE_ADDR_CAPTURE_DROPS 89
+#define USBMOUSE_ADDR_CAPTURE_WAITS 90
+#define USBMOUSE_ADDR_CAPTURE_RATE  91
+#define USBMOUSE_ADDR_CAPTURE_BACKLOG 92
+#define USBMOUSE_ADDR_CAPTURE_ERRORS 93
+#define USBMOUSE_ADDR_RESYNC_DISCREPANCIES 110
+#define USBMOUSE_ADDR_SCALED_X      120
+#define USBMOUSE_ADDR_SCALED_Y      121
+#define USBMOUSE_ADDR_SCALED_WHEEL  122
+#define USBMOUSE_ADDR_POWER_ACTIVE  130
+#define USBMOUSE_ADDR_POWER_RATE    131
+
+/*
+ * Encoder stage addresses, ten apart for X, Y and the wheel.  The count
+ * goes out on asynFloat64 and, where there is one, on asynInt64 too.
+ */
+#define USBMOUSE_ADDR_ENCODER       150
+#define USBMOUSE_ENCODER_STRIDE     10
+#define USBMOUSE_ENCODER_ANGLE      0
+#define USBMOUSE_ENCODER_REVOLUTIONS 1
+#define USBMOUSE_ENCODER_COUNT      2
+#define USBMOUSE_ENCODER_HOME       3
+
+#define USBMOUSE_ADDR_LATCH         180
+#define USBMOUSE_ADDR_LATCH_AT      181
+#define USBMOUSE_ADDR_LATCH_X       182
+#define USBMOUSE_ADDR_LATCH_Y       183
+#define USBMOUSE_ADDR_LATCH_WHEEL   184
+#define USBMOUSE_ADDR_LATCH_BUTTONS 185
+#define USBMOUSE_ADDR_LATCH_COUNT   186
+#define USBMOUSE_ADDR_LATCH_MISSED  187
+
+/*
+ * asynInt64 arrived in asyn R4-33
+ */
+#if (ASYN_VERSION > 4) || ((ASYN_VERSION == 4) && (ASYN_REVISION >= 33))
+# define USBMOUSE_HAVE_INT64
+#endif
+
+/*
+ * Per-port and per-stage state is split into sections by the thread that
+ * writes them, each starting on a cache line of its own, so the thread
+ * reading the device and the threads processing its samples do not
+ * invalidate each other's lines.  Define USBMOUSE_NO_CACHELINE_ALIGN to
+ * pack the sections together, for comparison.
+ */
+#define USBMOUSE_CACHELINE          64
+#if defined(__GNUC__) && !defined(USBMOUSE_NO_CACHELINE_ALIGN)
+# define USBMOUSE_CACHELINE_ALIGNED __attribute__((aligned(USBMOUSE_CACHELINE)))
+#else
+# define USBMOUSE_CACHELINE_ALIGNED
+#endif
+
+struct drvPvt;
+
+/*
+ * Source of time for everything the driver schedules and timestamps.
+ * The thread reading the device paces itself with advance; every other
+ * thread waits with sleep.
+ */
+typedef struct usbMouseClock {
+    const char     *name;
+    void          (*now)(struct usbMouseClock *clock, epicsTimeStamp *ts);
+    void          (*sleep)(struct usbMouseClock *clock, double seconds);
+    void          (*advance)(struct usbMouseClock *clock, double seconds);
+} usbMouseClock;
+
+/*
+ * A pipeline stage type.
+ * The process method returns 0 to drop the sample, in which case
+ * none of the following stages see it.
+ * The optional write and writeString methods handle values written
+ * from records.  They return 0 if the address isn't one of the stage's,
+ * 1 if the value was accepted or -1 if it was rejected.
+ */
+typedef struct usbMouseStageType {
+    const char *name;
+    void     *(*create)(struct drvPvt *pdpvt, const char *args);
+    int       (*process)(void *pvt, usbMouseSample *sample);
+    void      (*report)(void *pvt, FILE *fp, int details);
+    int       (*write)(void *pvt, int addr, double value);
+    int       (*writeString)(void *pvt, int addr, const char *value);
+} usbMouseStageType;
+
+/*
+ * A stage instance.
+ * Stages with a queue run on their own thread and are fed through a
+ * bounded message queue of preallocated sample buffers.
+ */
+typedef struct usbMouseStage {
+    struct usbMouseStage    *next;
+    const usbMouseStageType *type;
+    void                    *pvt;
+    struct drvPvt           *pdpvt;
+    epicsMessageQueueId      queue;
+    int                      queueSize;
+
+    /*
+     * Written by the thread feeding the queue
+     */
+    unsigned long            dropCount USBMOUSE_CACHELINE_ALIGNED;
+
+    /*
+     * Written by the thread running the stage
+     */
+    usbMouseSample           sample USBMOUSE_CACHELINE_ALIGNED;
+    unsigned long            sampleCount;
+    double                   totalTime;
+    double                   maxTime;
+} usbMouseStage;
+
+/*
+ * How reports get from the device to the reader thread.
+ * The read method returns the report length, 0 if no report arrived,
+ * or a negative value if the connection has failed.
+ * The optional resync method asks the device for its current state and
+ * returns it as a report in the same format as read, or a negative
+ * value if it can't.  Only the button levels of the report are used.
+ * Transports that read from the port's fd set 'selectable' and can be
+ * served by the event loop pool instead of a reader thread of their own.
+ */
+typedef struct usbMouseTransport {
+    const char *name;
+    int         polled;
+    asynStatus (*connect)(struct drvPvt *pdpvt);
+    int        (*read)(struct drvPvt *pdpvt, unsigned char *buf, int size);
+    void       (*disconnect)(struct drvPvt *pdpvt);
+    void       (*decode)(usbMouseSample *sample, int *buttons);
+    int         selectable;
+    int        (*resync)(struct drvPvt *pdpvt, unsigned char *buf, int size);
+} usbMouseTransport;
+
+struct usbMouseLoop;
+
+/*
+ * Samples held for batched dispatch, per port
+ */
+#define USBMOUSE_BATCH_SIZE         32
+
+/*
+ * Driver private storage
+ */
+typedef struct drvPvt {
+    struct drvPvt                  *next;
+    char                           *portName;
+
+    /*
+     * Asyn interfaces
+     */
+    asynInterface                   asynCommon;
+    asynInterface                   asynDrvUser;
+    asynInterface                   asynInt32;
+    void                           *asynInt32InterruptPvt;
+    asynInterface                   asynFloat64;
+    void                           *asynFloat64InterruptPvt;
+    asynInterface                   asynInt8Array;
+    void                           *asynInt8ArrayInterruptPvt;
+    asynInterface                   asynInt32Array;
+    void                           *asynInt32ArrayInterruptPvt;
+    asynInterface                   asynOctet;
+    void                           *asynOctetInterruptPvt;
+#ifdef USBMOUSE_HAVE_INT64
+    asynInterface                   asynInt64;
+    void                           *asynInt64InterruptPvt;
+#endif
+
+    /*
+     * Control diagnostic messages
+     */
+    asynUser                       *pasynUserForMessages;
+
+    /*
+     * Device information
+     */
+    int                             idVendor;
+    int                             idProduct;
+    int                             idNumber;
+    char                           *manufacturerString;
+    char                           *productString;
+    char                           *serialNumberString;
+    int                             HIDreportLength;
+    unsigned char                  *HIDreport;
+    int                             usesReportIds;
+
+    /*
+     * libusb-1.0, through the core library
+     */
+    usbMouseDevice                  usbDevice;
+    int                             isConnected;
+
+    /*
+     * Transport
+     */
+    const usbMouseTransport        *transport;
+    char                           *transportArgs;
+    void                           *transportPvt;
+    char                           *deviceNode;
+    int                             fd;
+
+    /*
+     * Processing pipeline
+     */
+    usbMouseStage                  *pipeline;
+
+    /*
+     * Event loop pool -- 'loop' is the thread now reading the port and
+     * 'loopNext' the one it is to be handed to.  Port CPU time is in ns.
+     */
+    struct usbMouseLoop            *loop;
+    struct usbMouseLoop            *loopNext;
+    epicsUInt64                     loopCpuLast;
+    double                          loopLoad;
+    double                          loopLastConnect;
+
+    /*
+     * Reader thread info
+     */
+    usbMouseClock                  *clock;
+    int                             priority;
+    double                          pollInterval;
+    int                             useDevicePollInterval;
+    double                          resyncInterval;
+
+    /*
+     * Written for every report by the thread reading the device
+     * (and by the decode stage, which normally runs inline)
+     */
+    unsigned char                   cbuf[USBMOUSE_REPORT_SIZE] USBMOUSE_CACHELINE_ALIGNED;
+    int                             nRead;
+    unsigned long                   packetCount;
+    epicsUInt64                     loopCpu;
+    mouseValues                     newMouse;
+    usbMouseSample                  sample;
+    epicsTimeStamp                  resyncTime;
+    unsigned long                   resyncCount;
+    unsigned long                   resyncErrors;
+    epicsInt32                      resyncDiscrepancies;
+    usbMouseSample                 *batch;
+    int                             batchCount;
+    int                             batchListed;
+    struct drvPvt                  *batchNext;
+
+    /*
+     * Written for every sample by the thread running the publish stage
+     */
+    usbMouseSample                  oldSample USBMOUSE_CACHELINE_ALIGNED;
+    int                             transferDone;
+} drvPvt;
+
+/*
+ * usbMouse.c
+ */
+void usbMouseConfigure(const char *portName, int idVendor, int idProduct,
+                       int idNumber, int interval, int priority,
+                       const char *transportSpec);
+drvPvt *usbMouseFindPort(const char *portName);
+drvPvt *usbMousePortList(void);
+int usbMouseFieldFind(const char *name);
+void *usbMouseCallocAligned(size_t size, const char *errorMessage);
+void usbMouseReplaceString(char **cpp, const char *value);
+void usbMouseHandleReport(drvPvt *pdpvt, int nRead);
+void usbMouseResyncCheck(drvPvt *pdpvt);
+typedef struct usbMouseBatch {
+    drvPvt         *first;
+    drvPvt         *last;
+    int             nPorts;
+    unsigned long   nSamples;
+} usbMouseBatch;
+void usbMouseBatchBegin(usbMouseBatch *batch);
+void usbMouseBatchEnd(usbMouseBatch *batch);
+void usbMousePublishInt32(drvPvt *pdpvt, int addr, epicsInt32 value,
+                          const epicsTimeStamp *time);
+void usbMousePublishFloat64(drvPvt *pdpvt, int addr, epicsFloat64 value,
+                            const epicsTimeStamp *time);
+void usbMousePublishInt32Array(drvPvt *pdpvt, int addr, epicsInt32 *value,
+                               size_t nElements, const epicsTimeStamp *time);
+void usbMousePublishString(drvPvt *pdpvt, int addr, const char *value,
+                           const epicsTimeStamp *time);
+#ifdef USBMOUSE_HAVE_INT64
+void usbMousePublishInt64(drvPvt *pdpvt, int addr, epicsInt64 value,
+                          const epicsTimeStamp *time);
+#endif
+extern const usbMouseStageType usbMouseDecodeStage;
+extern const usbMouseStageType usbMousePublishStage;
+extern const usbMouseStageType usbMouseRawStage;
+
+/*
+ * usbMouseClock.c
+ */
+usbMouseClock *usbMouseClockReal(void);
+usbMouseClock *usbMouseClockVirtual(double start);
+
+/*
+ * usbMouseJog.c
+ */
+extern const usbMouseStageType usbMouseJogStage;
+
+/*
+ * usbMouseSimplify.c
+ */
+extern const usbMouseStageType usbMouseSimplifyStage;
+
+/*
+ * usbMouseHistogram.c
+ */
+extern const usbMouseStageType usbMouseHistogramStage;
+
+/*
+ * usbMouseCapture.c
+ */
+extern const usbMouseStageType usbMouseCaptureStage;
+
+/*
+ * usbMouseEncoder.c
+ */
+extern const usbMouseStageType usbMouseEncoderStage;
+
+/*
+ * usbMouseLatch.c
+ */
+extern const usbMouseStageType usbMouseLatchStage;
+
+/*
+ * devUsbMouse.c
+ */
+extern const usbMouseStageType usbMouseNativeStage;
+
+/*
+ * usbMouseSim.c
+ */
+extern const usbMouseTransport usbMouseSimTransport;
+
+/*
+ * usbMouseReplay.c
+ */
+extern const usbMouseTransport usbMouseReplayTransport;
+
+/*
+ * usbMousePipeline.c
+ */
+asynStatus usbMouseStageAdd(drvPvt *pdpvt, const char *typeName,
+                            int queueSize, const char *args);
+void usbMousePipelineDefault(drvPvt *pdpvt);
+void usbMousePipelineRun(usbMouseStage *stage, usbMouseSample *sample);
+void usbMousePipelineReport(drvPvt *pdpvt, FILE *fp, int details);
+asynStatus usbMousePipelineWrite(drvPvt *pdpvt, int addr, double value);
+asynStatus usbMousePipelineWriteString(drvPvt *pdpvt, int addr,
+                                       const char *value);
+double usbMouseArgDouble(const char *args, const char *key, double defaultValue);
+int usbMouseArgInt(const char *args, const char *key, int defaultValue);
+void usbMouseArgString(const char *args, const char *key,
+                       const char *defaultValue, char *buf, size_t size);
+const char *usbMouseParseDecimal(const char *cp, epicsInt64 *num,
+                                 epicsInt64 *den);
+
+/*
+ * usbMouseDiscovery.c
+ */
+int usbMouseDiscoveryFind(int idVendor, int idProduct, libusb_device **device,
+                          usbMouseDeviceInfo *info);
+
+#ifdef __linux__
+/*
+ * usbMouseLinux.c
+ */
+extern const usbMouseTransport usbMouseHidrawTransport;
+extern const usbMouseTransport usbMouseEvdevTransport;
+
+/*
+ * usbMouseLoop.c
+ */
+asynStatus usbMouseLoopAdd(drvPvt *pdpvt);
+void usbMouseLoopReport(drvPvt *pdpvt, FILE *fp, int details);
+void usbMouseLoop_RegisterCommands(void);
+
+/*
+ * usbMouseBench.c
+ */
+extern const unsigned char usbMouseBootReportDescriptor[];
+extern const int usbMouseBootReportDescriptorSize;
+void usbMouseBench_RegisterCommands(void);
+
+/*
+ * usbMouseGadget.c
+ */
+int usbMouseGadgetCreate(int idVendor, int idProduct, const char *udc);
+int usbMouseGadgetInject(const unsigned char *report, int size);
+void usbMouseGadget_RegisterCommands(void);
+
+/*
+ * usbMousePower.c
+ */
+void usbMousePowerApply(void);
+void usbMousePower_RegisterCommands(void);
+#endif
+
+#endif /* INC_usbMousePvt_H */
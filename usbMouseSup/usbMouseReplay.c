@@ -0,0 +1,262 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Replay transport -- play back an evemu-record capture
+ *
+ * The recording is read when the port first connects.  Relative motion,
+ * button and absolute X/Y events up to each SYN_REPORT form one report,
+ * in the same layout as the evdev transport's.  Reports are paced on the
+ * port's clock by the recorded event times divided by the speed, so on
+ * a virtual clock the samples carry the recording's own timeline.
+ * Nothing is produced until iocInit.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+/*
+ * Linux input event types and codes used in evemu recordings
+ */
+#define EV_SYN          0x00
+#define EV_KEY          0x01
+#define EV_REL          0x02
+#define EV_ABS          0x03
+#define SYN_REPORT      0
+#define SYN_DROPPED     3
+#define REL_X           0x00
+#define REL_Y           0x01
+#define REL_WHEEL       0x08
+#define ABS_X           0x00
+#define ABS_Y           0x01
+#define BTN_MOUSE       0x110
+#define BTN_TOUCH       0x14a
+
+typedef struct replayEvent {
+    double          time;
+    unsigned short  type;
+    unsigned short  code;
+    int             value;
+} replayEvent;
+
+typedef struct replayPvt {
+    char            fileName[256];
+    double          speed;
+    int             loop;
+    replayEvent    *events;
+    int             nEvents;
+    int             nextEvent;
+    int             dropped;
+    int             buttons;
+    int             dx;
+    int             dy;
+    int             dWheel;
+    int             haveAbs[2];
+    int             abs[2];
+    int             haveReported;
+    double          lastTime;
+} replayPvt;
+
+/*
+ * Read the events and the device name from a recording
+ */
+static int
+readRecording(drvPvt *pdpvt, replayPvt *pvt)
+{
+    FILE *fp;
+    char line[512];
+    int size = 0, lineNumber = 0;
+
+    if ((fp = fopen(pvt->fileName, "r")) == NULL) {
+        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                                    "Can't open \"%s\".\n", pvt->fileName);
+        return -1;
+    }
+    usbMouseReplaceString(&pdpvt->manufacturerString, "???");
+    usbMouseReplaceString(&pdpvt->productString, pvt->fileName);
+    usbMouseReplaceString(&pdpvt->serialNumberString, "???");
+    while (fgets(line, sizeof line, fp) != NULL) {
+        replayEvent *ev;
+        unsigned int type, code;
+        int value;
+        double t;
+
+        lineNumber++;
+        if (strncmp(line, "N: ", 3) == 0) {
+            line[strcspn(line, "\r\n")] = '\0';
+            usbMouseReplaceString(&pdpvt->productString, line + 3);
+            continue;
+        }
+        if (strncmp(line, "E: ", 3) != 0)
+            continue;
+        if (sscanf(line + 3, "%lf %x %x %d", &t, &type, &code, &value) != 4) {
+            asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                    "%s line %d: bad event line.\n", pvt->fileName, lineNumber);
+            continue;
+        }
+        if (pvt->nEvents >= size) {
+            size = size ? size * 2 : 1024;
+            pvt->events = realloc(pvt->events, size * sizeof *pvt->events);
+            if (pvt->events == NULL)
+                cantProceed("readRecording");
+        }
+        ev = &pvt->events[pvt->nEvents++];
+        ev->time = t;
+        ev->type = type;
+        ev->code = code;
+        ev->value = value;
+    }
+    fclose(fp);
+    if (pvt->nEvents == 0) {
+        asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                                "No events in \"%s\".\n", pvt->fileName);
+        return -1;
+    }
+    return 0;
+}
+
+static asynStatus
+replayConnect(drvPvt *pdpvt)
+{
+    replayPvt *pvt = pdpvt->transportPvt;
+
+    if (pvt == NULL) {
+        pvt = callocMustSucceed(1, sizeof *pvt, "replayConnect");
+        usbMouseArgString(pdpvt->transportArgs, "file", "", pvt->fileName,
+                                                        sizeof pvt->fileName);
+        pvt->speed = usbMouseArgDouble(pdpvt->transportArgs, "speed", 1.0);
+        pvt->loop = usbMouseArgInt(pdpvt->transportArgs, "loop", 0);
+        pdpvt->transportPvt = pvt;
+    }
+    if (pvt->events == NULL) {
+        if (pvt->fileName[0] == '\0') {
+            asynPrint(pdpvt->pasynUserForMessages, ASYN_TRACE_ERROR,
+                                    "replay transport needs file=<path>.\n");
+            return asynError;
+        }
+        if (readRecording(pdpvt, pvt) != 0) {
+            free(pvt->events);
+            pvt->events = NULL;
+            pvt->nEvents = 0;
+            return asynError;
+        }
+    }
+    pdpvt->transferDone = 0;
+    pdpvt->isConnected = 1;
+    return asynSuccess;
+}
+
+/*
+ * Absolute positions become motion relative to the last one seen
+ */
+static void
+absEvent(replayPvt *pvt, int axis, int value)
+{
+    if (pvt->haveAbs[axis]) {
+        if (axis == 0)
+            pvt->dx += value - pvt->abs[axis];
+        else
+            pvt->dy += value - pvt->abs[axis];
+    }
+    pvt->haveAbs[axis] = 1;
+    pvt->abs[axis] = value;
+}
+
+/*
+ * Gather events up to the next SYN_REPORT into one report
+ */
+static int
+replayRead(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    replayPvt *pvt = pdpvt->transportPvt;
+    int s;
+    extern volatile int interruptAccept;
+
+    if (size < USBMOUSE_EVENT_REPORT_SIZE)
+        return -1;
+    if (!interruptAccept) {
+        epicsThreadSleep(0.1);
+        return 0;
+    }
+    for (;;) {
+        replayEvent *ev;
+
+        if (pvt->nextEvent >= pvt->nEvents) {
+            if (!pvt->loop) {
+                pdpvt->clock->advance(pdpvt->clock, 0.1);
+                return 0;
+            }
+            pvt->nextEvent = 0;
+            pvt->haveReported = 0;
+            pvt->haveAbs[0] = pvt->haveAbs[1] = 0;
+        }
+        ev = &pvt->events[pvt->nextEvent++];
+        switch (ev->type) {
+        case EV_REL:
+            switch (ev->code) {
+            case REL_X:     pvt->dx += ev->value;       break;
+            case REL_Y:     pvt->dy += ev->value;       break;
+            case REL_WHEEL: pvt->dWheel += ev->value;   break;
+            }
+            break;
+
+        case EV_ABS:
+            if ((ev->code == ABS_X) || (ev->code == ABS_Y))
+                absEvent(pvt, ev->code - ABS_X, ev->value);
+            break;
+
+        case EV_KEY:
+            if ((ev->code == BTN_TOUCH)
+             || ((ev->code >= BTN_MOUSE) && (ev->code < BTN_MOUSE + 8))) {
+                int bit = ev->code == BTN_TOUCH ? 0x1 : 1 << (ev->code - BTN_MOUSE);
+                if (ev->value)
+                    pvt->buttons |= bit;
+                else
+                    pvt->buttons &= ~bit;
+            }
+            break;
+
+        case EV_SYN:
+            if (ev->code == SYN_DROPPED) {
+                pvt->dropped = 1;
+            }
+            else if (ev->code == SYN_REPORT) {
+                if (pvt->dropped) {
+                    pvt->dropped = 0;
+                    pvt->dx = pvt->dy = pvt->dWheel = 0;
+                    break;
+                }
+                if (pvt->haveReported && (pvt->speed > 0)) {
+                    double delay = (ev->time - pvt->lastTime) / pvt->speed;
+                    if (delay > 0)
+                        pdpvt->clock->advance(pdpvt->clock, delay);
+                }
+                pvt->haveReported = 1;
+                pvt->lastTime = ev->time;
+                s = usbMouseEncodeEvents(buf, pvt->buttons, pvt->dx, pvt->dy,
+                                                                pvt->dWheel);
+                pvt->dx = pvt->dy = pvt->dWheel = 0;
+                return s;
+            }
+            break;
+        }
+    }
+}
+
+static void
+replayDisconnect(drvPvt *pdpvt)
+{
+}
+
+const usbMouseTransport usbMouseReplayTransport = {
+    "replay", 0, replayConnect, replayRead, replayDisconnect, usbMouseDecodeEvents
+};
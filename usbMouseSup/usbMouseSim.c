@@ -0,0 +1,120 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Simulated mouse transport
+ *
+ * Produces boot protocol reports that move the mouse around a circle,
+ * with button 0 held for the first quarter of each revolution and one
+ * wheel click per revolution.  Reports are polled at the port's poll
+ * interval on the port's clock, and nothing is produced until iocInit,
+ * so runs on a virtual clock are repeatable.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <epicsThread.h>
+#include <epicsString.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct simPvt {
+    int             radius;
+    int             period;
+    unsigned long   count;
+    unsigned long   step;
+    int             x;
+    int             y;
+    int             carryX;
+    int             carryY;
+} simPvt;
+
+static asynStatus
+simConnect(drvPvt *pdpvt)
+{
+    simPvt *pvt = pdpvt->transportPvt;
+
+    if (pvt == NULL) {
+        pvt = callocMustSucceed(1, sizeof *pvt, "simConnect");
+        pvt->radius = usbMouseArgInt(pdpvt->transportArgs, "radius", 100);
+        pvt->period = usbMouseArgInt(pdpvt->transportArgs, "period", 1000);
+        pvt->count = usbMouseArgInt(pdpvt->transportArgs, "count", 0);
+        if (pvt->period < 1)
+            pvt->period = 1;
+        pvt->x = pvt->radius;
+        pdpvt->transportPvt = pvt;
+    }
+    if (pdpvt->useDevicePollInterval)
+        pdpvt->pollInterval = 0.008;
+    if (pdpvt->productString == NULL) {
+        pdpvt->manufacturerString = epicsStrDup("???");
+        pdpvt->productString = epicsStrDup("Simulated mouse");
+        pdpvt->serialNumberString = epicsStrDup("???");
+    }
+    pdpvt->transferDone = 0;
+    pdpvt->isConnected = 1;
+    return asynSuccess;
+}
+
+static int
+clampCarry(int *carry)
+{
+    int d = *carry;
+
+    if (d > 127) d = 127;
+    if (d < -127) d = -127;
+    *carry -= d;
+    return d;
+}
+
+static int
+simRead(drvPvt *pdpvt, unsigned char *buf, int size)
+{
+    simPvt *pvt = pdpvt->transportPvt;
+    double angle;
+    int x, y, phase;
+    extern volatile int interruptAccept;
+
+    if (!interruptAccept) {
+        epicsThreadSleep(0.1);
+        return 0;
+    }
+    if ((pvt->count != 0) && (pvt->step >= pvt->count)) {
+        pdpvt->clock->advance(pdpvt->clock, 0.1);
+        return 0;
+    }
+    if (size < 4)
+        return -1;
+    pvt->step++;
+    phase = pvt->step % pvt->period;
+    angle = 2 * M_PI * phase / pvt->period;
+    x = (int)floor(pvt->radius * cos(angle) + 0.5);
+    y = (int)floor(pvt->radius * sin(angle) + 0.5);
+    pvt->carryX += x - pvt->x;
+    pvt->carryY += y - pvt->y;
+    pvt->x = x;
+    pvt->y = y;
+    buf[0] = (phase < pvt->period / 4) ? 0x1 : 0x0;
+    buf[1] = clampCarry(&pvt->carryX);
+    buf[2] = clampCarry(&pvt->carryY);
+    buf[3] = (phase == 0) ? 1 : 0;
+    return 4;
+}
+
+static void
+simDisconnect(drvPvt *pdpvt)
+{
+}
+
+const usbMouseTransport usbMouseSimTransport = {
+    "sim", 1, simConnect, simRead, simDisconnect, usbMouseDecodeBoot
+};
@@ -0,0 +1,216 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Simplify stage -- publish only the vertices of the X/Y path
+ *
+ * Uses the sleeve (cone intersection) method: from the last vertex
+ * published, each later point narrows the cone of directions in which
+ * a straight line passes within the tolerance of every point so far.
+ * When a point falls outside the cone, the point before it becomes the
+ * next vertex.  Each point costs a constant amount of work.
+ *
+ * A point is never held back longer than the latency limit.  A thread
+ * of the stage's own publishes the last point once the mouse has been
+ * still for that long, so the path always ends where the mouse stopped.
+ */
+
+#include <math.h>
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <cantProceed.h>
+
+#include "usbMousePvt.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct simplifyPoint {
+    int             x;
+    int             y;
+    epicsTimeStamp  time;
+} simplifyPoint;
+
+typedef struct simplifyPvt {
+    drvPvt         *pdpvt;
+    epicsMutexId    lock;
+    double          tolerance;
+    double          latency;
+    int             haveAnchor;
+    simplifyPoint   anchor;
+    int             havePending;
+    simplifyPoint   pending;
+    int             haveCone;
+    double          coneLow;
+    double          coneHigh;
+    epicsInt32      vertexCount;
+    unsigned long   pointCount;
+} simplifyPvt;
+
+static void
+emit(simplifyPvt *pvt, const simplifyPoint *p)
+{
+    pvt->vertexCount++;
+    usbMousePublishInt32(pvt->pdpvt, USBMOUSE_ADDR_VERTEX_X, p->x, &p->time);
+    usbMousePublishInt32(pvt->pdpvt, USBMOUSE_ADDR_VERTEX_Y, p->y, &p->time);
+    usbMousePublishInt32(pvt->pdpvt, USBMOUSE_ADDR_VERTEX_COUNT,
+                                                    pvt->vertexCount, &p->time);
+    pvt->anchor = *p;
+    pvt->haveAnchor = 1;
+    pvt->havePending = 0;
+    pvt->haveCone = 0;
+}
+
+/*
+ * Narrow the cone by the directions from the anchor that pass within
+ * the tolerance of a point.  Returns 0 if the point is outside the cone.
+ */
+static int
+narrowCone(simplifyPvt *pvt, const simplifyPoint *p)
+{
+    double dx = p->x - pvt->anchor.x;
+    double dy = p->y - pvt->anchor.y;
+    double d = sqrt(dx * dx + dy * dy);
+    double theta, halfWidth, low, high;
+
+    if (d <= pvt->tolerance)
+        return 1;
+    theta = atan2(dy, dx);
+    halfWidth = asin(pvt->tolerance / d);
+    if (!pvt->haveCone) {
+        pvt->coneLow = theta - halfWidth;
+        pvt->coneHigh = theta + halfWidth;
+        pvt->haveCone = 1;
+        return 1;
+    }
+
+    /*
+     * Work relative to the cone's low edge to keep clear of the wrap
+     */
+    theta = pvt->coneLow + remainder(theta - pvt->coneLow, 2 * M_PI);
+    if ((theta < pvt->coneLow) || (theta > pvt->coneHigh))
+        return 0;
+    low = theta - halfWidth;
+    high = theta + halfWidth;
+    if (low > pvt->coneLow) pvt->coneLow = low;
+    if (high < pvt->coneHigh) pvt->coneHigh = high;
+    return 1;
+}
+
+static void
+addPoint(simplifyPvt *pvt, const simplifyPoint *p)
+{
+    if (!pvt->haveAnchor) {
+        emit(pvt, p);
+        return;
+    }
+    if (pvt->havePending
+     && ((epicsTimeDiffInSeconds(&p->time, &pvt->anchor.time) > pvt->latency)
+      || !narrowCone(pvt, p))) {
+        simplifyPoint v = pvt->pending;
+        emit(pvt, &v);
+        narrowCone(pvt, p);
+    }
+    else if (!pvt->havePending) {
+        narrowCone(pvt, p);
+    }
+    pvt->pending = *p;
+    pvt->havePending = 1;
+}
+
+static void
+flushThread(void *arg)
+{
+    simplifyPvt *pvt = arg;
+    drvPvt *pdpvt = pvt->pdpvt;
+    epicsTimeStamp now;
+
+    for (;;) {
+        pdpvt->clock->sleep(pdpvt->clock, pvt->latency / 2);
+        pdpvt->clock->now(pdpvt->clock, &now);
+        epicsMutexMustLock(pvt->lock);
+        if (pvt->havePending
+         && (epicsTimeDiffInSeconds(&now, &pvt->pending.time) >= pvt->latency)) {
+            simplifyPoint v = pvt->pending;
+            emit(pvt, &v);
+        }
+        epicsMutexUnlock(pvt->lock);
+    }
+}
+
+static void *
+simplifyCreate(drvPvt *pdpvt, const char *args)
+{
+    simplifyPvt *pvt;
+    double tolerance = usbMouseArgDouble(args, "tolerance", 1.0);
+    double latency = usbMouseArgDouble(args, "latency", 1.0);
+    char threadName[40];
+
+    if ((tolerance <= 0) || (latency <= 0)) {
+        printf("simplify stage tolerance and latency must be positive\n");
+        return NULL;
+    }
+    pvt = callocMustSucceed(1, sizeof *pvt, "simplifyCreate");
+    pvt->pdpvt = pdpvt;
+    pvt->lock = epicsMutexMustCreate();
+    pvt->tolerance = tolerance;
+    pvt->latency = latency;
+    epicsSnprintf(threadName, sizeof threadName, "%s_SIMPLIFY", pdpvt->portName);
+    if (epicsThreadCreate(threadName,
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackSmall),
+                          flushThread,
+                          pvt) == NULL) {
+        printf("Can't set up %s thread!\n", threadName);
+        return NULL;
+    }
+    return pvt;
+}
+
+static int
+simplifyProcess(void *arg, usbMouseSample *sample)
+{
+    simplifyPvt *pvt = arg;
+    simplifyPoint p;
+
+    p.x = sample->values.xPosition;
+    p.y = sample->values.yPosition;
+    p.time = sample->time;
+    epicsMutexMustLock(pvt->lock);
+    pvt->pointCount++;
+    if (!pvt->haveAnchor) {
+        addPoint(pvt, &p);
+    }
+    else {
+        const simplifyPoint *last = pvt->havePending ? &pvt->pending
+                                                     : &pvt->anchor;
+        if ((p.x != last->x) || (p.y != last->y))
+            addPoint(pvt, &p);
+    }
+    epicsMutexUnlock(pvt->lock);
+    return 1;
+}
+
+static void
+simplifyReport(void *arg, FILE *fp, int details)
+{
+    simplifyPvt *pvt = arg;
+
+    epicsMutexMustLock(pvt->lock);
+    fprintf(fp, "tolerance=%g latency=%g", pvt->tolerance, pvt->latency);
+    if ((details >= 3) && (pvt->pointCount != 0))
+        fprintf(fp, " %d vertices from %lu points", (int)pvt->vertexCount,
+                                                    pvt->pointCount);
+    epicsMutexUnlock(pvt->lock);
+}
+
+const usbMouseStageType usbMouseSimplifyStage = {
+    "simplify", simplifyCreate, simplifyProcess, simplifyReport
+};
@@ -0,0 +1,438 @@
+/****************************************************************************
+ * Copyright (c) 2011 Lawrence Berkeley National Laboratory,                *
+ * Accelerator Technology Group, Engineering Division                       *
+ * This code is distributed subject to a Software License Agreement found   *
+ * in file LICENSE.txt that is included with this distribution.             *
+ ****************************************************************************/
+
+/*
+ * Asynchronous block writer for capture files
+ *
+ * A writer owns a pool of fixed-size blocks, aligned for O_DIRECT.  Its
+ * user fills a block, queues it with the file offset it belongs at and,
+ * once per batch, submits everything queued.  The block comes back to
+ * the pool when the write completes.  When no block is free the user
+ * waits, which is the only place a writer ever blocks its user.
+ *
+ * Built with HAVE_LIBURING a writer submits a batch to an io_uring in
+ * one system call, with the blocks registered as fixed buffers, and a
+ * thread of its own reaps the completions.  Otherwise, or if the ring
+ * can't be set up, a thread of its own writes each batch with pwritev,
+ * one call per run of blocks that are contiguous in the same file.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <epicsStdio.h>
+#include <epicsString.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <cantProceed.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "usbMouseCore.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct writerRequest {
+    int             fd;
+    size_t          length;
+    size_t          done;
+    off_t           offset;
+} writerRequest;
+
+struct usbMouseWriter {
+    char               *name;
+    int                 nBlocks;
+    size_t              blockSize;
+    char               *memory;
+    epicsMutexId        lock;
+    epicsEventId        freed;
+    epicsEventId        submitted;
+
+    /*
+     * Block states -- free, queued by the user, or being written
+     */
+    int                *freeList;
+    int                 nFree;
+    writerRequest      *requests;
+    int                *queued;
+    int                 nQueued;
+    int                *writing;
+    int                 nWriting;
+    int                 inFlight;
+
+    usbMouseWriterStats stats;
+
+#ifdef HAVE_LIBURING
+    int                 useUring;
+    struct io_uring     ring;
+#endif
+};
+
+static void
+blockDone(usbMouseWriter *w, int block, int error)
+{
+    writerRequest *rq = &w->requests[block];
+
+    epicsMutexMustLock(w->lock);
+    if (error) {
+        w->stats.errors++;
+        w->stats.lastError = error;
+        epicsSnprintf(w->stats.message, sizeof w->stats.message,
+                    "write of %lu bytes at %lu failed: %s",
+                    (unsigned long)rq->length, (unsigned long)rq->offset,
+                    strerror(error));
+    }
+    w->freeList[w->nFree++] = block;
+    w->inFlight--;
+    epicsMutexUnlock(w->lock);
+    epicsEventSignal(w->freed);
+}
+
+/*
+ * Fallback -- a thread writing batches with pwritev
+ */
+static void
+pwritevThread(void *arg)
+{
+    usbMouseWriter *w = arg;
+    struct iovec *iov = callocMustSucceed(w->nBlocks, sizeof *iov, w->name);
+    int *batch = callocMustSucceed(w->nBlocks, sizeof *batch, w->name);
+
+    for (;;) {
+        int n, i, j;
+
+        epicsMutexMustLock(w->lock);
+        n = w->nWriting;
+        memcpy(batch, w->writing, n * sizeof *batch);
+        w->nWriting = 0;
+        epicsMutexUnlock(w->lock);
+        if (n == 0) {
+            epicsEventMustWait(w->submitted);
+            continue;
+        }
+        for (i = 0 ; i < n ; i = j) {
+            writerRequest *first = &w->requests[batch[i]];
+            off_t offset = first->offset;
+            int nIov = 0, error = 0;
+            ssize_t s;
+
+            /*
+             * Gather the run of blocks that follow on in the same file
+             */
+            for (j = i ; (j < n) && (nIov < IOV_MAX) ; j++) {
+                writerRequest *rq = &w->requests[batch[j]];
+                if ((rq->fd != first->fd) || (rq->offset != offset))
+                    break;
+                iov[nIov].iov_base = w->memory + batch[j] * w->blockSize;
+                iov[nIov].iov_len = rq->length;
+                offset += rq->length;
+                nIov++;
+            }
+            s = pwritev(first->fd, iov, nIov, first->offset);
+            if (s < 0)
+                error = errno;
+            epicsMutexMustLock(w->lock);
+            w->stats.submits++;
+            if (s > 0)
+                w->stats.bytes += s;
+            epicsMutexUnlock(w->lock);
+
+            /*
+             * Finish a short write a block at a time
+             */
+            for ( ; i < j ; i++) {
+                writerRequest *rq = &w->requests[batch[i]];
+                char *cp = w->memory + batch[i] * w->blockSize;
+                size_t done = 0;
+
+                if (s > 0) {
+                    done = (size_t)s < rq->length ? (size_t)s : rq->length;
+                    s -= done;
+                }
+                while (!error && (done < rq->length)) {
+                    ssize_t r = pwrite(rq->fd, cp + done, rq->length - done,
+                                                            rq->offset + done);
+                    if (r < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        error = errno;
+                        break;
+                    }
+                    done += r;
+                    epicsMutexMustLock(w->lock);
+                    w->stats.bytes += r;
+                    epicsMutexUnlock(w->lock);
+                }
+                blockDone(w, batch[i], error);
+            }
+        }
+    }
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * Queue the unwritten part of a block on the ring -- called with the lock held
+ */
+static void
+uringPrepare(usbMouseWriter *w, int block)
+{
+    writerRequest *rq = &w->requests[block];
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+
+    io_uring_prep_write_fixed(sqe, rq->fd,
+                              w->memory + block * w->blockSize + rq->done,
+                              rq->length - rq->done, rq->offset + rq->done,
+                              block);
+    io_uring_sqe_set_data(sqe, (void *)(long)block);
+}
+
+static void
+uringReaper(void *arg)
+{
+    usbMouseWriter *w = arg;
+    struct io_uring_cqe *cqe;
+
+    for (;;) {
+        int block, res, s;
+        writerRequest *rq;
+
+        s = io_uring_wait_cqe(&w->ring, &cqe);
+        if (s < 0) {
+            if (s == -EINTR)
+                continue;
+            epicsMutexMustLock(w->lock);
+            w->stats.errors++;
+            w->stats.lastError = -s;
+            epicsSnprintf(w->stats.message, sizeof w->stats.message,
+                    "io_uring_wait_cqe failed: %s", strerror(-s));
+            epicsMutexUnlock(w->lock);
+            return;
+        }
+        block = (int)(long)io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&w->ring, cqe);
+        rq = &w->requests[block];
+        if (res > 0) {
+            epicsMutexMustLock(w->lock);
+            w->stats.bytes += res;
+            rq->done += res;
+            if (rq->done < rq->length) {
+                uringPrepare(w, block);
+                io_uring_submit(&w->ring);
+                w->stats.submits++;
+                epicsMutexUnlock(w->lock);
+                continue;
+            }
+            epicsMutexUnlock(w->lock);
+        }
+        blockDone(w, block, res < 0 ? -res : res == 0 ? EIO : 0);
+    }
+}
+
+static int
+uringSetup(usbMouseWriter *w)
+{
+    struct iovec *iov;
+    int s, i;
+
+    if ((s = io_uring_queue_init(w->nBlocks, &w->ring, 0)) < 0) {
+        epicsSnprintf(w->stats.message, sizeof w->stats.message,
+                    "io_uring unavailable (%s) -- using pwritev", strerror(-s));
+        return -1;
+    }
+    iov = callocMustSucceed(w->nBlocks, sizeof *iov, w->name);
+    for (i = 0 ; i < w->nBlocks ; i++) {
+        iov[i].iov_base = w->memory + i * w->blockSize;
+        iov[i].iov_len = w->blockSize;
+    }
+    s = io_uring_register_buffers(&w->ring, iov, w->nBlocks);
+    free(iov);
+    if (s < 0) {
+        epicsSnprintf(w->stats.message, sizeof w->stats.message,
+                    "can't register buffers (%s) -- using pwritev", strerror(-s));
+        io_uring_queue_exit(&w->ring);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Create a writer.  Returns NULL, with a description in errorMessage,
+ * if it can't be set up.
+ */
+usbMouseWriter *
+usbMouseWriterCreate(const char *name, int nBlocks, size_t blockSize,
+                     int useUring, char *errorMessage, size_t errorSize)
+{
+    usbMouseWriter *w;
+    char threadName[40];
+    EPICSTHREADFUNC func = pwritevThread;
+    int i;
+
+    if ((nBlocks < 2) || (blockSize == 0) || (blockSize % USBMOUSE_WRITER_ALIGN)) {
+        epicsSnprintf(errorMessage, errorSize,
+                    "%s: need at least 2 blocks of a multiple of %d bytes",
+                    name, USBMOUSE_WRITER_ALIGN);
+        return NULL;
+    }
+    w = callocMustSucceed(1, sizeof *w, name);
+    w->name = epicsStrDup(name);
+    w->nBlocks = nBlocks;
+    w->blockSize = blockSize;
+    w->memory = callocMustSucceed(1, nBlocks * blockSize + USBMOUSE_WRITER_ALIGN, name);
+    w->memory += USBMOUSE_WRITER_ALIGN - (size_t)w->memory % USBMOUSE_WRITER_ALIGN;
+    w->lock = epicsMutexMustCreate();
+    w->freed = epicsEventMustCreate(epicsEventEmpty);
+    w->submitted = epicsEventMustCreate(epicsEventEmpty);
+    w->freeList = callocMustSucceed(nBlocks, sizeof *w->freeList, name);
+    w->requests = callocMustSucceed(nBlocks, sizeof *w->requests, name);
+    w->queued = callocMustSucceed(nBlocks, sizeof *w->queued, name);
+    w->writing = callocMustSucceed(nBlocks, sizeof *w->writing, name);
+    for (i = 0 ; i < nBlocks ; i++)
+        w->freeList[i] = nBlocks - 1 - i;
+    w->nFree = nBlocks;
+    w->stats.method = "pwritev";
+#ifdef HAVE_LIBURING
+    if (useUring && (uringSetup(w) == 0)) {
+        w->useUring = 1;
+        w->stats.method = "io_uring";
+        func = uringReaper;
+    }
+#endif
+    epicsSnprintf(threadName, sizeof threadName, "%s_IO", name);
+    if (epicsThreadCreate(threadName,
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackSmall),
+                          func,
+                          w) == NULL) {
+        epicsSnprintf(errorMessage, errorSize, "Can't set up %s thread",
+                                                            threadName);
+        return NULL;
+    }
+    return w;
+}
+
+/*
+ * Get an empty block, waiting for one if all are in use.  Blocks
+ * queued but not yet submitted are submitted first, or none might
+ * ever come free.
+ */
+char *
+usbMouseWriterAcquire(usbMouseWriter *w)
+{
+    int block;
+
+    epicsMutexMustLock(w->lock);
+    if (w->nFree == 0) {
+        epicsTimeStamp t0, t1;
+
+        w->stats.waits++;
+        epicsTimeGetCurrent(&t0);
+        if (w->nQueued) {
+            epicsMutexUnlock(w->lock);
+            usbMouseWriterSubmit(w);
+            epicsMutexMustLock(w->lock);
+        }
+        while (w->nFree == 0) {
+            epicsMutexUnlock(w->lock);
+            epicsEventMustWait(w->freed);
+            epicsMutexMustLock(w->lock);
+        }
+        epicsTimeGetCurrent(&t1);
+        w->stats.waitTime += epicsTimeDiffInSeconds(&t1, &t0);
+    }
+    block = w->freeList[--w->nFree];
+    epicsMutexUnlock(w->lock);
+    return w->memory + block * w->blockSize;
+}
+
+/*
+ * Queue a filled block for writing at the given offset
+ */
+void
+usbMouseWriterQueue(usbMouseWriter *w, int fd, char *data, size_t length,
+                    off_t offset)
+{
+    int block = (data - w->memory) / w->blockSize;
+    writerRequest *rq = &w->requests[block];
+
+    rq->fd = fd;
+    rq->length = length;
+    rq->done = 0;
+    rq->offset = offset;
+    epicsMutexMustLock(w->lock);
+    w->queued[w->nQueued++] = block;
+    w->inFlight++;
+    w->stats.blocks++;
+    epicsMutexUnlock(w->lock);
+}
+
+/*
+ * Start writing everything queued
+ */
+void
+usbMouseWriterSubmit(usbMouseWriter *w)
+{
+    int i;
+
+    epicsMutexMustLock(w->lock);
+    if (w->nQueued == 0) {
+        epicsMutexUnlock(w->lock);
+        return;
+    }
+#ifdef HAVE_LIBURING
+    if (w->useUring) {
+        for (i = 0 ; i < w->nQueued ; i++)
+            uringPrepare(w, w->queued[i]);
+        w->nQueued = 0;
+        io_uring_submit(&w->ring);
+        w->stats.submits++;
+        epicsMutexUnlock(w->lock);
+        return;
+    }
+#endif
+    for (i = 0 ; i < w->nQueued ; i++)
+        w->writing[w->nWriting++] = w->queued[i];
+    w->nQueued = 0;
+    epicsMutexUnlock(w->lock);
+    epicsEventSignal(w->submitted);
+}
+
+/*
+ * Submit everything queued and wait for all writes to finish
+ */
+void
+usbMouseWriterDrain(usbMouseWriter *w)
+{
+    usbMouseWriterSubmit(w);
+    epicsMutexMustLock(w->lock);
+    while (w->inFlight) {
+        epicsMutexUnlock(w->lock);
+        epicsEventMustWait(w->freed);
+        epicsMutexMustLock(w->lock);
+    }
+    epicsMutexUnlock(w->lock);
+}
+
+void
+usbMouseWriterGetStats(usbMouseWriter *w, usbMouseWriterStats *stats)
+{
+    epicsMutexMustLock(w->lock);
+    *stats = w->stats;
+    stats->blocksFree = w->nFree;
+    epicsMutexUnlock(w->lock);
+}